@@ -0,0 +1,681 @@
+/*
+ * agent.cpp - disk state of several hosts in one place
+ *
+ * Copyright (c) 2022 RalfOGit
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * With -A <host:port>, hd-idle reports the state of its disks to a collector
+ * started elsewhere with -C <port>. The agent does no work of its own: after
+ * every pass of the main loop, agent_update() compares the disks with what
+ * was last sent and puts the ones that arrived, left, spun down or up or got
+ * other settings into a single UDP datagram (several if they do not fit into
+ * AGENT_DATAGRAM bytes); a pass without changes sends nothing. Every
+ * AGENT_HEARTBEAT seconds the next pass sends all disks with their counters,
+ * so that a lost datagram or a restarted collector is caught up. The
+ * datagrams are text; <run> tells the runs of an agent apart, <seq> counts
+ * the datagrams of a run:
+ *
+ *   hd-idle <host> <run> <seq> [full]
+ *   disk <name> serial=<serial> down=<0|1> idle=<s> last_io=<time> spindowns=<n> spinups=<n> reads=<n> writes=<n>
+ *   gone <name>
+ *   bye
+ *
+ * The collector keeps the disks of all hosts, prints their changes and a
+ * summary of the fleet, and reports hosts that have sent nothing for three
+ * heartbeats. Given -f <file>, it sends the lines of the file ("policy
+ * <line>") to every host when the host first reports, with each of its
+ * heartbeats and whenever the file has been changed. The agent takes only
+ * those from the address given with -A and applies them like the lines of
+ * its own -f file (config.cpp), so a local reload overrides them until the
+ * next push.
+ *
+ * The datagrams are plain UDP, so anyone on the path can forge them. The
+ * disk reports only feed the collector's output, but pushed policy changes
+ * the idle times of the agents; so it is applied only if the agent has been
+ * given the same key file with -K as the collector, and each policy datagram
+ * starts with
+ *
+ *   hd-idle-policy <host> <counter> <hmac>
+ *
+ * where <hmac> is the HMAC-SHA256 (hex) with the key of the rest of the
+ * datagram, after "<host> <counter>\n". An agent takes only datagrams for its
+ * own host name, with a counter above the latest one it has taken; the
+ * counter starts from the time the collector started, so a restarted
+ * collector continues above it. The collector does not push without -K.
+ */
+
+#include "hd-idle.h"
+#include <ws2tcpip.h>
+#include <bcrypt.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "bcrypt.lib")
+
+#define AGENT_DATAGRAM      1400    /* bytes; stays below the path mtu */
+#define AGENT_HEARTBEAT     300     /* s between full updates */
+#define COLLECTOR_HOSTS     64
+#define COLLECTOR_DISKS     32      /* per host */
+#define COLLECTOR_CHECK     60000   /* ms between checks for silent hosts */
+#define POLICY_KEY_SIZE     256     /* bytes of the -K key file that are used */
+#define POLICY_MAC_SIZE     32      /* HMAC-SHA256 */
+#define POLICY_HEADER_SIZE  192     /* room for the hd-idle-policy line */
+
+/* what has last been sent for a disk, indexed by drive number */
+typedef struct AGENT_SENT {
+    unsigned int       known : 1;
+    unsigned int       spun_down : 1;
+    int                idle_time;
+    unsigned int       spindowns;
+    unsigned int       spinups;
+    char               name[24];
+} AGENT_SENT;
+
+static SOCKET             agent_socket = INVALID_SOCKET;
+static WSAEVENT           agent_event = NULL;
+static struct sockaddr_in agent_addr;                   /* of the collector */
+static char               agent_host[MAX_COMPUTERNAME_LENGTH + 1];
+static unsigned long      agent_run;
+static unsigned long      agent_seq = 0;
+static ULONGLONG          agent_heartbeat_at = 0;
+static AGENT_SENT         agent_sent[MAX_DISKS];
+static char               agent_buf[AGENT_DATAGRAM];
+static size_t             agent_len = 0;
+static size_t             agent_header = 0;             /* length of the header line in agent_buf */
+
+/* the disks of a host as last reported */
+typedef struct COLLECTOR_DISK {
+    char               name[24];
+    char               serial[64];
+    int                down;
+    int                idle_time;
+    long long          last_io;
+    unsigned int       spindowns;
+    unsigned int       spinups;
+    unsigned int       reads;
+    unsigned int       writes;
+} COLLECTOR_DISK;
+
+typedef struct COLLECTOR_HOST {
+    char               name[64];
+    struct sockaddr_in addr;    /* the datagrams came from here */
+    unsigned long      run;     /* of the agent; its seq starts over with a new one */
+    unsigned long      seq;
+    ULONGLONG          seen;    /* GetTickCount64() time of the latest datagram */
+    int                silent;
+    unsigned int       pushed;  /* config_loads at the latest push */
+    int                ndisks;
+    COLLECTOR_DISK     disks[COLLECTOR_DISKS];
+} COLLECTOR_HOST;
+
+static COLLECTOR_HOST     collector_hosts[COLLECTOR_HOSTS];
+static int                collector_nhosts = 0;
+static const char        *collector_policy = NULL;      /* -f file, NULL if none */
+static unsigned long long collector_counter = 0;        /* of the latest policy datagram */
+
+static unsigned char      policy_key[POLICY_KEY_SIZE];  /* -K */
+static DWORD              policy_key_len = 0;           /* 0 without -K */
+static unsigned long long agent_policy_counter = 0;     /* of the latest policy datagram taken */
+static bool               agent_policy_warned = false;
+
+/* create a non-blocking UDP socket bound to the given local port (0 for any)
+ * whose datagrams signal event; returns INVALID_SOCKET on failure */
+static SOCKET udp_open(int port, WSAEVENT *event)
+{
+    struct sockaddr_in addr;
+    WSADATA wsa;
+    SOCKET s;
+
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        return INVALID_SOCKET;
+    }
+    if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+    memset(&addr, 0x00, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        dprintf("agent: cannot bind port %d; error %d\n", port, WSAGetLastError());
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+
+    /* also makes the socket non-blocking */
+    if ((*event = WSACreateEvent()) == NULL || WSAEventSelect(s, *event, FD_READ) != 0) {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+static bool same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+/* read the key that authenticates pushed policy (-K); returns 0 on success */
+int policy_key_open(const char *path)
+{
+    FILE *fp;
+    size_t n;
+
+    if ((fp = fopen(path, "rb")) == NULL) {
+        return -1;
+    }
+    n = fread(policy_key, 1, sizeof(policy_key), fp);
+    fclose(fp);
+    while (n > 0 && (policy_key[n - 1] == '\r' || policy_key[n - 1] == '\n' || policy_key[n - 1] == ' ')) {
+        --n;
+    }
+    if (n < 16) {
+        fprintf(stderr, "error: the key in %s must have at least 16 bytes\n", path);
+        return -1;
+    }
+    policy_key_len = (DWORD)n;
+    return 0;
+}
+
+/* hex HMAC-SHA256 of "<host> <counter>\n" and the body with the -K key; false on failure */
+static bool policy_mac(const char *host, unsigned long long counter, const char *body, size_t len, char hex[2 * POLICY_MAC_SIZE + 1])
+{
+    BCRYPT_ALG_HANDLE alg;
+    BCRYPT_HASH_HANDLE hash;
+    unsigned char mac[POLICY_MAC_SIZE];
+    char prefix[128];
+    int n = snprintf(prefix, sizeof(prefix), "%s %llu\n", host, counter);
+    bool ok = false;
+
+    if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&alg, BCRYPT_SHA256_ALGORITHM, NULL, BCRYPT_ALG_HANDLE_HMAC_FLAG))) {
+        return false;
+    }
+    if (BCRYPT_SUCCESS(BCryptCreateHash(alg, &hash, NULL, 0, policy_key, policy_key_len, 0))) {
+        ok = BCRYPT_SUCCESS(BCryptHashData(hash, (PUCHAR)prefix, (ULONG)n, 0)) &&
+             BCRYPT_SUCCESS(BCryptHashData(hash, (PUCHAR)body, (ULONG)len, 0)) &&
+             BCRYPT_SUCCESS(BCryptFinishHash(hash, mac, sizeof(mac), 0));
+        BCryptDestroyHash(hash);
+    }
+    BCryptCloseAlgorithmProvider(alg, 0);
+    for (int i = 0; ok && i < POLICY_MAC_SIZE; ++i) {
+        sprintf(hex + 2 * i, "%02x", mac[i]);
+    }
+    return ok;
+}
+
+
+/*
+ * agent
+ */
+
+/* report to the collector at host:port; returns 0 on success */
+int agent_init(const char *spec)
+{
+    struct addrinfo hints, *ai;
+    char host[256];
+    const char *colon;
+    DWORD size = sizeof(agent_host);
+
+    if ((colon = strrchr(spec, ':')) == NULL || colon == spec || (size_t)(colon - spec) >= sizeof(host) || atoi(colon + 1) <= 0) {
+        return -1;
+    }
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+
+    if ((agent_socket = udp_open(0, &agent_event)) == INVALID_SOCKET) {
+        return -1;
+    }
+    memset(&hints, 0x00, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host, colon + 1, &hints, &ai) != 0) {
+        dprintf("agent: cannot resolve %s\n", host);
+        return -1;
+    }
+    memcpy(&agent_addr, ai->ai_addr, sizeof(agent_addr));
+    freeaddrinfo(ai);
+
+    if (!GetComputerNameA(agent_host, &size)) {
+        strcpy(agent_host, "unknown");
+    }
+
+    /* a restarted agent starts a new sequence, which the collector must not take for old datagrams */
+    agent_run = (unsigned long)time(NULL) ^ (GetCurrentProcessId() << 16);
+    return 0;
+}
+
+/* event that is signaled when the collector has sent something, NULL without -A */
+HANDLE agent_handle(void)
+{
+    return agent_event;
+}
+
+static void agent_send(void)
+{
+    if (agent_len > agent_header) {
+        sendto(agent_socket, agent_buf, (int)agent_len, 0, (struct sockaddr*)&agent_addr, sizeof(agent_addr));
+    }
+    agent_len = 0;
+}
+
+static void agent_printf(bool full, const char *fmt, ...)
+{
+    char line[256];
+    va_list va;
+    int n;
+
+    va_start(va, fmt);
+    n = vsnprintf(line, sizeof(line), fmt, va);
+    va_end(va);
+    if (n < 0 || n >= (int)sizeof(line)) {
+        return;
+    }
+    if (agent_len > 0 && agent_len + n > sizeof(agent_buf)) {
+        agent_send();
+    }
+    if (agent_len == 0) {
+        agent_len = agent_header = snprintf(agent_buf, sizeof(agent_buf), "hd-idle %s %lu %lu%s\n", agent_host, agent_run, ++agent_seq, full ? " full" : "");
+    }
+    memcpy(agent_buf + agent_len, line, n);
+    agent_len += n;
+}
+
+/* send the disks that have changed since the previous call; all of them once
+ * a heartbeat is due */
+void agent_update(ULONGLONG now)
+{
+    bool full = now >= agent_heartbeat_at;
+
+    if (agent_socket == INVALID_SOCKET) {
+        return;
+    }
+    for (int i = 0; i < ds_capacity; ++i) {
+        DISKSTATS *ds = &ds_table[i];
+        AGENT_SENT *s = &agent_sent[i];
+
+        if (!ds->in_use || ds->backend == NULL) {
+            if (s->known) {
+                agent_printf(full, "gone %s\n", s->name);
+                s->known = 0;
+            }
+            continue;
+        }
+        if (!full && s->known && s->spun_down == ds->spun_down && s->idle_time == ds->idle_time &&
+            s->spindowns == ds->spindowns && s->spinups == ds->spinups) {
+            continue;
+        }
+        agent_printf(full, "disk %s serial=%s down=%u idle=%d last_io=%lld spindowns=%u spinups=%u reads=%u writes=%u\n",
+                     ds->name + 4, (ds->caps.serial[0] != '\0') ? ds->caps.serial : "-", ds->spun_down, ds->idle_time,
+                     (long long)ds->last_io, ds->spindowns, ds->spinups, ds->reads, ds->writes);
+        s->known = 1;
+        s->spun_down = ds->spun_down;
+        s->idle_time = ds->idle_time;
+        s->spindowns = ds->spindowns;
+        s->spinups = ds->spinups;
+        strncpy(s->name, ds->name + 4, sizeof(s->name) - 1);
+    }
+    if (full) {
+        /* also tells the collector that this host is alive if it has no disks */
+        agent_printf(full, "\n");
+        agent_heartbeat_at = now + AGENT_HEARTBEAT * 1000;
+    }
+    agent_send();
+}
+
+/* apply the policy lines sent by the collector */
+void agent_receive(void)
+{
+    char buf[AGENT_DATAGRAM + 1];
+    struct sockaddr_in from;
+    int fromlen = sizeof(from), n;
+
+    WSAResetEvent(agent_event);
+    while ((n = recvfrom(agent_socket, buf, sizeof(buf) - 1, 0, (struct sockaddr*)&from, &fromlen)) > 0) {
+        char *line, *next;
+
+        char host[64], mac[2 * POLICY_MAC_SIZE + 1], expected[2 * POLICY_MAC_SIZE + 1];
+        unsigned long long counter;
+        unsigned char diff = 0;
+        char *body;
+
+        fromlen = sizeof(from);
+        if (!same_addr(&from, &agent_addr)) {
+            continue;
+        }
+        buf[n] = '\0';
+        if (policy_key_len == 0) {
+            if (!agent_policy_warned) {
+                console_printf(V_STATE, "agent: ignoring the policy pushed by the collector; no -K key\n");
+                agent_policy_warned = true;
+            }
+            continue;
+        }
+        if ((body = strchr(buf, '\n')) == NULL ||
+            sscanf(buf, "hd-idle-policy %63s %llu %64s", host, &counter, mac) != 3 || strlen(mac) != 2 * POLICY_MAC_SIZE ||
+            strcmp(host, agent_host) != 0 || !policy_mac(host, counter, body + 1, n - (body + 1 - buf), expected)) {
+            dprintf("agent: dropping a datagram that is not policy for this host\n");
+            continue;
+        }
+        for (int i = 0; i < 2 * POLICY_MAC_SIZE; ++i) {
+            diff |= (unsigned char)(mac[i] ^ expected[i]);
+        }
+        if (diff != 0) {
+            console_printf(V_ERROR, "agent: dropping policy with a wrong hmac; is -K the collector's key?\n");
+            continue;
+        }
+        if (counter <= agent_policy_counter) {
+            dprintf("agent: dropping replayed policy %llu\n", counter);
+            continue;
+        }
+        agent_policy_counter = counter;
+
+        for (line = body + 1; line != NULL && *line != '\0'; line = next) {
+            if ((next = strchr(line, '\n')) != NULL) {
+                *next++ = '\0';
+            }
+            if (strncmp(line, "policy ", 7) == 0 && config_update(line + 7) == 0) {
+                dprintf("agent: policy %s\n", line + 7);
+            }
+        }
+    }
+}
+
+/* tell the collector that this host stops */
+void agent_close(void)
+{
+    if (agent_socket == INVALID_SOCKET) {
+        return;
+    }
+    agent_printf(false, "bye\n");
+    agent_send();
+    closesocket(agent_socket);
+    agent_socket = INVALID_SOCKET;
+}
+
+
+/*
+ * collector
+ */
+
+/* send policy lines to a host, authenticated with the -K key */
+static void collector_send_policy(SOCKET s, COLLECTOR_HOST *h, const char *body, size_t len)
+{
+    char buf[AGENT_DATAGRAM], mac[2 * POLICY_MAC_SIZE + 1];
+    unsigned long long counter = ++collector_counter;
+    int n;
+
+    if (!policy_mac(h->name, counter, body, len, mac)) {
+        console_printf(V_ERROR, "%s: cannot authenticate the policy; error %lu\n", h->name, GetLastError());
+        return;
+    }
+    n = snprintf(buf, sizeof(buf), "hd-idle-policy %s %llu %s\n", h->name, counter, mac);
+    memcpy(buf + n, body, len);
+    sendto(s, buf, (int)(n + len), 0, (struct sockaddr*)&h->addr, sizeof(h->addr));
+}
+
+/* send the lines of the -f file to a host; only called once the file has
+ * been read successfully, so the agents do not get a file that does not parse */
+static void collector_push(SOCKET s, COLLECTOR_HOST *h)
+{
+    char buf[AGENT_DATAGRAM - POLICY_HEADER_SIZE], line[512];
+    size_t len = 0;
+    FILE *fp;
+
+    h->pushed = config_loads;
+    if (collector_policy == NULL || (fp = fopen(collector_policy, "r")) == NULL) {
+        return;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char *p = line + strspn(line, " \t");
+        size_t n;
+
+        p[strcspn(p, "\r\n")] = '\0';
+        if (*p == '#' || *p == '\0') {
+            continue;
+        }
+        if ((n = strlen(p) + 8) > sizeof(buf)) {
+            continue;
+        }
+        if (len + n > sizeof(buf)) {
+            collector_send_policy(s, h, buf, len);
+            len = 0;
+        }
+        len += sprintf(buf + len, "policy %s\n", p);
+    }
+    fclose(fp);
+    if (len > 0) {
+        collector_send_policy(s, h, buf, len);
+    }
+}
+
+static COLLECTOR_HOST *collector_host(const char *name)
+{
+    for (int i = 0; i < collector_nhosts; ++i) {
+        if (strcmp(collector_hosts[i].name, name) == 0) {
+            return &collector_hosts[i];
+        }
+    }
+    if (collector_nhosts == COLLECTOR_HOSTS) {
+        return NULL;
+    }
+    COLLECTOR_HOST *h = &collector_hosts[collector_nhosts++];
+    memset(h, 0x00, sizeof(*h));
+    strcpy(h->name, name);
+    return h;
+}
+
+static void collector_remove_disk(COLLECTOR_HOST *h, int i)
+{
+    lprintf("%s %s: gone\n", h->name, h->disks[i].name);
+    h->disks[i] = h->disks[--h->ndisks];
+}
+
+/* take over a "disk" line; returns true if the state of the disk has changed */
+static bool collector_disk(COLLECTOR_HOST *h, const char *line)
+{
+    COLLECTOR_DISK d, *p = NULL;
+
+    if (sscanf(line, "disk %23s serial=%63s down=%d idle=%d last_io=%lld spindowns=%u spinups=%u reads=%u writes=%u",
+               d.name, d.serial, &d.down, &d.idle_time, &d.last_io, &d.spindowns, &d.spinups, &d.reads, &d.writes) != 9) {
+        return false;
+    }
+    for (int i = 0; i < h->ndisks; ++i) {
+        if (strcmp(h->disks[i].name, d.name) == 0) {
+            p = &h->disks[i];
+        }
+    }
+    if (p == NULL) {
+        if (h->ndisks == COLLECTOR_DISKS) {
+            return false;
+        }
+        p = &h->disks[h->ndisks++];
+        lprintf("%s %s: serial %s, idle time %d s%s\n", h->name, d.name, d.serial, d.idle_time, d.down ? ", spun down" : "");
+    } else if (p->down != d.down) {
+        lprintf("%s %s: %s\n", h->name, d.name, d.down ? "spun down" : "spun up");
+    } else if (p->idle_time != d.idle_time) {
+        lprintf("%s %s: idle time %d s\n", h->name, d.name, d.idle_time);
+    } else {
+        *p = d;
+        return false;
+    }
+    *p = d;
+    return true;
+}
+
+/* print the number of hosts, disks and spun down disks */
+static void collector_summary(void)
+{
+    int hosts = 0, disks = 0, down = 0;
+
+    for (int i = 0; i < collector_nhosts; ++i) {
+        COLLECTOR_HOST *h = &collector_hosts[i];
+        if (h->seen == 0) {
+            continue;
+        }
+        ++hosts;
+        disks += h->ndisks;
+        for (int j = 0; j < h->ndisks; ++j) {
+            down += h->disks[j].down;
+        }
+    }
+    lprintf("fleet: %d hosts, %d disks, %d spun down\n", hosts, disks, down);
+}
+
+/* take over the datagrams of the agents */
+static void collector_receive(SOCKET s, WSAEVENT event)
+{
+    char buf[AGENT_DATAGRAM + 1];
+    struct sockaddr_in from;
+    int fromlen = sizeof(from), n;
+    bool changed = false;
+
+    WSAResetEvent(event);
+    while ((n = recvfrom(s, buf, sizeof(buf) - 1, 0, (struct sockaddr*)&from, &fromlen)) > 0) {
+        char host[64], kind[8] = "";
+        unsigned long run, seq;
+        COLLECTOR_HOST *h;
+        char *line, *next;
+
+        fromlen = sizeof(from);
+        buf[n] = '\0';
+        if (sscanf(buf, "hd-idle %63s %lu %lu %7s", host, &run, &seq, kind) < 3 || (h = collector_host(host)) == NULL) {
+            continue;
+        }
+        if (h->seen != 0 && run == h->run && seq <= h->seq) {
+            continue;       /* reordered or duplicated */
+        }
+        if (h->seen == 0 || h->silent) {
+            lprintf("%s: reporting\n", h->name);
+            changed = true;
+        } else if (run != h->run) {
+            lprintf("%s: restarted\n", h->name);
+        }
+        h->addr = from;
+        h->run = run;
+        h->seq = seq;
+        h->seen = GetTickCount64();
+        h->silent = 0;
+
+        for (line = strchr(buf, '\n'); line != NULL; line = next) {
+            if ((next = strchr(++line, '\n')) != NULL) {
+                *next = '\0';
+            }
+            if (strncmp(line, "disk ", 5) == 0) {
+                changed |= collector_disk(h, line);
+            } else if (strncmp(line, "gone ", 5) == 0) {
+                for (int i = 0; i < h->ndisks; ++i) {
+                    if (strcmp(h->disks[i].name, line + 5) == 0) {
+                        collector_remove_disk(h, i);
+                        changed = true;
+                        break;
+                    }
+                }
+            } else if (strcmp(line, "bye") == 0) {
+                lprintf("%s: stopped\n", h->name);
+                while (h->ndisks > 0) {
+                    collector_remove_disk(h, h->ndisks - 1);
+                }
+                h->seen = 0;    /* its next run starts a new sequence */
+                changed = true;
+            }
+        }
+
+        /* a host that has just appeared gets the policy; a heartbeat repeats
+         * it in case a push was lost */
+        if (h->seen != 0 && (h->pushed != config_loads || strcmp(kind, "full") == 0)) {
+            collector_push(s, h);
+        }
+    }
+    if (changed) {
+        collector_summary();
+    }
+}
+
+/* report the hosts that have not sent anything for three heartbeats */
+static void collector_check(ULONGLONG now)
+{
+    for (int i = 0; i < collector_nhosts; ++i) {
+        COLLECTOR_HOST *h = &collector_hosts[i];
+        if (h->seen != 0 && !h->silent && now - h->seen > 3 * AGENT_HEARTBEAT * 1000) {
+            lprintf("%s: silent for %llu s\n", h->name, (now - h->seen) / 1000);
+            h->silent = 1;
+        }
+    }
+}
+
+/* collect the disk state of the agents on the given port until stop_event is
+ * set, pushing the -f file to them if given; returns the exit code */
+int collector_run(int port, const char *policy)
+{
+    WSAEVENT event = NULL;
+    unsigned int loads = config_loads;
+    SOCKET s;
+
+    if (policy != NULL && policy_key_len == 0) {
+        fprintf(stderr, "error: pushing -f to the agents requires -K <key file>\n");
+        return 1;
+    }
+    if ((s = udp_open(port, &event)) == INVALID_SOCKET) {
+        fprintf(stderr, "cannot collect on port %d\n", port);
+        return 2;
+    }
+    collector_policy = policy;
+    collector_counter = (unsigned long long)time(NULL) << 20;
+    if (!service_mode) {
+        console_open();
+    }
+    lprintf("collecting on port %d%s%s\n", port, (policy != NULL) ? ", pushing " : "", (policy != NULL) ? policy : "");
+
+    for (;;) {
+        HANDLE handles[3] = { stop_event, event, config_handle() };
+        DWORD count = (handles[2] != NULL) ? 3 : 2;
+        DWORD timeout = COLLECTOR_CHECK;
+        DWORD r;
+
+        if (handles[2] != NULL) {
+            DWORD reload = config_poll(GetTickCount64());
+            if (timeout > reload) {
+                timeout = reload;
+            }
+        }
+        if (config_loads != loads) {
+            /* the file has been changed and parses; all hosts get it */
+            loads = config_loads;
+            for (int i = 0; i < collector_nhosts; ++i) {
+                if (collector_hosts[i].seen != 0) {
+                    collector_push(s, &collector_hosts[i]);
+                }
+            }
+        }
+
+        r = WaitForMultipleObjects(count, handles, FALSE, timeout);
+        if (r == WAIT_OBJECT_0) {
+            closesocket(s);
+            log_close();
+            return 0;
+        } else if (r == WAIT_OBJECT_0 + 1) {
+            collector_receive(s, event);
+        } else if (r == WAIT_OBJECT_0 + 2) {
+            config_changed();
+        }
+        collector_check(GetTickCount64());
+    }
+}
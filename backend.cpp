@@ -0,0 +1,389 @@
+/*
+ * backend.cpp - power commands for ata, scsi/sas and nvme disks
+ *
+ * Copyright (c) 2022 RalfOGit
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Every disk gets a backend, i.e. the set of commands that query its power
+ * state, put it into standby and spin it up again. The backend is chosen once,
+ * by the first probe of a disk, together with the other capabilities of the
+ * disk (drive type, removable media, seek penalty), from the bus type Windows
+ * reports for it:
+ *
+ * - sata/ata (and anything unknown, e.g. usb bridges): ata pass-through with
+ *   CHECK POWER MODE, STANDBY IMMEDIATE and IDLE IMMEDIATE. On a bus other
+ *   than sata/ata, one CHECK POWER MODE tells whether ata pass-through works;
+ *   a disk that rejects it as unsupported is switched to scsi for good;
+ * - scsi/sas/fibre channel/iscsi: START STOP UNIT with the STANDBY and ACTIVE
+ *   power conditions, and REQUEST SENSE for the power state. Sata disks
+ *   behind a sas hba get these translated by the hba (SAT);
+ * - nvme: the power management feature (Set Features via
+ *   IOCTL_STORAGE_SET_PROPERTY), with the deepest non-operational power state
+ *   of the controller as standby. Nvme disks without one have no standby.
+ *   Nvme disks are ssds, usually managed by Windows (APST) already, and
+ *   forcing a power state overrides that; so they are only spun down with -N.
+ *
+ * All power modes are reported in the ata encoding: 0x00 standby, 0x80 idle,
+ * 0xff active, -1 unknown.
+ *
+ * Disks that can never be spun down (not a fixed drive, removable media,
+ * ssds other than nvme disks with a non-operational power state given -N, no
+ * standby at all) are left alone from then on.
+ */
+
+#include "hd-idle.h"
+#include <Ntddscsi.h>
+#include <stddef.h>
+#include <string.h>
+
+#define NVME_FEATURE_POWER_MGMT 0x02    /* feature identifier of the power state */
+#define NVME_IDENTIFY_CNS_CTRL  0x01    /* identify controller */
+#define NVME_IDENTIFY_SIZE      4096
+#define NVME_IDENTIFY_NPSS      263     /* offset of the number of power states - 1 */
+#define NVME_IDENTIFY_PSD       2048    /* offset of the 32-byte power state descriptors */
+
+static int  scsi_check_power_mode(DISKSTATS *ds);
+static bool scsi_standby(DISKSTATS *ds);
+static bool scsi_wake(DISKSTATS *ds);
+static int  nvme_check_power_mode(DISKSTATS *ds);
+static bool nvme_standby(DISKSTATS *ds);
+static bool nvme_wake(DISKSTATS *ds);
+static int  none_check_power_mode(DISKSTATS *ds);
+static bool none_wake(DISKSTATS *ds);
+
+const BACKEND backend_ata  = { "ata",  ata_check_power_mode,  ata_set_standby_mode, ata_set_idle_mode };
+const BACKEND backend_scsi = { "scsi", scsi_check_power_mode, scsi_standby,         scsi_wake };
+const BACKEND backend_nvme = { "nvme", nvme_check_power_mode, nvme_standby,         nvme_wake };
+const BACKEND backend_none = { "none", none_check_power_mode, NULL,                 none_wake };
+
+int nvme_power = 0;     /* -N: put nvme disks into their non-operational power state */
+
+/* scsi pass-through request with room for sense and data */
+typedef struct SCSI_REQUEST {
+    SCSI_PASS_THROUGH  spt;
+    ULONG              filler;      /* align the buffers */
+    UCHAR              sense[32];
+    UCHAR              data[32];
+} SCSI_REQUEST;
+
+/* issue a scsi command without data out; returns true if the device
+ * completed it with good status */
+static bool scsi_command(HANDLE hDevice, const UCHAR *cdb, UCHAR cdb_len, ULONG data_len, ULONG timeout, SCSI_REQUEST *r)
+{
+    DWORD cb = 0;
+
+    memset(r, 0x00, sizeof(*r));
+    r->spt.Length = sizeof(SCSI_PASS_THROUGH);
+    r->spt.CdbLength = cdb_len;
+    memcpy(r->spt.Cdb, cdb, cdb_len);
+    /* some miniport drivers reject data-in with a zero length */
+    r->spt.DataIn = data_len != 0 ? SCSI_IOCTL_DATA_IN : SCSI_IOCTL_DATA_UNSPECIFIED;
+    r->spt.TimeOutValue = timeout;
+    r->spt.SenseInfoLength = sizeof(r->sense);
+    r->spt.SenseInfoOffset = offsetof(SCSI_REQUEST, sense);
+    r->spt.DataTransferLength = data_len;
+    r->spt.DataBufferOffset = data_len != 0 ? offsetof(SCSI_REQUEST, data) : 0;
+
+    if (!profile_ioctl(hDevice, IOCTL_SCSI_PASS_THROUGH, r, sizeof(*r), r, sizeof(*r), &cb, NULL)) {
+        return false;
+    }
+    if (r->spt.ScsiStatus != 0x00) {
+        /* check condition or busy */
+        SetLastError(ERROR_IO_DEVICE);
+        return false;
+    }
+    return true;
+}
+
+/* START STOP UNIT; cdb4 holds the power condition (bits 7..4) and the start bit */
+bool scsi_start_stop(HANDLE hDevice, const char *name, UCHAR cdb4)
+{
+    UCHAR cdb[6] = { 0x1b, 0x00, 0x00, 0x00, cdb4, 0x00 };
+    SCSI_REQUEST r;
+
+    if (!scsi_command(hDevice, cdb, sizeof(cdb), 0, SPINDOWN_TIMEOUT, &r)) {
+        DWORD error = GetLastError();
+        dprintf("scsi_start_stop(%s, 0x%02x): error %lu, sense key 0x%x\n", name, cdb4, error, r.sense[2] & 0x0f);
+        SetLastError(error);
+        return false;
+    }
+    dprintf("scsi_start_stop(%s, 0x%02x): SUCCESS\n", name, cdb4);
+    return true;
+}
+
+/* REQUEST SENSE does not change the power condition; the additional sense
+ * code 5Eh tells which low-power condition the device is in */
+static int scsi_check_power_mode(DISKSTATS *ds)
+{
+    UCHAR cdb[6] = { 0x03, 0x00, 0x00, 0x00, 18, 0x00 };
+    SCSI_REQUEST r;
+    UCHAR asc, ascq;
+    HANDLE hDevice = drive_rw_handle(ds);
+
+    if (hDevice == INVALID_HANDLE_VALUE) {
+        return -1;
+    }
+    if (!scsi_command(hDevice, cdb, sizeof(cdb), 18, 3, &r)) {
+        drive_failed(ds, GetLastError());
+        return -1;
+    }
+    switch (r.data[0] & 0x7f) {
+    case 0x70:  case 0x71:  asc = r.data[12];   ascq = r.data[13];  break;     /* fixed format */
+    case 0x72:  case 0x73:  asc = r.data[2];    ascq = r.data[3];   break;     /* descriptor format */
+    default:                return -1;
+    }
+    if (asc != 0x5e) {
+        return 0xff;
+    }
+    switch (ascq) {
+    case 0x02:  case 0x04:  case 0x09:  case 0x0a:  case 0x43:
+        return 0x00;    /* standby, standby_y */
+    case 0x01:  case 0x03:  case 0x05:  case 0x06:  case 0x07:  case 0x08:  case 0x42:
+        return 0x80;    /* idle, idle_b, idle_c */
+    default:
+        return 0xff;
+    }
+}
+
+/* STANDBY power condition; devices that do not support power conditions are stopped */
+static bool scsi_standby(DISKSTATS *ds)
+{
+    HANDLE hDevice = drive_rw_handle(ds);
+
+    if (hDevice == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    if (scsi_start_stop(hDevice, ds->name, 0x30) || scsi_start_stop(hDevice, ds->name, 0x00)) {
+        return true;
+    }
+    drive_failed(ds, GetLastError());
+    return false;
+}
+
+/* ACTIVE power condition, or a plain start */
+static bool scsi_wake(DISKSTATS *ds)
+{
+    HANDLE hDevice = drive_rw_handle(ds);
+
+    if (hDevice == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    if (scsi_start_stop(hDevice, ds->name, 0x10) || scsi_start_stop(hDevice, ds->name, 0x01)) {
+        return true;
+    }
+    drive_failed(ds, GetLastError());
+    return false;
+}
+
+/* get an nvme identify structure or feature (data may be NULL for features);
+ * returns the completion dword 0 or -1 on failure */
+static LONGLONG nvme_query(DISKSTATS *ds, DWORD type, DWORD value, void *data, DWORD len)
+{
+    static const DWORD header = offsetof(STORAGE_PROPERTY_QUERY, AdditionalParameters) + sizeof(STORAGE_PROTOCOL_SPECIFIC_DATA);
+    char buffer[offsetof(STORAGE_PROPERTY_QUERY, AdditionalParameters) + sizeof(STORAGE_PROTOCOL_SPECIFIC_DATA) + NVME_IDENTIFY_SIZE];
+    STORAGE_PROPERTY_QUERY *query = (STORAGE_PROPERTY_QUERY*)buffer;
+    STORAGE_PROTOCOL_SPECIFIC_DATA *psd = (STORAGE_PROTOCOL_SPECIFIC_DATA*)query->AdditionalParameters;
+    STORAGE_PROTOCOL_DATA_DESCRIPTOR *desc = (STORAGE_PROTOCOL_DATA_DESCRIPTOR*)buffer;
+    HANDLE hDevice = drive_meta_handle(ds);
+    DWORD cb = 0;
+
+    if (hDevice == INVALID_HANDLE_VALUE || len > NVME_IDENTIFY_SIZE) {
+        return -1;
+    }
+    memset(buffer, 0x00, header + len);
+    query->PropertyId = StorageDeviceProtocolSpecificProperty;
+    query->QueryType = PropertyStandardQuery;
+    psd->ProtocolType = ProtocolTypeNvme;
+    psd->DataType = type;
+    psd->ProtocolDataRequestValue = value;
+    psd->ProtocolDataOffset = (len > 0) ? sizeof(STORAGE_PROTOCOL_SPECIFIC_DATA) : 0;
+    psd->ProtocolDataLength = len;
+    if (!profile_ioctl(hDevice, IOCTL_STORAGE_QUERY_PROPERTY, buffer, header + len, buffer, header + len, &cb, NULL)) {
+        drive_failed(ds, GetLastError());
+        return -1;
+    }
+    psd = &desc->ProtocolSpecificData;
+    if (len > 0) {
+        if (psd->ProtocolDataOffset < sizeof(STORAGE_PROTOCOL_SPECIFIC_DATA) || psd->ProtocolDataLength < len) {
+            return -1;
+        }
+        memcpy(data, (char*)psd + psd->ProtocolDataOffset, len);
+    }
+    return psd->FixedProtocolReturnData;
+}
+
+/* Set Features: power management */
+static bool nvme_set_power_state(DISKSTATS *ds, int ps)
+{
+    char buffer[offsetof(STORAGE_PROPERTY_SET, AdditionalParameters) + sizeof(STORAGE_PROTOCOL_SPECIFIC_DATA_EXT)];
+    STORAGE_PROPERTY_SET *set = (STORAGE_PROPERTY_SET*)buffer;
+    STORAGE_PROTOCOL_SPECIFIC_DATA_EXT *psd = (STORAGE_PROTOCOL_SPECIFIC_DATA_EXT*)set->AdditionalParameters;
+    HANDLE hDevice = drive_rw_handle(ds);
+    DWORD cb = 0;
+
+    if (hDevice == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    memset(buffer, 0x00, sizeof(buffer));
+    set->PropertyId = StorageDeviceProtocolSpecificProperty;
+    set->SetType = PropertyStandardSet;
+    psd->ProtocolType = ProtocolTypeNvme;
+    psd->DataType = NVMeDataTypeFeature;
+    psd->ProtocolDataValue = NVME_FEATURE_POWER_MGMT;
+    psd->ProtocolDataSubValue = ps;     /* dword 11: power state */
+    if (!profile_ioctl(hDevice, IOCTL_STORAGE_SET_PROPERTY, buffer, sizeof(buffer), buffer, sizeof(buffer), &cb, NULL)) {
+        DWORD error = GetLastError();
+        dprintf("nvme_set_power_state(%s, %d): error %lu\n", ds->name, ps, error);
+        drive_failed(ds, error);
+        return false;
+    }
+    dprintf("nvme_set_power_state(%s, %d): SUCCESS\n", ds->name, ps);
+    return true;
+}
+
+/* deepest non-operational power state of the controller, 0 if it has none */
+static int nvme_standby_state(DISKSTATS *ds)
+{
+    UCHAR id[NVME_IDENTIFY_SIZE];
+    int ps = 0;
+
+    if (nvme_query(ds, NVMeDataTypeIdentify, NVME_IDENTIFY_CNS_CTRL, id, sizeof(id)) >= 0) {
+        for (int i = id[NVME_IDENTIFY_NPSS]; i > 0 && i < 32; --i) {
+            if (id[NVME_IDENTIFY_PSD + 32 * i + 3] & 0x02) {    /* non-operational state */
+                ps = i;
+                break;
+            }
+        }
+    }
+    return ps;
+}
+
+static int nvme_check_power_mode(DISKSTATS *ds)
+{
+    LONGLONG dw0 = nvme_query(ds, NVMeDataTypeFeature, NVME_FEATURE_POWER_MGMT, NULL, 0);
+
+    if (dw0 < 0) {
+        return -1;
+    }
+    return ((dw0 & 0x1f) == ds->nvme_standby_ps) ? 0x00 : 0xff;
+}
+
+/* the controller returns to an operational state by itself on the next i/o;
+ * with autonomous power state transitions enabled, it may also leave the
+ * state on its own */
+static bool nvme_standby(DISKSTATS *ds)
+{
+    return nvme_set_power_state(ds, ds->nvme_standby_ps);
+}
+
+static bool nvme_wake(DISKSTATS *ds)
+{
+    return nvme_set_power_state(ds, 0);
+}
+
+static int none_check_power_mode(DISKSTATS *ds)
+{
+    return -1;
+}
+
+static bool none_wake(DISKSTATS *ds)
+{
+    return true;
+}
+
+/* Fill in the capabilities of a disk and choose its backend (runs on the
+ * worker of its first probe; the main thread reads ds->caps only after that
+ * probe has been evaluated). Returns NULL if the disk cannot be queried yet;
+ * its next probe tries again.
+ */
+const BACKEND *caps_detect(DISKSTATS *ds)
+{
+    STORAGE_PROPERTY_QUERY query;
+    STORAGE_DEVICE_DESCRIPTOR desc;
+    DEVICE_SEEK_PENALTY_DESCRIPTOR seek;
+    CAPS *caps = &ds->caps;
+    char vol[sizeof(DISKSTATS::name) + 1];
+    HANDLE hDevice = drive_meta_handle(ds);
+    DWORD cb = 0;
+
+    strcpy(vol, ds->name);
+    strcat(vol, "\\");
+    caps->drive_type = GetDriveTypeA(vol);
+    caps->bus_type = -1;
+    caps->removable = 0;
+    caps->rotational = -1;
+
+    memset(&query, 0x00, sizeof(query));
+    query.QueryType = PropertyStandardQuery;
+    if (hDevice == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+    config_identify(ds, hDevice);
+    query.PropertyId = StorageDeviceSeekPenaltyProperty;
+    if (profile_ioctl(hDevice, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query), &seek, sizeof(seek), &cb, NULL) &&
+        cb >= sizeof(seek)) {
+        caps->rotational = seek.IncursSeekPenalty ? 1 : 0;
+    }
+    query.PropertyId = StorageDeviceProperty;
+    if (!profile_ioctl(hDevice, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query), &desc, sizeof(desc), &cb, NULL) ||
+        cb < offsetof(STORAGE_DEVICE_DESCRIPTOR, RawPropertiesLength)) {
+        return NULL;
+    }
+    caps->bus_type = desc.BusType;
+    caps->removable = desc.RemovableMedia;
+    caps->known = 1;
+
+    switch (desc.BusType) {
+    case BusTypeNvme:
+        if ((ds->nvme_standby_ps = nvme_standby_state(ds)) > 0) {
+            return &backend_nvme;
+        }
+        return &backend_none;
+    case BusTypeScsi:
+    case BusTypeSas:
+    case BusTypeFibre:
+    case BusTypeiScsi:
+        return &backend_scsi;
+    case BusTypeAta:
+    case BusTypeSata:
+        return &backend_ata;
+    default:
+        /* e.g. a usb bridge: find out once whether it passes ata commands through */
+        if (ata_check_power_mode(ds) < 0) {
+            DWORD error = GetLastError();
+            if (error == ERROR_INVALID_FUNCTION || error == ERROR_NOT_SUPPORTED) {
+                return &backend_scsi;
+            }
+        }
+        return &backend_ata;
+    }
+}
+
+/* can the disk ever be spun down (or put into a low-power state)? */
+bool caps_spindown(DISKSTATS *ds, const BACKEND *backend)
+{
+    CAPS *caps = &ds->caps;
+
+    if (caps->drive_type != DRIVE_FIXED || caps->removable || backend->standby == NULL) {
+        return false;
+    }
+    if (backend == &backend_nvme) {
+        return nvme_power != 0;
+    }
+    return caps->rotational != 0;
+}
@@ -0,0 +1,193 @@
+/*
+ * bench.cpp - probe cycle benchmark for hd-idle
+ *
+ * Copyright (c) 2022 RalfOGit
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * hd-idle -b <cycles> measures what probing costs on this host instead of
+ * running the main loop. For each disk, every cycle times the individual calls
+ * of a probe the way the original loop issued them (open, power state, drive
+ * type, ata check power mode, read/write counts, close), and then one probe
+ * pass over all disks through the regular concurrent probe path. No spin-down
+ * command is ever sent. p50/p99/max are reported per call and disk, plus the
+ * time of a whole probe pass.
+ */
+
+#include "hd-idle.h"
+#include <stdlib.h>
+#include <string.h>
+
+enum { BENCH_OPEN, BENCH_POWER_STATE, BENCH_DRIVE_TYPE, BENCH_ATA_CHECK, BENCH_PERFORMANCE, BENCH_CLOSE, BENCH_CALLS };
+
+static const char *bench_call_names[BENCH_CALLS] = {
+    "CreateFile", "GetDevicePowerState", "GetDriveTypeA", "ata_check_power_mode", "IOCTL_DISK_PERFORMANCE", "CloseHandle"
+};
+
+typedef struct BENCH_STATS {
+    double            *samples;     /* ms */
+    int                count;
+    int                failed;
+} BENCH_STATS;
+
+static LARGE_INTEGER bench_freq;
+
+static double bench_ms(LARGE_INTEGER start)
+{
+    LARGE_INTEGER end;
+    QueryPerformanceCounter(&end);
+    return (double)(end.QuadPart - start.QuadPart) * 1000.0 / (double)bench_freq.QuadPart;
+}
+
+static void bench_add(BENCH_STATS *st, LARGE_INTEGER start, BOOL ok)
+{
+    st->samples[st->count++] = bench_ms(start);
+    if (!ok) {
+        st->failed++;
+    }
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+static void bench_print(const char *disk, const char *call, BENCH_STATS *st)
+{
+    if (st->count == 0) {
+        return;
+    }
+    qsort(st->samples, st->count, sizeof(double), bench_compare);
+    printf("%-20s %-24s %10.3f %10.3f %10.3f %7d\n", disk, call,
+           st->samples[(st->count - 1) / 2],
+           st->samples[(st->count * 99 - 1) / 100],
+           st->samples[st->count - 1],
+           st->failed);
+}
+
+/* time the individual calls of one probe of a disk */
+static void bench_calls(DISKSTATS *ds, BENCH_STATS *st)
+{
+    LARGE_INTEGER start;
+    DISK_PERFORMANCE perf;
+    char vol[sizeof(DISKSTATS::name) + 1];
+    DWORD cb = 0;
+    BOOL fOn;
+
+    QueryPerformanceCounter(&start);
+    HANDLE hDevice = CreateFileA(ds->name, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+    bench_add(&st[BENCH_OPEN], start, hDevice != INVALID_HANDLE_VALUE);
+    if (hDevice == INVALID_HANDLE_VALUE) {
+        return;
+    }
+
+    QueryPerformanceCounter(&start);
+    BOOL r = GetDevicePowerState(hDevice, &fOn);
+    bench_add(&st[BENCH_POWER_STATE], start, r);
+
+    strcpy(vol, ds->name);
+    strcat(vol, "\\");
+    QueryPerformanceCounter(&start);
+    UINT type = GetDriveTypeA(vol);
+    bench_add(&st[BENCH_DRIVE_TYPE], start, type != DRIVE_UNKNOWN);
+
+    QueryPerformanceCounter(&start);
+    int ata = ata_check_power_mode(ds);
+    bench_add(&st[BENCH_ATA_CHECK], start, ata >= 0);
+
+    QueryPerformanceCounter(&start);
+    r = DeviceIoControl(hDevice, IOCTL_DISK_PERFORMANCE, NULL, 0, &perf, sizeof(perf), &cb, NULL);
+    bench_add(&st[BENCH_PERFORMANCE], start, r);
+
+    QueryPerformanceCounter(&start);
+    r = CloseHandle(hDevice);
+    bench_add(&st[BENCH_CLOSE], start, r);
+}
+
+/* run the given number of cycles over the disks in the table and print the
+ * results; returns the exit code */
+int bench_run(int cycles)
+{
+    BENCH_STATS *stats, pass;
+    DISKSTATS *ds;
+    int ndisks = 0;
+
+    QueryPerformanceFrequency(&bench_freq);
+    for (ds = first_diskstats(); ds != NULL; ds = next_diskstats(ds)) {
+        ++ndisks;
+    }
+    if (ndisks == 0) {
+        fprintf(stderr, "bench: no disks found\n");
+        return 1;
+    }
+
+    /* one set of statistics per call and disk, indexed by position in the table */
+    if ((stats = (BENCH_STATS*)calloc(ndisks * BENCH_CALLS, sizeof(*stats))) == NULL ||
+        (pass.samples = (double*)malloc(cycles * sizeof(double))) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    pass.count = pass.failed = 0;
+    for (int i = 0; i < ndisks * BENCH_CALLS; ++i) {
+        if ((stats[i].samples = (double*)malloc(cycles * sizeof(double))) == NULL) {
+            fprintf(stderr, "out of memory\n");
+            return 2;
+        }
+    }
+
+    printf("bench: %d cycles over %d disks\n", cycles, ndisks);
+    for (int c = 0; c < cycles; ++c) {
+        LARGE_INTEGER start;
+        int i = 0;
+
+        for (ds = first_diskstats(); ds != NULL; ds = next_diskstats(ds), ++i) {
+            bench_calls(ds, &stats[i * BENCH_CALLS]);
+        }
+
+        /* a probe pass through the concurrent probe path; the results are
+         * discarded instead of being evaluated, so nothing is spun down */
+        QueryPerformanceCounter(&start);
+        for (ds = first_diskstats(); ds != NULL; ds = next_diskstats(ds)) {
+            probe_start(ds);
+        }
+        int outstanding = probe_wait(PROBE_DEADLINE);
+        bench_add(&pass, start, outstanding == 0);
+        for (ds = first_diskstats(); ds != NULL; ds = next_diskstats(ds)) {
+            if (ds->probe.state == PROBE_DONE) {
+                ds->probe.state = PROBE_IDLE;
+            }
+        }
+    }
+
+    printf("%-20s %-24s %10s %10s %10s %7s\n", "disk", "call", "p50 ms", "p99 ms", "max ms", "failed");
+    int i = 0;
+    for (ds = first_diskstats(); ds != NULL; ds = next_diskstats(ds), ++i) {
+        const char *disk = ds->name + 4;   /* without \\.\ */
+        for (int call = 0; call < BENCH_CALLS; ++call) {
+            bench_print(disk, bench_call_names[call], &stats[i * BENCH_CALLS + call]);
+        }
+    }
+    bench_print("all disks", "probe pass", &pass);
+
+    for (i = 0; i < ndisks * BENCH_CALLS; ++i) {
+        free(stats[i].samples);
+    }
+    free(stats);
+    free(pass.samples);
+    return 0;
+}
@@ -0,0 +1,472 @@
+/*
+ * config.cpp - per-disk settings from a configuration file
+ *
+ * Copyright (c) 2022 RalfOGit
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * PhysicalDrive numbers change with reboots and hot-plugging, so with
+ * -f <file>, settings can be given per disk identity instead. Every line
+ * of the file names a disk and its settings, which start from the defaults
+ * just like those of an -a option:
+ *
+ *   # key                                           settings
+ *   serial:WD-WCC4E1234567                          idle=600 ops=10 kbytes=100
+ *   wwn:50014ee2b5c0c123                            idle=1200 group=pool:together
+ *   guid:{3F2504E0-4F89-11D3-9A0C-0305E82C3301}     idle=0
+ *   serial:ZA1B2C3D                                 idle=1800 tiers=idle_b:120,idle_c:600
+ *
+ * The serial number comes from the storage device descriptor, the wwn from
+ * the NAA (or for nvme, EUI-64) identifier of the device identification
+ * page and the guid is the disk id of a gpt partitioned disk. A disk is
+ * identified by its first probe; a matching line takes precedence over the
+ * -a options. The directory of the file is watched with
+ * ReadDirectoryChangesW, and CONFIG_SETTLE ms after the file has last been
+ * written it is read again and applied to the present disks in place, so
+ * that their idle state is kept. A file that does not parse is reported
+ * and ignored; the previous settings stay in effect. Lines pushed by a
+ * collector (agent.cpp) are applied the same way, until the file is read
+ * again.
+ */
+
+#include "hd-idle.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define CONFIG_SETTLE       500     /* ms after the last change before reading the file */
+#define CONFIG_LINE_SIZE    512
+#define CONFIG_LAYOUT_SIZE  32768   /* drive layout with up to 128 gpt partitions */
+
+static char            *config_path = NULL;
+static IDLE_TIME       *config_root = NULL;     /* settings by disk key (IDLE_TIME::name) */
+static WCHAR            config_file[MAX_PATH];  /* file name within the watched directory */
+static HANDLE           config_dir = INVALID_HANDLE_VALUE;
+static OVERLAPPED       config_ov;
+static DWORD            config_buf[1024];       /* FILE_NOTIFY_INFORMATION records; DWORD-aligned */
+static ULONGLONG        config_reload_at = 0;   /* GetTickCount64() time of a pending reload, 0 if none */
+
+unsigned int config_loads = 0;                  /* times the file has been read successfully */
+
+/* copy an identity string without leading and trailing blanks */
+static void copy_trimmed(char *dst, size_t size, const char *src, size_t len)
+{
+    while (len > 0 && isspace((unsigned char)*src)) {
+        ++src;
+        --len;
+    }
+    while (len > 0 && isspace((unsigned char)src[len - 1])) {
+        --len;
+    }
+    if (len >= size) {
+        len = size - 1;
+    }
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+/* read serial number, wwn and gpt disk id of a disk; called by caps_detect() */
+void config_identify(DISKSTATS *ds, HANDLE hDevice)
+{
+    STORAGE_PROPERTY_QUERY query;
+    CAPS *caps = &ds->caps;
+    BYTE buf[1024], *layout_buf;
+    DWORD cb = 0;
+
+    caps->serial[0] = '\0';
+    caps->wwn[0] = '\0';
+    caps->guid[0] = '\0';
+
+    memset(&query, 0x00, sizeof(query));
+    query.QueryType = PropertyStandardQuery;
+    query.PropertyId = StorageDeviceProperty;
+    if (profile_ioctl(hDevice, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query), buf, sizeof(buf), &cb, NULL) &&
+        cb >= offsetof(STORAGE_DEVICE_DESCRIPTOR, RawPropertiesLength)) {
+        STORAGE_DEVICE_DESCRIPTOR *desc = (STORAGE_DEVICE_DESCRIPTOR*)buf;
+        if (desc->SerialNumberOffset != 0 && desc->SerialNumberOffset < cb) {
+            const char *serial = (const char*)buf + desc->SerialNumberOffset;
+            copy_trimmed(caps->serial, sizeof(caps->serial), serial, strnlen(serial, cb - desc->SerialNumberOffset));
+        }
+    }
+
+    query.PropertyId = StorageDeviceIdProperty;
+    if (profile_ioctl(hDevice, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query), buf, sizeof(buf), &cb, NULL) &&
+        cb >= offsetof(STORAGE_DEVICE_ID_DESCRIPTOR, Identifiers)) {
+        STORAGE_DEVICE_ID_DESCRIPTOR *desc = (STORAGE_DEVICE_ID_DESCRIPTOR*)buf;
+        DWORD pos = offsetof(STORAGE_DEVICE_ID_DESCRIPTOR, Identifiers);
+        for (DWORD i = 0; i < desc->NumberOfIdentifiers && pos + offsetof(STORAGE_IDENTIFIER, Identifier) <= cb; ++i) {
+            STORAGE_IDENTIFIER *id = (STORAGE_IDENTIFIER*)(buf + pos);
+            if (pos + offsetof(STORAGE_IDENTIFIER, Identifier) + id->IdentifierSize > cb) {
+                break;
+            }
+            /* association 0: the identifier is of the device rather than its port */
+            if (id->CodeSet == StorageIdCodeSetBinary && id->Association == 0 &&
+                (id->Type == StorageIdTypeFCPHName || id->Type == StorageIdTypeEUI64) &&
+                id->IdentifierSize * 2 < sizeof(caps->wwn)) {
+                for (WORD b = 0; b < id->IdentifierSize; ++b) {
+                    sprintf(caps->wwn + 2 * b, "%02x", id->Identifier[b]);
+                }
+                if (id->Type == StorageIdTypeFCPHName) {
+                    break;      /* prefer naa over eui-64 */
+                }
+            }
+            if (id->NextOffset == 0) {
+                break;
+            }
+            pos += id->NextOffset;
+        }
+    }
+
+    /* the partition table is cached by the partition manager */
+    if ((layout_buf = (BYTE*)malloc(CONFIG_LAYOUT_SIZE)) != NULL) {
+        DRIVE_LAYOUT_INFORMATION_EX *layout = (DRIVE_LAYOUT_INFORMATION_EX*)layout_buf;
+        if (profile_ioctl(hDevice, IOCTL_DISK_GET_DRIVE_LAYOUT_EX, NULL, 0, layout_buf, CONFIG_LAYOUT_SIZE, &cb, NULL) &&
+            cb >= offsetof(DRIVE_LAYOUT_INFORMATION_EX, PartitionEntry) && layout->PartitionStyle == PARTITION_STYLE_GPT) {
+            GUID *g = &layout->Gpt.DiskId;
+            sprintf(caps->guid, "{%08lX-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X}",
+                    (unsigned long)g->Data1, g->Data2, g->Data3, g->Data4[0], g->Data4[1],
+                    g->Data4[2], g->Data4[3], g->Data4[4], g->Data4[5], g->Data4[6], g->Data4[7]);
+        }
+        free(layout_buf);
+    }
+
+    dprintf("probing %s: serial \"%s\", wwn \"%s\", guid \"%s\"\n", ds->name, caps->serial, caps->wwn, caps->guid);
+}
+
+/* does the key of a config line (serial:, wwn: or guid:) name the disk? */
+static bool config_match(const char *key, DISKSTATS *ds)
+{
+    const CAPS *caps = &ds->caps;
+
+    if (strncmp(key, "serial:", 7) == 0) {
+        return caps->serial[0] != '\0' && strcmp(key + 7, caps->serial) == 0;
+    }
+    if (strncmp(key, "wwn:", 4) == 0) {
+        return caps->wwn[0] != '\0' && _stricmp(key + 4, caps->wwn) == 0;
+    }
+    if (strncmp(key, "guid:", 5) == 0) {
+        return caps->guid[0] != '\0' && _stricmp(key + 5, caps->guid) == 0;
+    }
+    return false;
+}
+
+static void config_free(IDLE_TIME *root)
+{
+    while (root != NULL) {
+        IDLE_TIME *next = root->next;
+        free(root->name);
+        free(root->group_spec);
+        free(root);
+        root = next;
+    }
+}
+
+/* parse one line into an entry; returns NULL with *error set if it is invalid */
+static IDLE_TIME *config_parse(char *line, const char **error)
+{
+    static const char blanks[] = " \t\r\n";
+    IDLE_TIME *it;
+    char *tok, *next;
+
+    tok = line + strspn(line, blanks);
+    if (strncmp(tok, "serial:", 7) != 0 && strncmp(tok, "wwn:", 4) != 0 && strncmp(tok, "guid:", 5) != 0) {
+        *error = "expected serial:, wwn: or guid:";
+        return NULL;
+    }
+    if ((it = (IDLE_TIME*)calloc(1, sizeof(*it))) == NULL) {
+        *error = "out of memory";
+        return NULL;
+    }
+    it->drive = -1;
+    it->idle_time = DEFAULT_IDLE_TIME;
+    it->group = -1;
+
+    for (; *tok != '\0'; tok = next + strspn(next, blanks)) {
+        next = tok + strcspn(tok, blanks);
+        if (*next != '\0') {
+            *next++ = '\0';
+        }
+        if (it->name == NULL) {
+            if ((it->name = _strdup(tok)) == NULL) {
+                *error = "out of memory";
+                break;
+            }
+        } else if (strncmp(tok, "idle=", 5) == 0) {
+            it->idle_time = atoi(tok + 5);
+        } else if (strncmp(tok, "ops=", 4) == 0) {
+            it->min_ops = atoi(tok + 4);
+        } else if (strncmp(tok, "kbytes=", 7) == 0) {
+            it->min_kbytes = atoi(tok + 7);
+        } else if (strncmp(tok, "tiers=", 6) == 0) {
+            if ((it->ntiers = epc_parse(tok + 6, it->tiers)) < 0) {
+                *error = "tiers= requires <condition>:<seconds>[,...]";
+                break;
+            }
+        } else if (strncmp(tok, "group=", 6) == 0) {
+            if (!group_valid(tok + 6) || (it->group_spec = _strdup(tok + 6)) == NULL) {
+                *error = "group= requires <group>[:together][,wake]";
+                break;
+            }
+        } else {
+            *error = "unknown setting";
+            break;
+        }
+    }
+    if (*tok != '\0') {
+        config_free(it);
+        return NULL;
+    }
+    return it;
+}
+
+/* read the settings from the file; returns the entries (in file order) or
+ * NULL with ok == false if the file cannot be read or does not parse */
+static IDLE_TIME *config_read(bool *ok)
+{
+    char line[CONFIG_LINE_SIZE];
+    IDLE_TIME *root = NULL, **tail = &root;
+    const char *error = NULL;
+    int lineno = 0;
+    FILE *fp;
+
+    *ok = false;
+    if ((fp = fopen(config_path, "r")) == NULL) {
+        console_printf(V_ERROR, "config %s: cannot read file\n", config_path);
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char *p = line + strspn(line, " \t");
+        ++lineno;
+        if (*p == '#' || *p == '\r' || *p == '\n' || *p == '\0') {
+            continue;
+        }
+        if ((*tail = config_parse(p, &error)) == NULL) {
+            break;
+        }
+        tail = &(*tail)->next;
+    }
+    fclose(fp);
+
+    if (error != NULL) {
+        console_printf(V_ERROR, "config %s: line %d: %s\n", config_path, lineno, error);
+        config_free(root);
+        return NULL;
+    }
+    *ok = true;
+    return root;
+}
+
+/* resolve the groups of the current entries from scratch, so that groups
+ * and policies no longer in the file are gone */
+static void config_groups(void)
+{
+    group_reset();
+    for (IDLE_TIME *it = config_root; it != NULL; it = it->next) {
+        it->group = -1;
+        if (it->group_spec != NULL && (it->group = group_add(it->group_spec)) < 0) {
+            console_printf(V_ERROR, "config %s: %s: more than %d groups\n", config_path, it->name, MAX_GROUPS);
+        }
+    }
+}
+
+/* start watching the directory of the file for changes */
+static void config_watch(void)
+{
+    DWORD cb;
+
+    if (!ReadDirectoryChangesW(config_dir, config_buf, sizeof(config_buf), FALSE,
+                               FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE,
+                               &cb, &config_ov, NULL)) {
+        console_printf(V_ERROR, "config %s: cannot watch for changes; error %lu\n", config_path, GetLastError());
+        CloseHandle(config_dir);
+        config_dir = INVALID_HANDLE_VALUE;
+    }
+}
+
+/* read the file given with -f and watch it for changes; returns 0 on success */
+int config_open(const char *path)
+{
+    char full[MAX_PATH], *file = NULL;
+    bool ok;
+
+    if (GetFullPathNameA(path, sizeof(full), full, &file) == 0 || file == NULL ||
+        (config_path = _strdup(full)) == NULL) {
+        return -1;
+    }
+    group_freeze();
+    config_root = config_read(&ok);
+    if (!ok) {
+        return -1;
+    }
+    config_groups();
+    config_loads++;
+
+    MultiByteToWideChar(CP_ACP, 0, file, -1, config_file, MAX_PATH);
+    *file = '\0';
+    if ((config_ov.hEvent = CreateEvent(NULL, FALSE, FALSE, NULL)) != NULL) {
+        config_dir = CreateFileA(full, FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                                 OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+    }
+    if (config_dir != INVALID_HANDLE_VALUE) {
+        config_watch();
+    } else {
+        console_printf(V_ERROR, "config %s: cannot watch for changes; error %lu\n", config_path, GetLastError());
+    }
+    return 0;
+}
+
+/* signaled when the watched directory has changed, NULL if not watching */
+HANDLE config_handle(void)
+{
+    return (config_dir != INVALID_HANDLE_VALUE) ? config_ov.hEvent : NULL;
+}
+
+/* the watched directory has changed; schedule a reload if the file is among the changes */
+void config_changed(void)
+{
+    DWORD cb = 0;
+    bool hit = false;
+
+    if (!GetOverlappedResult(config_dir, &config_ov, &cb, FALSE) || cb == 0) {
+        hit = true;         /* e.g. too many changes for the buffer */
+        cb = 0;
+    }
+    for (DWORD pos = 0; pos < cb; ) {
+        FILE_NOTIFY_INFORMATION *fni = (FILE_NOTIFY_INFORMATION*)((BYTE*)config_buf + pos);
+        size_t len = fni->FileNameLength / sizeof(WCHAR);
+        if (len == wcslen(config_file) && _wcsnicmp(fni->FileName, config_file, len) == 0) {
+            hit = true;
+        }
+        if (fni->NextEntryOffset == 0) {
+            break;
+        }
+        pos += fni->NextEntryOffset;
+    }
+    config_watch();
+
+    /* editors write a file in several steps; wait until they are done */
+    if (hit) {
+        config_reload_at = GetTickCount64() + CONFIG_SETTLE;
+    }
+}
+
+/* take over the settings of the line matching the disk, if any; called once
+ * the first probe has identified the disk and on every reload */
+void config_apply(DISKSTATS *ds)
+{
+    idle_settings(ds);
+    for (IDLE_TIME *it = config_root; it != NULL; it = it->next) {
+        if (config_match(it->name, ds)) {
+            ds->idle_time = it->idle_time;
+            ds->min_ops = it->min_ops;
+            ds->min_kbytes = it->min_kbytes;
+            ds->group = it->group;
+            memcpy(ds->tiers, it->tiers, sizeof(ds->tiers));
+            ds->ntiers = it->ntiers;
+            break;
+        }
+    }
+}
+
+/* apply the current entries to the present disks that have been identified */
+static void config_reapply(void)
+{
+    for (DISKSTATS *ds = first_diskstats(); ds != NULL; ds = next_diskstats(ds)) {
+        int idle_time = ds->idle_time, group = ds->group;
+        unsigned int min_ops = ds->min_ops, min_kbytes = ds->min_kbytes;
+        EPC_TIER tiers[EPC_TIERS];
+        int ntiers = ds->ntiers;
+
+        if (ds->backend == NULL) {
+            continue;       /* applied when its first probe completes */
+        }
+        memcpy(tiers, ds->tiers, sizeof(tiers));
+        config_apply(ds);
+        if (ds->idle_time == idle_time && ds->group == group && ds->min_ops == min_ops && ds->min_kbytes == min_kbytes &&
+            ds->ntiers == ntiers && memcmp(ds->tiers, tiers, sizeof(tiers)) == 0) {
+            continue;
+        }
+        lprintf("%s: idle time %d s, %u ops, %u kbytes per minute%s%s\n", ds->name, ds->idle_time, ds->min_ops, ds->min_kbytes,
+                (ds->group >= 0) ? ", group " : "", group_name(ds));
+
+        /* evaluate the disk against its new settings right away */
+        if (ds->sched_pos >= 0) {
+            sched_insert(ds, device_ops->ticks());
+        }
+    }
+}
+
+/* take over a single line in the format of the file, replacing the entry
+ * with the same key; returns 0 on success */
+int config_update(const char *line)
+{
+    char buf[CONFIG_LINE_SIZE];
+    const char *error = NULL;
+    IDLE_TIME *it, **pp;
+
+    strncpy(buf, line, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    if ((it = config_parse(buf, &error)) == NULL) {
+        dprintf("config: ignoring \"%s\"; %s\n", line, error);
+        return -1;
+    }
+    for (pp = &config_root; *pp != NULL; pp = &(*pp)->next) {
+        if (strcmp((*pp)->name, it->name) == 0) {
+            IDLE_TIME *old = *pp;
+            it->next = old->next;
+            old->next = NULL;
+            config_free(old);
+            break;
+        }
+    }
+    *pp = it;
+    config_groups();
+    config_reapply();
+    return 0;
+}
+
+/* reload the file when a change has settled; returns the ms until a pending
+ * reload is due, INFINITE if none is */
+DWORD config_poll(ULONGLONG now)
+{
+    IDLE_TIME *root;
+    int entries = 0;
+    bool ok;
+
+    if (config_reload_at == 0) {
+        return INFINITE;
+    }
+    if (now < config_reload_at) {
+        return (DWORD)(config_reload_at - now);
+    }
+    config_reload_at = 0;
+
+    root = config_read(&ok);
+    if (!ok) {
+        return INFINITE;
+    }
+    config_free(config_root);
+    config_root = root;
+    config_groups();
+    config_loads++;
+    for (IDLE_TIME *it = config_root; it != NULL; it = it->next) {
+        ++entries;
+    }
+    lprintf("config %s: reloaded, %d disk entries\n", config_path, entries);
+    config_reapply();
+    return INFINITE;
+}
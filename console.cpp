@@ -0,0 +1,182 @@
+/*
+ * console.cpp - console output decoupled from the main loop
+ *
+ * Copyright (c) 2022 RalfOGit
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Writing to the console blocks while the console window is in QuickEdit
+ * selection mode (a single click into the window) or while its output is
+ * slow, and the main loop must not stall with it. Once the main loop runs,
+ * console_printf() therefore only formats the line into a slot of a bounded
+ * lock-free queue (multiple producers: the main loop and the probe workers)
+ * and a separate thread writes the lines to stdout, or stderr for errors. If
+ * the queue is full, the line is dropped and counted instead of waiting.
+ *
+ * Each line has a verbosity level: V_ERROR, V_STATE (spin-downs, spin-ups,
+ * arrivals, ...) and V_DEBUG (every probe); lines above the level given with
+ * -v (or -d for V_DEBUG) are not even formatted.
+ */
+
+#include "hd-idle.h"
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CONSOLE_LINES       1024    /* slots in the queue; a power of two */
+#define CONSOLE_LINE_SIZE   256
+#define CONSOLE_CLOSE_WAIT  1000    /* ms to wait for the remaining lines on exit */
+
+/* a slot is free for the producer at position pos if seq == pos, and holds
+ * a line for the consumer at position pos if seq == pos + 1 */
+typedef struct CONSOLE_SLOT {
+    volatile LONG      seq;
+    int                level;
+    char               text[CONSOLE_LINE_SIZE];
+} CONSOLE_SLOT;
+
+static CONSOLE_SLOT     console_slots[CONSOLE_LINES];
+static volatile LONG    console_head = 0;       /* next position to fill */
+static LONG             console_tail = 0;       /* next position to write; writer thread only */
+static volatile LONG    console_dropped = 0;
+static volatile LONG    console_signaled = 0;
+
+static HANDLE           console_thread = NULL;
+static HANDLE           console_event = NULL;   /* auto-reset; new lines */
+static volatile LONG    console_stop = 0;
+
+int verbosity = V_STATE;
+
+static void console_write(int level, const char *text, size_t len)
+{
+    DWORD cb;
+    WriteFile(GetStdHandle((level == V_ERROR) ? STD_ERROR_HANDLE : STD_OUTPUT_HANDLE), text, (DWORD)len, &cb, NULL);
+    InterlockedExchangeAdd(&profile.console_bytes, (LONG)len);
+}
+
+/* write the queued lines; returns once the queue is empty */
+static void console_drain(void)
+{
+    char note[64];
+    LONG dropped;
+
+    for (;;) {
+        CONSOLE_SLOT *slot = &console_slots[console_tail & (CONSOLE_LINES - 1)];
+        if (slot->seq != console_tail + 1) {
+            break;      /* empty, or the next line is still being formatted */
+        }
+        console_write(slot->level, slot->text, strlen(slot->text));
+        InterlockedExchange(&slot->seq, console_tail + CONSOLE_LINES);
+        ++console_tail;
+    }
+    if ((dropped = InterlockedExchange(&console_dropped, 0)) > 0) {
+        int n = snprintf(note, sizeof(note), "(%ld lines dropped)\n", dropped);
+        console_write(V_STATE, note, n);
+    }
+}
+
+static DWORD WINAPI console_writer(LPVOID param)
+{
+    while (!console_stop) {
+        WaitForSingleObject(console_event, INFINITE);
+        InterlockedExchange(&console_signaled, 0);
+        console_drain();
+    }
+    console_drain();
+    return 0;
+}
+
+/* start the writer thread; until then (and if it cannot be started), lines
+ * are written directly */
+void console_open(void)
+{
+    for (LONG i = 0; i < CONSOLE_LINES; ++i) {
+        console_slots[i].seq = i;
+    }
+    if ((console_event = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL ||
+        (console_thread = CreateThread(NULL, 0, console_writer, NULL, 0, NULL)) == NULL) {
+        return;
+    }
+    atexit(console_close);
+}
+
+/* write the remaining lines, unless the console stays blocked */
+void console_close(void)
+{
+    HANDLE thread = console_thread;
+
+    if (thread == NULL) {
+        return;
+    }
+    InterlockedExchange(&console_stop, 1);
+    SetEvent(console_event);
+    if (WaitForSingleObject(thread, CONSOLE_CLOSE_WAIT) == WAIT_OBJECT_0) {
+        console_thread = NULL;
+        CloseHandle(thread);
+    }
+}
+
+/* print a line of the given verbosity level; never blocks once the writer runs */
+void console_printf(int level, const char *fmt, ...)
+{
+    CONSOLE_SLOT *slot;
+    va_list va;
+    LONG pos;
+
+    if (level > verbosity) {
+        return;
+    }
+    if (console_thread == NULL) {
+        va_start(va, fmt);
+        vfprintf((level == V_ERROR) ? stderr : stdout, fmt, va);
+        va_end(va);
+        return;
+    }
+
+    /* claim the slot at the head */
+    for (pos = console_head; ; ) {
+        slot = &console_slots[pos & (CONSOLE_LINES - 1)];
+        LONG diff = slot->seq - pos;
+        if (diff == 0) {
+            LONG prev = InterlockedCompareExchange(&console_head, pos + 1, pos);
+            if (prev == pos) {
+                break;
+            }
+            pos = prev;
+        } else if (diff < 0) {
+            /* full; the writer has not caught up */
+            InterlockedIncrement(&console_dropped);
+            return;
+        } else {
+            pos = console_head;
+        }
+    }
+
+    va_start(va, fmt);
+    vsnprintf(slot->text, sizeof(slot->text), fmt, va);
+    va_end(va);
+    if (strlen(slot->text) == sizeof(slot->text) - 1) {
+        slot->text[sizeof(slot->text) - 2] = '\n';     /* truncated */
+    }
+    slot->level = level;
+
+    /* publish the line and wake the writer if it may be waiting */
+    InterlockedExchange(&slot->seq, pos + 1);
+    if (InterlockedExchange(&console_signaled, 1) == 0) {
+        SetEvent(console_event);
+    }
+}
@@ -0,0 +1,443 @@
+/*
+ * control.cpp - spin-up on request through a named pipe
+ *
+ * Copyright (c) 2022 RalfOGit
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * A job that is about to read from several spun down disks would otherwise
+ * wait for their spin-ups one after another. The main loop therefore serves
+ * the local pipe CONTROL_PIPE, on which a job (or "hd-idle -w", which does
+ * just that) sends one line
+ *
+ *   wake <disk> [<disk> ...] <minutes>
+ *
+ * with up to CONTROL_DRIVES disks named \\.\PhysicalDriveN or PhysicalDriveN
+ * and up to CONTROL_MAX_MINUTES minutes; any other line is answered with
+ * "error <usage>". Each disk is then spun up by its next probe, which is
+ * started right away, exactly like a disk whose group is woken (group.cpp):
+ * the probes run on the thread pool concurrently, subject to the -n limit,
+ * and use the wake command of the disk's backend (ata idle mode, scsi start
+ * unit, nvme power state 0). None of the disks is spun down again before the
+ * given number of minutes has passed. Once all disks have been found
+ * running (or CONTROL_TIMEOUT ms have passed), the reply is written and the
+ * pipe is closed:
+ *
+ *   ready <disk> <ms>          running <ms> after the request
+ *   failed <disk>              the wake command failed or timed out
+ *   unknown <disk>             not present
+ *   done <ready>/<disks>
+ *
+ * The pipe uses the default security of named pipes, so requests can only
+ * be written by administrators and the account hd-idle runs under, and
+ * remote clients are rejected. All pipe instances share one event for
+ * their overlapped operations, which the main loop waits on.
+ */
+
+#include "hd-idle.h"
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CONTROL_PIPE        "\\\\.\\pipe\\hd-idle"
+#define CONTROL_CLIENTS     4       /* pipe instances, i.e. concurrent requests */
+#define CONTROL_DRIVES      16      /* disks per request */
+#define CONTROL_TIMEOUT     120000  /* ms until the disks that are not running count as failed */
+#define CONTROL_BUF_SIZE    1024
+#define CONTROL_MAX_MINUTES 525600  /* a year */
+
+enum { CONTROL_IDLE, CONTROL_LISTENING, CONTROL_READING, CONTROL_WAKING, CONTROL_WRITING, CONTROL_CLOSING };
+enum { WAKE_WAITING, WAKE_READY, WAKE_FAILED, WAKE_UNKNOWN };
+
+typedef struct CONTROL_DRIVE {
+    char               name[32];    /* as given in the request */
+    int                drive;
+    int                state;       /* WAKE_WAITING, ... */
+    unsigned int       probes;      /* ds->probes once a probe has evaluated the disk after the request */
+    ULONGLONG          ready_ms;    /* after the request */
+} CONTROL_DRIVE;
+
+typedef struct CONTROL_CLIENT {
+    HANDLE             pipe;
+    OVERLAPPED         ov;
+    int                state;       /* CONTROL_LISTENING, ... */
+    char               buf[CONTROL_BUF_SIZE];   /* request, then reply */
+    DWORD              len;
+    ULONGLONG          started;     /* GetTickCount64() time of the request */
+    int                ndrives;
+    CONTROL_DRIVE      drives[CONTROL_DRIVES];
+} CONTROL_CLIENT;
+
+static CONTROL_CLIENT   control_clients[CONTROL_CLIENTS];
+static HANDLE           control_event = NULL;      /* manual-reset; shared by all instances */
+
+static void control_printf(CONTROL_CLIENT *c, const char *fmt, ...)
+{
+    va_list va;
+    int n;
+
+    va_start(va, fmt);
+    n = vsnprintf(c->buf + c->len, sizeof(c->buf) - c->len, fmt, va);
+    va_end(va);
+    if (n > 0 && c->len + n < sizeof(c->buf)) {
+        c->len += n;
+    }
+}
+
+static void control_reset(CONTROL_CLIENT *c);
+
+/* read from the client of an instance: its request, or with CONTROL_CLOSING,
+ * the end of the pipe once the client has taken the reply and closed it */
+static void control_read(CONTROL_CLIENT *c, int state)
+{
+    c->state = state;
+    c->len = 0;
+    if (!ReadFile(c->pipe, c->buf, sizeof(c->buf) - 1, NULL, &c->ov) && GetLastError() != ERROR_IO_PENDING) {
+        control_reset(c);
+    }
+}
+
+/* wait for the next client on an instance */
+static void control_listen(CONTROL_CLIENT *c)
+{
+    c->state = CONTROL_LISTENING;
+    c->ndrives = 0;
+    if (!ConnectNamedPipe(c->pipe, &c->ov)) {
+        DWORD error = GetLastError();
+        if (error == ERROR_PIPE_CONNECTED) {
+            control_read(c, CONTROL_READING);       /* connected before the call */
+        } else if (error != ERROR_IO_PENDING) {
+            dprintf("control: cannot listen; error %lu\n", error);
+            c->state = CONTROL_IDLE;
+        }
+    }
+}
+
+/* drop the client of an instance and wait for the next one */
+static void control_reset(CONTROL_CLIENT *c)
+{
+    DisconnectNamedPipe(c->pipe);
+    control_listen(c);
+}
+
+/* write the reply in buf; the operation resets the shared event, so have
+ * control_service() look at the other instances again */
+static void control_write(CONTROL_CLIENT *c)
+{
+    c->state = CONTROL_WRITING;
+    if (!WriteFile(c->pipe, c->buf, c->len, NULL, &c->ov) && GetLastError() != ERROR_IO_PENDING) {
+        control_reset(c);
+    }
+    SetEvent(control_event);
+}
+
+/* serve the pipe; returns 0 on success */
+int control_init(void)
+{
+    if ((control_event = CreateEvent(NULL, TRUE, FALSE, NULL)) == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < CONTROL_CLIENTS; ++i) {
+        CONTROL_CLIENT *c = &control_clients[i];
+
+        /* the first instance fails if another hd-idle serves the pipe already */
+        c->pipe = CreateNamedPipeA(CONTROL_PIPE, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | ((i == 0) ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+                                   PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                   CONTROL_CLIENTS, CONTROL_BUF_SIZE, CONTROL_BUF_SIZE, 0, NULL);
+        if (c->pipe == INVALID_HANDLE_VALUE) {
+            dprintf("control: cannot create %s; error %lu\n", CONTROL_PIPE, GetLastError());
+            if (i == 0) {
+                CloseHandle(control_event);
+                control_event = NULL;
+                return -1;
+            }
+            c->state = CONTROL_IDLE;
+            continue;
+        }
+        c->ov.hEvent = control_event;
+        control_listen(c);
+    }
+    return 0;
+}
+
+/* event that is signaled when an operation on the pipe has completed, NULL
+ * if the pipe is not served */
+HANDLE control_handle(void)
+{
+    return control_event;
+}
+
+/* write the reply of a request whose disks have all been settled */
+static void control_reply(CONTROL_CLIENT *c)
+{
+    int ready = 0;
+
+    c->len = 0;
+    for (int i = 0; i < c->ndrives; ++i) {
+        CONTROL_DRIVE *d = &c->drives[i];
+        switch (d->state) {
+        case WAKE_READY:    control_printf(c, "ready %s %llu\n", d->name, d->ready_ms); ++ready; break;
+        case WAKE_UNKNOWN:  control_printf(c, "unknown %s\n", d->name); break;
+        default:            control_printf(c, "failed %s\n", d->name); break;
+        }
+    }
+    control_printf(c, "done %d/%d\n", ready, c->ndrives);
+    lprintf("control: %d of %d disks running after %llu ms\n", ready, c->ndrives, GetTickCount64() - c->started);
+    control_write(c);
+}
+
+/* settle the disks of a request that have been found running, or whose
+ * spin-up has failed; replies once all of them are settled */
+static void control_check(CONTROL_CLIENT *c, bool timeout)
+{
+    bool settled = true;
+
+    for (int i = 0; i < c->ndrives; ++i) {
+        CONTROL_DRIVE *d = &c->drives[i];
+        DISKSTATS *ds = get_diskstats(d->drive);
+
+        if (d->state != WAKE_WAITING) {
+            continue;
+        }
+        if (ds == NULL) {
+            d->state = WAKE_FAILED;     /* removed meanwhile */
+        } else if (ds->ignored || (ds->probes >= d->probes && !ds->spun_down)) {
+            /* running, or never spun down */
+            d->state = WAKE_READY;
+            d->ready_ms = GetTickCount64() - c->started;
+        } else if ((ds->probes >= d->probes && !ds->wake_pending) || timeout) {
+            /* the wake command has been issued, but the disk is still spun down */
+            d->state = WAKE_FAILED;
+        } else {
+            settled = false;
+        }
+    }
+    if (settled) {
+        control_reply(c);
+    }
+}
+
+/* the <minutes> of a request; -1 unless it is a number within 0..CONTROL_MAX_MINUTES */
+static int control_minutes(const char *s, const char *end)
+{
+    char *stop;
+    long minutes;
+
+    if (s == end || *s < '0' || *s > '9') {
+        return -1;
+    }
+    minutes = strtol(s, &stop, 10);
+    return (stop == end && minutes <= CONTROL_MAX_MINUTES) ? (int)minutes : -1;
+}
+
+/* take over the request line of a client: look up the disks, hold them
+ * awake and have their next probes spin them up right away */
+static void control_request(CONTROL_CLIENT *c)
+{
+    char *argv[CONTROL_DRIVES + 2], *p;
+    int argc = 0, minutes;
+    ULONGLONG now = GetTickCount64();
+
+    c->buf[c->len] = '\0';
+    c->buf[strcspn(c->buf, "\r\n")] = '\0';
+    for (p = strtok(c->buf, " \t"); p != NULL; p = strtok(NULL, " \t")) {
+        if (argc == CONTROL_DRIVES + 2) {
+            argc = 0;       /* more disks than a request can hold */
+            break;
+        }
+        argv[argc++] = p;
+    }
+    if (argc < 3 || strcmp(argv[0], "wake") != 0 ||
+        (minutes = control_minutes(argv[argc - 1], argv[argc - 1] + strlen(argv[argc - 1]))) < 0) {
+        c->len = 0;
+        control_printf(c, "error usage: wake <disk> [<disk> ...] <minutes>, at most %d disks\n", CONTROL_DRIVES);
+        control_write(c);
+        return;
+    }
+
+    c->started = now;
+    c->ndrives = 0;
+    for (int i = 1; i < argc - 1; ++i) {
+        CONTROL_DRIVE *d = &c->drives[c->ndrives++];
+        const char *name = argv[i];
+        DISKSTATS *ds;
+        char x;
+
+        strncpy(d->name, name, sizeof(d->name) - 1);
+        d->name[sizeof(d->name) - 1] = '\0';
+        if (strncmp(name, "\\\\.\\", 4) == 0) {
+            name += 4;
+        }
+        if (sscanf(name, "PhysicalDrive%d%c", &d->drive, &x) != 1 || (ds = get_diskstats(d->drive)) == NULL) {
+            d->state = WAKE_UNKNOWN;
+            continue;
+        }
+        d->state = WAKE_WAITING;
+
+        /* the result of a probe that is already running counts as well; a
+         * disk that it finds spun down keeps wake_pending and is woken by
+         * the next one */
+        d->probes = ds->probes + 1;
+
+        if (ds->hold_until < time(NULL) + minutes * 60) {
+            ds->hold_until = time(NULL) + minutes * 60;
+        }
+        ds->wake_pending = 1;
+        if (ds->sched_pos >= 0) {
+            sched_insert(ds, device_ops->ticks());
+        }
+        lprintf("%s: spin-up requested, held for %d min\n", ds->name, minutes);
+    }
+    c->state = CONTROL_WAKING;
+    control_check(c, false);
+}
+
+/* advance the instances whose operations have completed */
+void control_service(void)
+{
+    bool progress;
+
+    /* starting an operation resets the shared event, which may hide the
+     * completion of another instance; so all instances are checked again
+     * until none of them has made progress */
+    ResetEvent(control_event);
+    do {
+        progress = false;
+        for (int i = 0; i < CONTROL_CLIENTS; ++i) {
+            CONTROL_CLIENT *c = &control_clients[i];
+            DWORD n = 0;
+
+            if (c->state == CONTROL_IDLE || c->state == CONTROL_WAKING) {
+                continue;
+            }
+            if (!GetOverlappedResult(c->pipe, &c->ov, &n, FALSE)) {
+                if (GetLastError() == ERROR_IO_INCOMPLETE) {
+                    continue;
+                }
+                control_reset(c);       /* the client has gone */
+                progress = true;
+                continue;
+            }
+            progress = true;
+            switch (c->state) {
+            case CONTROL_LISTENING:
+                control_read(c, CONTROL_READING);
+                break;
+            case CONTROL_READING:
+                c->len = n;
+                control_request(c);
+                break;
+            case CONTROL_WRITING:
+                /* disconnecting now would discard the reply if the client has not read it yet */
+                control_read(c, CONTROL_CLOSING);
+                break;
+            case CONTROL_CLOSING:
+                control_reset(c);
+                break;
+            }
+        }
+    } while (progress);
+}
+
+/* a disk has been probed; settle the requests that wait for it */
+void control_probed(DISKSTATS *ds)
+{
+    for (int i = 0; i < CONTROL_CLIENTS; ++i) {
+        CONTROL_CLIENT *c = &control_clients[i];
+        if (c->state == CONTROL_WAKING) {
+            control_check(c, false);
+        }
+    }
+}
+
+/* fail the disks of requests that have waited too long; returns the ms until
+ * the next request times out, INFINITE if none waits */
+DWORD control_poll(ULONGLONG now)
+{
+    DWORD timeout = INFINITE;
+
+    for (int i = 0; i < CONTROL_CLIENTS; ++i) {
+        CONTROL_CLIENT *c = &control_clients[i];
+        if (c->state != CONTROL_WAKING) {
+            continue;
+        }
+        if (now >= c->started + CONTROL_TIMEOUT) {
+            control_check(c, true);
+        } else if (timeout > c->started + CONTROL_TIMEOUT - now) {
+            timeout = (DWORD)(c->started + CONTROL_TIMEOUT - now);
+        }
+    }
+    return timeout;
+}
+
+/* hd-idle -w: send a request to the running hd-idle and print the reply once
+ * the disks are running; returns the exit code */
+int control_wake(const char *spec)
+{
+    char request[CONTROL_BUF_SIZE], reply[CONTROL_BUF_SIZE];
+    const char *colon = strrchr(spec, ':');
+    size_t len = 0;
+    int minutes, ndrives = 0;
+    DWORD n;
+    HANDLE h;
+    bool ok = false;
+
+    if (colon == NULL || colon == spec || (minutes = control_minutes(colon + 1, colon + 1 + strlen(colon + 1))) < 0) {
+        fprintf(stderr, "error: -w requires <disk>[,<disk>...]:<minutes>\n");
+        return 1;
+    }
+    len = snprintf(request, sizeof(request), "wake ");
+    for (const char *p = spec; p < colon && len < sizeof(request); ) {
+        size_t n = strcspn(p, ",:");
+        len += snprintf(request + len, sizeof(request) - len, "%.*s ", (int)n, p);
+        p += n + 1;
+        ++ndrives;
+    }
+    if (ndrives > CONTROL_DRIVES || len >= sizeof(request) - 16) {
+        fprintf(stderr, "error: at most %d disks\n", CONTROL_DRIVES);
+        return 1;
+    }
+    len += snprintf(request + len, sizeof(request) - len, "%d\n", minutes);
+
+    while ((h = CreateFileA(CONTROL_PIPE, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL)) == INVALID_HANDLE_VALUE) {
+        if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipeA(CONTROL_PIPE, 5000)) {
+            fprintf(stderr, "cannot connect to %s; is hd-idle running? error %lu\n", CONTROL_PIPE, GetLastError());
+            return 2;
+        }
+    }
+    if (!WriteFile(h, request, (DWORD)len, &n, NULL)) {
+        fprintf(stderr, "cannot send request; error %lu\n", GetLastError());
+        CloseHandle(h);
+        return 2;
+    }
+
+    /* the reply comes once the disks are running; hd-idle waits for this end to close the pipe */
+    while (ReadFile(h, reply, sizeof(reply) - 1, &n, NULL) && n > 0) {
+        const char *done;
+        int ready, total;
+
+        reply[n] = '\0';
+        fputs(reply, stdout);
+        if ((done = strstr(reply, "done ")) != NULL || strncmp(reply, "error ", 6) == 0) {
+            ok = done != NULL && sscanf(done, "done %d/%d", &ready, &total) == 2 && ready == total;
+            break;
+        }
+    }
+    CloseHandle(h);
+    return ok ? 0 : 1;
+}
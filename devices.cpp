@@ -0,0 +1,212 @@
+/*
+ * devices.cpp - disk enumeration and arrival/removal tracking for hd-idle
+ *
+ * Copyright (c) 2022 RalfOGit
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Instead of probing PhysicalDrive0..254 on every poll, the disks are
+ * enumerated once through SetupAPI (GUID_DEVINTERFACE_DISK). After that, the
+ * configuration manager notifies us about disk interface arrivals and
+ * removals, and the disk list is re-enumerated only when such a notification
+ * has been received. Thus the cost of a poll depends on the number of disks
+ * actually present and gaps in the drive numbering do not hide any disks.
+ */
+
+#include <initguid.h>
+#include "hd-idle.h"
+#include <SetupAPI.h>
+#include <cfgmgr32.h>
+#include <stdlib.h>
+#include <string.h>
+
+#pragma comment(lib, "setupapi.lib")
+#pragma comment(lib, "cfgmgr32.lib")
+
+static HCMNOTIFICATION  devices_notification = NULL;
+static HANDLE           devices_event = NULL;   /* auto-reset; set on arrival or removal */
+
+/* called by the configuration manager on a thread pool thread */
+static DWORD CALLBACK devices_callback(HCMNOTIFICATION hNotify, PVOID context, CM_NOTIFY_ACTION action, PCM_NOTIFY_EVENT_DATA data, DWORD size)
+{
+    switch (action) {
+    case CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL:
+    case CM_NOTIFY_ACTION_DEVICEINTERFACEREMOVAL:
+        SetEvent(devices_event);
+        break;
+    default:
+        break;
+    }
+    return ERROR_SUCCESS;
+}
+
+/* enumerate the present disks and register for arrival/removal notifications;
+ * returns 0 on success, -1 if the caller has to fall back to probing */
+int devices_init(void)
+{
+    CM_NOTIFY_FILTER filter;
+
+    if ((devices_event = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL) {
+        return -1;
+    }
+
+    memset(&filter, 0x00, sizeof(filter));
+    filter.cbSize = sizeof(filter);
+    filter.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+    filter.u.DeviceInterface.ClassGuid = GUID_DEVINTERFACE_DISK;
+    if (CM_Register_Notification(&filter, NULL, devices_callback, &devices_notification) != CR_SUCCESS) {
+        dprintf("devices: cannot register for device notifications\n");
+        CloseHandle(devices_event);
+        devices_event = NULL;
+        return -1;
+    }
+
+    devices_enumerate();
+    return 0;
+}
+
+/* event that is signaled on a disk arrival or removal (auto-reset) */
+HANDLE devices_handle(void)
+{
+    return devices_event;
+}
+
+/* enumerate the present disks and update the DISKSTATS list: add disks that
+ * have arrived and remove disks that have disappeared */
+void devices_enumerate(void)
+{
+    SP_DEVICE_INTERFACE_DATA ifd;
+    DISKSTATS *ds;
+    HDEVINFO devs;
+
+    devs = SetupDiGetClassDevs(&GUID_DEVINTERFACE_DISK, NULL, NULL, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
+    if (devs == INVALID_HANDLE_VALUE) {
+        dprintf("devices: cannot enumerate disks; error %lu\n", GetLastError());
+        return;
+    }
+
+    for (ds = first_diskstats(); ds != NULL; ds = next_diskstats(ds)) {
+        ds->present = 0;
+    }
+
+    ifd.cbSize = sizeof(ifd);
+    for (DWORD i = 0; SetupDiEnumDeviceInterfaces(devs, NULL, &GUID_DEVINTERFACE_DISK, i, &ifd); ++i) {
+        PSP_DEVICE_INTERFACE_DETAIL_DATA_A detail;
+        STORAGE_DEVICE_NUMBER sdn;
+        DWORD size = 0;
+
+        SetupDiGetDeviceInterfaceDetailA(devs, &ifd, NULL, 0, &size, NULL);
+        if (size == 0 || (detail = (PSP_DEVICE_INTERFACE_DETAIL_DATA_A)malloc(size)) == NULL) {
+            continue;
+        }
+        detail->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_A);
+        if (!SetupDiGetDeviceInterfaceDetailA(devs, &ifd, detail, size, NULL, NULL)) {
+            free(detail);
+            continue;
+        }
+
+        // open the disk interface (must not set GENERIC_READ or GENERIC_WRITE, as otherwise the device will be woken up)
+        HANDLE hDevice = CreateFileA(detail->DevicePath, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+        free(detail);
+        if (hDevice == INVALID_HANDLE_VALUE) {
+            if (GetLastError() == ERROR_ACCESS_DENIED) {
+                console_printf(V_ERROR, "devices: application requires admin privileges\n");
+            }
+            continue;
+        }
+
+        /* map the interface to its PhysicalDriveN number */
+        DWORD cb = 0;
+        if (!profile_ioctl(hDevice, IOCTL_STORAGE_GET_DEVICE_NUMBER, NULL, 0, &sdn, sizeof(sdn), &cb, NULL)) {
+            CloseHandle(hDevice);
+            continue;
+        }
+
+        if ((ds = get_diskstats((int)sdn.DeviceNumber)) != NULL) {
+            CloseHandle(hDevice);
+        } else {
+            /* new disk; the entry takes over the handle */
+            if ((ds = new_diskstats((int)sdn.DeviceNumber, hDevice)) == NULL) {
+                CloseHandle(hDevice);
+                continue;
+            }
+            lprintf("%s: arrived\n", ds->name);
+        }
+        ds->present = 1;
+    }
+    SetupDiDestroyDeviceInfoList(devs);
+
+    /* drop the disks that are gone */
+    for (ds = first_diskstats(); ds != NULL; ds = next_diskstats(ds)) {
+        if (!ds->present) {
+            lprintf("%s: removed\n", ds->name);
+            trace_event(ds, TRACE_STOP, filetime_now(), 0);
+            remove_diskstats(ds);
+        }
+    }
+}
+
+/* find the disks holding the volume of a file or directory; returns the
+ * number of drive numbers stored, 0 if they cannot be determined */
+int volume_disks(const char *path, int *drives, int max)
+{
+    char full[MAX_PATH], mount[MAX_PATH], volume[MAX_PATH];
+    size_t len;
+    int n;
+
+    if (GetFullPathNameA(path, sizeof(full), full, NULL) == 0 ||
+        !GetVolumePathNameA(full, mount, sizeof(mount)) ||
+        !GetVolumeNameForVolumeMountPointA(mount, volume, sizeof(volume))) {
+        return 0;
+    }
+
+    /* \\?\Volume{guid}\ -> \\?\Volume{guid}; open without access rights, so the disks are not woken up */
+    if ((len = strlen(volume)) > 0 && volume[len - 1] == '\\') {
+        volume[len - 1] = '\0';
+    }
+    HANDLE hVolume = CreateFileA(volume, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+    if (hVolume == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+    n = volume_handle_disks(hVolume, drives, max);
+    CloseHandle(hVolume);
+    return n;
+}
+
+/* find the disks holding a volume opened as \\?\Volume{guid}; returns the
+ * number of (distinct) drive numbers stored */
+int volume_handle_disks(HANDLE hVolume, int *drives, int max)
+{
+    union {
+        VOLUME_DISK_EXTENTS vde;
+        char                buf[sizeof(VOLUME_DISK_EXTENTS) + 31 * sizeof(DISK_EXTENT)];
+    } extents;
+    DWORD cb = 0;
+    int n = 0;
+
+    if (profile_ioctl(hVolume, IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS, NULL, 0, &extents, sizeof(extents), &cb, NULL)) {
+        for (DWORD i = 0; i < extents.vde.NumberOfDiskExtents && n < max; ++i) {
+            int drive = (int)extents.vde.Extents[i].DiskNumber;
+            int j;
+            for (j = 0; j < n && drives[j] != drive; ++j);
+            if (j == n) {
+                drives[n++] = drive;
+            }
+        }
+    }
+    return n;
+}
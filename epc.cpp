@@ -0,0 +1,238 @@
+/*
+ * epc.cpp - idle tiers through ata extended power conditions
+ *
+ * Copyright (c) 2022 RalfOGit
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * A spun down disk takes seconds to answer again. Disks with the Extended
+ * Power Conditions feature set (EPC, ACS-3) have intermediate states that
+ * are left within milliseconds: idle_a (electronics partly off), idle_b
+ * (heads unloaded), idle_c (heads unloaded, lower rpm) and standby_y
+ * (lower rpm, between idle_c and a full stop). With -T (or tiers= in the
+ * -f file), a disk is put into such states as its idle time grows, e.g.
+ *
+ *   -T idle_b:120,idle_c:600 -i 1800
+ *
+ * unloads the heads after 2 minutes, lowers the rpm after 10 and spins
+ * the disk down after 30. Each tier is entered with SET FEATURES, EPC "go
+ * to power condition", by the worker of a probe of its own, like a
+ * spin-down; the disk leaves the state by itself on the next i/o, which
+ * also restarts the tiers. Whether a disk supports EPC is taken from its
+ * IDENTIFY DEVICE data when the first tier is due; if it is supported but
+ * disabled, it is enabled. Disks without EPC (or ata pass-through) ignore
+ * their tiers and are only spun down.
+ */
+
+#include "hd-idle.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define EPC_TIMEOUT         10      /* s; lowering the rpm takes a while */
+
+static const struct {
+    const char        *name;
+    UCHAR              condition;
+} epc_conditions[] = {
+    /* in order of depth */
+    { "idle_a",    0x81 },
+    { "idle_b",    0x82 },
+    { "idle_c",    0x83 },
+    { "standby_y", 0x01 },
+};
+
+const char *epc_name(UCHAR condition)
+{
+    for (size_t i = 0; i < sizeof(epc_conditions) / sizeof(epc_conditions[0]); ++i) {
+        if (epc_conditions[i].condition == condition) {
+            return epc_conditions[i].name;
+        }
+    }
+    return "?";
+}
+
+static int epc_depth(UCHAR condition)
+{
+    for (size_t i = 0; i < sizeof(epc_conditions) / sizeof(epc_conditions[0]); ++i) {
+        if (epc_conditions[i].condition == condition) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/* parse <condition>:<seconds>[,<condition>:<seconds>...]; the tiers must get
+ * deeper with their idle times. Returns the number of tiers or -1. */
+int epc_parse(const char *spec, EPC_TIER *tiers)
+{
+    int n = 0;
+
+    for (const char *p = spec; *p != '\0'; ) {
+        size_t len = strcspn(p, ":");
+        size_t i;
+
+        for (i = 0; i < sizeof(epc_conditions) / sizeof(epc_conditions[0]); ++i) {
+            if (strlen(epc_conditions[i].name) == len && strncmp(p, epc_conditions[i].name, len) == 0) {
+                break;
+            }
+        }
+        if (i == sizeof(epc_conditions) / sizeof(epc_conditions[0]) || p[len] != ':' || n == EPC_TIERS) {
+            return -1;
+        }
+        tiers[n].condition = epc_conditions[i].condition;
+        if ((tiers[n].after = atoi(p + len + 1)) <= 0) {
+            return -1;
+        }
+        if (n > 0 && (tiers[n].after <= tiers[n - 1].after || epc_depth(tiers[n].condition) <= epc_depth(tiers[n - 1].condition))) {
+            return -1;
+        }
+        ++n;
+        p += len + 1 + strcspn(p + len + 1, ",");
+        if (*p == ',') {
+            ++p;
+        }
+    }
+    return n;
+}
+
+/* can the tiers of a disk be used? */
+static bool epc_usable(DISKSTATS *ds)
+{
+    return ds->ntiers > 0 && ds->backend == &backend_ata && ds->caps.epc != EPC_NONE && !ds->spun_down && !ds->new_disk;
+}
+
+/* the tier a disk that has been idle for the given time is to enter now, -1 if none */
+int epc_due(DISKSTATS *ds, LONGLONG idle_ms)
+{
+    int due = -1;
+
+    if (!epc_usable(ds)) {
+        return -1;
+    }
+    for (int i = ds->epc_tier + 1; i < ds->ntiers; ++i) {
+        if (idle_ms >= ds->tiers[i].after * 1000LL && (ds->idle_time == 0 || ds->tiers[i].after < ds->idle_time)) {
+            due = i;    /* the deepest one that is due; those before it are skipped */
+        }
+    }
+    return due;
+}
+
+/* ms until the next tier of a disk is due, -1 if none is ahead */
+LONGLONG epc_next(DISKSTATS *ds, LONGLONG now_ft)
+{
+    int i = ds->epc_tier + 1;
+    LONGLONG left;
+
+    if (!epc_usable(ds) || i >= ds->ntiers || (ds->idle_time != 0 && ds->tiers[i].after >= ds->idle_time)) {
+        return -1;
+    }
+    left = ds->last_io_ft + ds->tiers[i].after * 10000000LL - now_ft;
+    return (left > 0) ? (left + 9999) / 10000 : 0;     /* rounded up, like policy_next_probe() */
+}
+
+/* enter a tier with a probe of its own */
+void epc_start(DISKSTATS *ds, int tier)
+{
+    ds->probe.epc = tier;
+    probe_start(ds);
+}
+
+/* find out whether the disk supports EPC and enable it if it does; runs on
+ * the worker of the probe */
+static int epc_detect(DISKSTATS *ds)
+{
+    UCHAR taskfile[8] = { 0 };
+    USHORT id[256];
+
+    taskfile[6] = 0xEC;     /*  "IDENTIFY DEVICE"  */
+    if (!ata_taskfile(ds, taskfile, id, sizeof(id), 3, "epc_identify") || (taskfile[6] & 0x01)) {
+        return EPC_NONE;
+    }
+
+    /* word 119 and 120: commands and feature sets supported and enabled, if bit 14 is set and bit 15 is not */
+    if ((id[119] & 0xC000) != 0x4000 || !(id[119] & 0x0080)) {
+        dprintf("epc %s: not supported\n", ds->name);
+        return EPC_NONE;
+    }
+    if ((id[120] & 0xC000) == 0x4000 && (id[120] & 0x0080)) {
+        return EPC_OK;
+    }
+
+    memset(taskfile, 0x00, sizeof(taskfile));
+    taskfile[0] = 0x4A;     /*  features: extended power conditions  */
+    taskfile[2] = 0x04;     /*  lba: subcommand enable the EPC feature set  */
+    taskfile[6] = 0xEF;     /*  "SET FEATURES"  */
+    if (!ata_taskfile(ds, taskfile, NULL, 0, 3, "epc_enable") || (taskfile[6] & 0x01)) {
+        dprintf("epc %s: cannot be enabled\n", ds->name);
+        return EPC_NONE;
+    }
+    dprintf("epc %s: enabled\n", ds->name);
+    return EPC_OK;
+}
+
+/* runs on a worker thread */
+void epc_run(DISKSTATS *ds)
+{
+    PROBE *p = &ds->probe;
+    UCHAR taskfile[8] = { 0 };
+
+    p->status = PROBE_OK;
+    p->error = 0;
+    p->epc_ok = 0;
+
+    /* written by this worker only; read by the main thread after the probe */
+    if (ds->caps.epc == 0) {
+        ds->caps.epc = epc_detect(ds);
+    }
+    if (ds->caps.epc != EPC_OK) {
+        p->error = ERROR_NOT_SUPPORTED;
+        return;
+    }
+
+    taskfile[0] = 0x4A;                             /*  features: extended power conditions  */
+    taskfile[1] = ds->tiers[p->epc].condition;      /*  count: power condition id  */
+    taskfile[2] = 0x01;                             /*  lba: subcommand go to power condition, not held  */
+    taskfile[6] = 0xEF;                             /*  "SET FEATURES"  */
+    if (!ata_taskfile(ds, taskfile, NULL, 0, EPC_TIMEOUT, "epc_go_to_power_condition")) {
+        p->error = GetLastError();
+    } else if (taskfile[6] & 0x01) {
+        p->error = ERROR_NOT_SUPPORTED;             /*  aborted, e.g. the condition is not supported  */
+    } else {
+        p->epc_ok = 1;
+    }
+}
+
+void epc_evaluate(DISKSTATS *ds)
+{
+    PROBE *p = &ds->probe;
+    int tier = p->epc;
+
+    p->epc = -1;
+
+    /* a failed tier is not tried again before the next i/o */
+    ds->epc_tier = tier;
+    if (ds->caps.epc == EPC_NONE) {
+        lprintf("%s: no extended power conditions; idle tiers ignored\n", ds->name);
+        return;
+    }
+    if (!p->epc_ok) {
+        lprintf("%s: cannot enter %s; error %lu\n", ds->name, epc_name(ds->tiers[tier].condition), p->error);
+        return;
+    }
+    lprintf("%s: %s after %llu s idle\n", ds->name, epc_name(ds->tiers[tier].condition),
+            (unsigned long long)(p->time - ds->last_io));
+}
@@ -0,0 +1,219 @@
+/*
+ * etw.cpp - disk activity detection through kernel disk i/o events
+ *
+ * Copyright (c) 2022 RalfOGit
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * When started with -e, hd-idle runs a real-time ETW session subscribed to the
+ * Microsoft-Windows-Kernel-Disk provider. Every disk read and write completion
+ * is counted per disk and the time stamp of the latest one is recorded. The
+ * probe then takes read/write counts and the exact time of the last i/o from
+ * here, instead of issuing IOCTL_DISK_PERFORMANCE and power state requests to
+ * the drive, and last_io is no longer off by up to one poll interval.
+ *
+ * After a disk has been spun down, the response time of the first i/o that
+ * completes on it is recorded as its spin-up latency: that i/o had to wait for
+ * the disk to spin up.
+ */
+
+#include "hd-idle.h"
+#include <evntrace.h>
+#include <evntcons.h>
+#include <string.h>
+
+#pragma comment(lib, "advapi32.lib")
+
+#define ETW_SESSION_NAME    "hd-idle"
+#define ETW_EVENT_READ      10      /* Microsoft-Windows-Kernel-Disk: read completed */
+#define ETW_EVENT_WRITE     11      /* Microsoft-Windows-Kernel-Disk: write completed */
+
+/* Microsoft-Windows-Kernel-Disk {C7BDE69A-E1E0-4177-B6EF-283AD1525271} */
+static const GUID kernel_disk_provider = { 0xc7bde69a, 0xe1e0, 0x4177, { 0xb6, 0xef, 0x28, 0x3a, 0xd1, 0x52, 0x52, 0x71 } };
+
+static TRACEHANDLE      etw_session = 0;
+static TRACEHANDLE      etw_trace = INVALID_PROCESSTRACE_HANDLE;
+
+/* per-disk counters, indexed by disk number (written by the trace thread) */
+static volatile LONG     etw_reads[MAX_DISKS];
+static volatile LONG     etw_writes[MAX_DISKS];
+static volatile LONGLONG etw_bytes_read[MAX_DISKS];
+static volatile LONGLONG etw_bytes_written[MAX_DISKS];
+static volatile LONGLONG etw_last_io[MAX_DISKS];   /* FILETIME of the latest i/o */
+static volatile LONG     etw_armed[MAX_DISKS];     /* spun down; next completion is the spin-up */
+static volatile LONG     etw_wake_ms[MAX_DISKS];   /* spin-up latency, -1 if none measured */
+static int               etw_was_down[MAX_DISKS];  /* main thread only */
+static LARGE_INTEGER     etw_qpc_freq;
+
+int etw_active = 0;
+
+/* session properties, followed by the session name */
+static EVENT_TRACE_PROPERTIES *etw_properties(void)
+{
+    static char buffer[sizeof(EVENT_TRACE_PROPERTIES) + sizeof(ETW_SESSION_NAME)];
+    EVENT_TRACE_PROPERTIES *props = (EVENT_TRACE_PROPERTIES*)buffer;
+
+    memset(buffer, 0x00, sizeof(buffer));
+    props->Wnode.BufferSize = sizeof(buffer);
+    props->Wnode.Flags = WNODE_FLAG_TRACED_GUID;
+    props->Wnode.ClientContext = 2;     /* time stamps in system time (FILETIME) */
+    props->LogFileMode = EVENT_TRACE_REAL_TIME_MODE;
+    props->FlushTimer = 1;              /* deliver buffered events at least every second */
+    props->LoggerNameOffset = sizeof(EVENT_TRACE_PROPERTIES);
+    return props;
+}
+
+static void WINAPI etw_callback(PEVENT_RECORD rec)
+{
+    USHORT id = rec->EventHeader.EventDescriptor.Id;
+    LONGLONG stamp = rec->EventHeader.TimeStamp.QuadPart;
+    LONGLONG last;
+    ULONG drive;
+
+    if ((id != ETW_EVENT_READ && id != ETW_EVENT_WRITE) || rec->UserDataLength < sizeof(ULONG)) {
+        return;
+    }
+
+    /* the disk number is the first field of the payload */
+    drive = *(ULONG*)rec->UserData;
+    if (drive >= MAX_DISKS) {
+        return;
+    }
+
+    /* HighResResponseTime (qpc ticks) follows DiskNumber, IrpFlags, TransferSize,
+     * Reserved, ByteOffset, FileObject and Irp; record it before the counts change */
+    if (etw_armed[drive] && InterlockedExchange(&etw_armed[drive], 0)) {
+        ULONG ptr = (rec->EventHeader.Flags & EVENT_HEADER_FLAG_64_BIT_HEADER) ? 8 : 4;
+        ULONG offset = 4 * sizeof(ULONG) + sizeof(ULONGLONG) + 2 * ptr;
+        if (rec->UserDataLength >= offset + sizeof(ULONGLONG) && etw_qpc_freq.QuadPart > 0) {
+            ULONGLONG ticks;
+            memcpy(&ticks, (char*)rec->UserData + offset, sizeof(ticks));
+            InterlockedExchange(&etw_wake_ms[drive], (LONG)(ticks * 1000 / etw_qpc_freq.QuadPart));
+        }
+    }
+    if (rec->UserDataLength >= 3 * sizeof(ULONG)) {
+        ULONG size = ((ULONG*)rec->UserData)[2];     /* TransferSize */
+        InterlockedAdd64((id == ETW_EVENT_READ) ? &etw_bytes_read[drive] : &etw_bytes_written[drive], size);
+    }
+    InterlockedIncrement((id == ETW_EVENT_READ) ? &etw_reads[drive] : &etw_writes[drive]);
+
+    /* events of different processors may arrive out of order */
+    do {
+        last = etw_last_io[drive];
+    } while (stamp > last && InterlockedCompareExchange64(&etw_last_io[drive], stamp, last) != last);
+}
+
+static DWORD WINAPI etw_thread(LPVOID param)
+{
+    ProcessTrace(&etw_trace, 1, NULL, NULL);
+    return 0;
+}
+
+/* start the trace session; returns 0 on success, -1 if the probes have to
+ * fall back to the disk performance counters */
+int etw_init(void)
+{
+    EVENT_TRACE_LOGFILEA log;
+    ULONG status;
+    HANDLE thread;
+
+    QueryPerformanceFrequency(&etw_qpc_freq);
+    for (int i = 0; i < MAX_DISKS; ++i) {
+        etw_wake_ms[i] = -1;
+    }
+
+    status = StartTraceA(&etw_session, ETW_SESSION_NAME, etw_properties());
+    if (status == ERROR_ALREADY_EXISTS) {
+        /* left over from a previous run that did not stop it */
+        ControlTraceA(0, ETW_SESSION_NAME, etw_properties(), EVENT_TRACE_CONTROL_STOP);
+        status = StartTraceA(&etw_session, ETW_SESSION_NAME, etw_properties());
+    }
+    if (status != ERROR_SUCCESS) {
+        dprintf("etw: cannot start trace session; error %lu\n", status);
+        return -1;
+    }
+
+    status = EnableTraceEx2(etw_session, &kernel_disk_provider, EVENT_CONTROL_CODE_ENABLE_PROVIDER, TRACE_LEVEL_INFORMATION, 0, 0, 0, NULL);
+    if (status != ERROR_SUCCESS) {
+        dprintf("etw: cannot enable kernel disk provider; error %lu\n", status);
+        etw_exit();
+        return -1;
+    }
+
+    memset(&log, 0x00, sizeof(log));
+    log.LoggerName = (LPSTR)ETW_SESSION_NAME;
+    log.ProcessTraceMode = PROCESS_TRACE_MODE_REAL_TIME | PROCESS_TRACE_MODE_EVENT_RECORD;
+    log.EventRecordCallback = etw_callback;
+    if ((etw_trace = OpenTraceA(&log)) == INVALID_PROCESSTRACE_HANDLE) {
+        dprintf("etw: cannot open trace session; error %lu\n", GetLastError());
+        etw_exit();
+        return -1;
+    }
+
+    if ((thread = CreateThread(NULL, 0, etw_thread, NULL, 0, NULL)) == NULL) {
+        etw_exit();
+        return -1;
+    }
+    CloseHandle(thread);
+
+    etw_active = 1;
+    return 0;
+}
+
+/* stop the trace session; real-time sessions outlive the process otherwise */
+void etw_exit(void)
+{
+    if (etw_trace != INVALID_PROCESSTRACE_HANDLE) {
+        CloseTrace(etw_trace);
+        etw_trace = INVALID_PROCESSTRACE_HANDLE;
+    }
+    if (etw_session != 0) {
+        ControlTraceA(etw_session, NULL, etw_properties(), EVENT_TRACE_CONTROL_STOP);
+        etw_session = 0;
+    }
+    etw_active = 0;
+}
+
+/* fill in the read/write counts and bytes of a disk since the session
+ * started, the FILETIME of its latest i/o (0 if none was seen) and the
+ * spin-up latency measured since the previous query (-1 if none) */
+void etw_query(int drive, PROBE *p)
+{
+    memset(&p->perf, 0x00, sizeof(p->perf));
+    p->etw_last_io = 0;
+    p->wake_ms = -1;
+    if (drive < 0 || drive >= MAX_DISKS) {
+        return;
+    }
+    p->wake_ms = InterlockedExchange(&etw_wake_ms[drive], -1);
+    p->perf.ReadCount = (DWORD)etw_reads[drive];
+    p->perf.WriteCount = (DWORD)etw_writes[drive];
+    p->perf.BytesRead.QuadPart = etw_bytes_read[drive];
+    p->perf.BytesWritten.QuadPart = etw_bytes_written[drive];
+    p->etw_last_io = etw_last_io[drive];
+}
+
+/* tell the trace thread whether a disk is spun down; the first completion
+ * after a spin-down is measured as spin-up */
+void etw_disk_state(int drive, int spun_down)
+{
+    if (drive < 0 || drive >= MAX_DISKS || etw_was_down[drive] == spun_down) {
+        return;
+    }
+    etw_was_down[drive] = spun_down;
+    InterlockedExchange(&etw_armed[drive], spun_down);
+}
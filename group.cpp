@@ -0,0 +1,255 @@
+/*
+ * group.cpp - drive groups and staggered power commands for hd-idle
+ *
+ * Copyright (c) 2022 RalfOGit
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Disks sharing an enclosure, a power rail or a controller can be put into a
+ * named group with -g <group>[:<policy>,...] following their -a option. The
+ * policies of a group are:
+ *
+ * - together: when a member is spun down, the other members are probed right
+ *   away and spun down as well if they have been idle for at least a quarter
+ *   of their own idle time;
+ * - wake: when a member is found spun up, the other members that are spun
+ *   down are spun up too (ata IDLE IMMEDIATE), so that a striped pool waits
+ *   for one spin-up instead of one per disk in turn. Spun-down members of such
+ *   a group are polled at their regular interval, so the first access is
+ *   noticed early.
+ *
+ * With -n <max>[:<ms>], hd-idle issues at most <max> spin-down and spin-up
+ * commands within any window of <ms> (default GROUP_WINDOW) milliseconds,
+ * over all disks; a disk whose command would exceed this is retried when the
+ * window has passed. Spin-ups that Windows causes itself are not affected.
+ */
+
+#include "hd-idle.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define GROUP_WINDOW        3000    /* ms; default window of the -n limit */
+
+typedef struct GROUP {
+    char              *name;
+    int                policy;      /* GROUP_TOGETHER | GROUP_WAKE */
+} GROUP;
+
+static GROUP            groups[MAX_GROUPS];
+static int              group_count = 0;
+static int              group_fixed = 0;        /* groups given with -g; the others come from -f */
+static int              group_fixed_policy[MAX_GROUPS];
+
+static int              group_max_cmds = 0;     /* 0 = unlimited */
+static ULONGLONG        group_window = GROUP_WINDOW;
+static ULONGLONG        group_window_start = 0;
+static int              group_window_cmds = 0;
+
+/* split <name>[:<policy>,...] into the length of the name and the policies;
+ * returns 0 if the spec is valid */
+static int group_parse(const char *spec, size_t *len, int *policy)
+{
+    const char *colon = strchr(spec, ':');
+
+    *len = (colon != NULL) ? (size_t)(colon - spec) : strlen(spec);
+    *policy = 0;
+    if (*len == 0) {
+        return -1;
+    }
+    if (colon != NULL) {
+        for (const char *p = colon + 1; *p != '\0'; ) {
+            size_t n = strcspn(p, ",");
+            if (n == 8 && strncmp(p, "together", n) == 0) {
+                *policy |= GROUP_TOGETHER;
+            } else if (n == 4 && strncmp(p, "wake", n) == 0) {
+                *policy |= GROUP_WAKE;
+            } else {
+                return -1;
+            }
+            p += n;
+            if (*p == ',') {
+                ++p;
+            }
+        }
+    }
+    return 0;
+}
+
+/* is <name>[:<policy>,...] a valid group spec? */
+bool group_valid(const char *spec)
+{
+    size_t len;
+    int policy;
+
+    return group_parse(spec, &len, &policy) == 0;
+}
+
+/* Look up or add the group given as <name>[:<policy>,...] and merge the
+ * policies; returns its index or -1 if the spec is invalid.
+ */
+int group_add(const char *spec)
+{
+    size_t len;
+    int policy;
+    int g;
+
+    if (group_parse(spec, &len, &policy) != 0) {
+        return -1;
+    }
+
+    for (g = 0; g < group_count; ++g) {
+        if (strlen(groups[g].name) == len && strncmp(groups[g].name, spec, len) == 0) {
+            break;
+        }
+    }
+    if (g == group_count) {
+        if (group_count == MAX_GROUPS || (groups[g].name = (char*)malloc(len + 1)) == NULL) {
+            return -1;
+        }
+        memcpy(groups[g].name, spec, len);
+        groups[g].name[len] = '\0';
+        ++group_count;
+    }
+    groups[g].policy |= policy;
+    return g;
+}
+
+/* the groups given so far (with -g) are kept when the -f file is read again */
+void group_freeze(void)
+{
+    group_fixed = group_count;
+    for (int g = 0; g < group_fixed; ++g) {
+        group_fixed_policy[g] = groups[g].policy;
+    }
+}
+
+/* drop the groups and policies added since group_freeze(), before the
+ * entries of the -f file are resolved again */
+void group_reset(void)
+{
+    for (int g = group_fixed; g < group_count; ++g) {
+        free(groups[g].name);
+        groups[g].name = NULL;
+    }
+    group_count = group_fixed;
+    for (int g = 0; g < group_fixed; ++g) {
+        groups[g].policy = group_fixed_policy[g];
+    }
+}
+
+/* set the -n limit from <max>[:<ms>]; returns 0 on success */
+int group_limit(const char *spec)
+{
+    int max, ms = GROUP_WINDOW;
+    char c;
+
+    if (sscanf(spec, "%d:%d%c", &max, &ms, &c) != 2 && sscanf(spec, "%d%c", &max, &c) != 1) {
+        return -1;
+    }
+    if (max <= 0 || ms <= 0) {
+        return -1;
+    }
+    group_max_cmds = max;
+    group_window = ms;
+    return 0;
+}
+
+/* policies of the group of a disk, 0 if it is in none */
+int group_policy(DISKSTATS *ds)
+{
+    return (ds->group >= 0 && ds->group < group_count) ? groups[ds->group].policy : 0;
+}
+
+const char *group_name(DISKSTATS *ds)
+{
+    return (ds->group >= 0 && ds->group < group_count) ? groups[ds->group].name : "";
+}
+
+/* may a spin-down or spin-up command be issued now? counts it if so */
+bool group_issue(ULONGLONG now)
+{
+    if (group_max_cmds == 0) {
+        return true;
+    }
+    if (now >= group_window_start + group_window) {
+        group_window_start = now;
+        group_window_cmds = 0;
+    }
+    if (group_window_cmds == group_max_cmds) {
+        return false;
+    }
+    ++group_window_cmds;
+    return true;
+}
+
+/* device_ops->ticks() time at which a command held back by the limit may be retried */
+ULONGLONG group_retry(void)
+{
+    return group_window_start + group_window;
+}
+
+/* have the siblings of a disk probed right away */
+static void group_probe_now(DISKSTATS *ds)
+{
+    if (ds->sched_pos >= 0) {
+        sched_insert(ds, device_ops->ticks());
+    }
+}
+
+/* a disk has been spun down; ask the running siblings to follow */
+void group_spun_down(DISKSTATS *ds)
+{
+    if (!(group_policy(ds) & GROUP_TOGETHER)) {
+        return;
+    }
+    for (DISKSTATS *sib = first_diskstats(); sib != NULL; sib = next_diskstats(sib)) {
+        if (sib != ds && sib->group == ds->group && !sib->spun_down && !sib->new_disk) {
+            sib->join_spindown = 1;
+            group_probe_now(sib);
+        }
+    }
+}
+
+/* should a sibling that was asked to follow a spin-down join it? */
+bool group_join(DISKSTATS *ds, LONGLONG idle_ms)
+{
+    return ds->idle_time != 0 && idle_ms >= ds->idle_time * 1000LL / 4;
+}
+
+/* a disk has been found spun up; spin up the siblings that are spun down */
+void group_spun_up(DISKSTATS *ds)
+{
+    if (!(group_policy(ds) & GROUP_WAKE)) {
+        return;
+    }
+    for (DISKSTATS *sib = first_diskstats(); sib != NULL; sib = next_diskstats(sib)) {
+        if (sib != ds && sib->group == ds->group && sib->spun_down) {
+            sib->wake_pending = 1;
+            group_probe_now(sib);
+        }
+    }
+}
+
+/* just before a disk is probed: turn a pending wake into a spin-up by the
+ * probe, if the limit allows it */
+void group_prepare(DISKSTATS *ds, ULONGLONG now)
+{
+    if (ds->wake_pending && ds->spun_down && group_issue(now)) {
+        ds->wake_pending = 0;
+        ds->probe.wake = 1;
+    }
+}
@@ -145,37 +145,26 @@ typedef __int64 ssize_t;
 typedef long ssize_t;
 #endif
 
+#include "hd-idle.h"
+
 #define STAT_FILE "/proc/diskstats"
-#define DEFAULT_IDLE_TIME 60
-
-#define dprintf if (debug) printf
-
-/* typedefs and structures */
-typedef struct IDLE_TIME {
-    struct IDLE_TIME  *next;
-    char              *name;
-    int                idle_time;
-} IDLE_TIME;
-
-typedef struct DISKSTATS {
-    struct DISKSTATS  *next;
-    char               name[50];
-    int                idle_time;
-    time_t             last_io;
-    time_t             spindown;
-    time_t             spinup;
-    unsigned int       spun_down : 1;
-    unsigned int       reads;
-    unsigned int       writes;
-} DISKSTATS;
 
 /* function prototypes */
-static DISKSTATS  *get_diskstats   (const char *name);
+#ifndef HD_IDLE_BENCH
+static BOOL WINAPI console_handler (DWORD type);
+#endif
+static int         wait_events     (DWORD timeout_ms);
+static int         probe_new_disks (void);
+static void        probe_query     (DISKSTATS *ds);
+static void        spindown_run    (DISKSTATS *ds);
+static ULONGLONG   tick_count      (void);
+static HANDLE      drive_open      (const char *name, DWORD access);
+static void        drive_close     (DISKSTATS *ds);
+static void        free_diskstats  (DISKSTATS *ds);
+static int         ata_command     (DISKSTATS *ds, UCHAR command, ULONG timeout, const char *what);
 static void        spindown_disk   (const char *name);
-static int         ata_check_power_mode(const char *name);
-static bool        ata_set_idle_mode(const char *name);
-static bool        ata_set_standby_mode(const char *name);
 static char       *disk_name       (char *name);
+static int         disk_number     (const char *name);
 static void        phex            (const void *p, int len, const char *fmt, ...);
 extern int         getopt          (int nargc, char *const nargv[], const char *ostr);
 extern char       *optarg;         /* argument associated with option */
@@ -187,16 +176,31 @@ extern int         optreset;       /* reset getopt */
 
 /* global/static variables */
 IDLE_TIME *it_root;
-DISKSTATS *ds_root;
-char *logfile = "/dev/null";
-int debug = 1;
-
-/* main function */
+DISKSTATS *ds_table;        /* disk state, indexed by drive number */
+int ds_capacity;            /* number of entries in ds_table */
+int ds_end;                 /* one past the highest drive number in use */
+char *logfile = NULL;
+int probe_drives = 0;
+int lazy_power_check = 0;
+static int use_etw = 0;
+static int bench_cycles = 0;
+static int metrics_port = 0;
+static int profile_minutes = 0;
+static int collector_port = 0;
+static char *agent_spec = NULL;
+static char *key_path = NULL;
+static char *snapshot_path = NULL;
+static char *config_path = NULL;
+static char *trace_path = NULL;
+static char *simulate_path = NULL;
+static HANDLE wait_timer = NULL;
+
+/* main function; hd-idle-bench has its own (mock.cpp) */
+#ifndef HD_IDLE_BENCH
 int main(int argc, char *argv[]) {
     IDLE_TIME *it;
-    int have_logfile = 0;
-    int min_idle_time;
-    int sleep_time;
+    int run_service = 0;
+    int have_verbosity = 0;
     int opt;
 
     /* create default idle-time parameter entry */
@@ -206,11 +210,17 @@ int main(int argc, char *argv[]) {
     }
     it->next = NULL;
     it->name = NULL;
+    it->drive = -1;
     it->idle_time = DEFAULT_IDLE_TIME;
+    it->min_ops = 0;
+    it->min_kbytes = 0;
+    it->group = -1;
+    it->group_spec = NULL;
+    it->ntiers = 0;
     it_root = it;
 
     /* process command line options */
-    while ((opt = getopt(argc, argv, "t:a:i:l:dh")) != -1) {
+    while ((opt = getopt(argc, argv, "t:w:a:i:T:F:o:k:l:b:m:P:S:f:R:x:A:C:K:g:n:v:pcesIUVNdh")) != -1) {
         switch (opt) {
 
         case 't':
@@ -218,6 +228,10 @@ int main(int argc, char *argv[]) {
             spindown_disk(optarg);
             return 0;
 
+        case 'w':
+            /* have the running hd-idle spin up the specified disks and keep them running */
+            return control_wake(optarg);
+
         case 'a':
             /* add a new set of idle-time parameters for this particular disk */
             if ((it = (IDLE_TIME*)malloc(sizeof(*it))) == NULL) {
@@ -225,7 +239,16 @@ int main(int argc, char *argv[]) {
                 return 2;
             }
             it->name = disk_name(optarg);
+            if ((it->drive = disk_number(it->name)) < 0) {
+                fprintf(stderr, "error: %s is not a \\\\.\\PhysicalDriveN disk name\n", it->name);
+                return 1;
+            }
             it->idle_time = DEFAULT_IDLE_TIME;
+            it->min_ops = 0;
+            it->min_kbytes = 0;
+            it->group = -1;
+            it->group_spec = NULL;
+            it->ntiers = 0;
             it->next = it_root;
             it_root = it;
             break;
@@ -235,17 +258,167 @@ int main(int argc, char *argv[]) {
             it->idle_time = atoi(optarg);
             break;
 
+        case 'T':
+            /* enter lower power conditions before the spin-down on current (or default) disk */
+            if ((it->ntiers = epc_parse(optarg, it->tiers)) < 0) {
+                fprintf(stderr, "error: -T requires <condition>:<seconds>[,...] with conditions idle_a, idle_b, idle_c, standby_y\n");
+                return 1;
+            }
+            break;
+
+        case 'o':
+            /* ignore activity of at most this many i/os per minute on current (or default) disk */
+            it->min_ops = atoi(optarg);
+            break;
+
+        case 'k':
+            /* ignore activity of at most this many kbytes per minute on current (or default) disk */
+            it->min_kbytes = atoi(optarg);
+            break;
+
+        case 'g':
+            /* put current (or default) disk into a group of disks that share power or a controller */
+            if ((it->group = group_add(optarg)) < 0) {
+                fprintf(stderr, "error: -g requires <group>[:together][,wake]\n");
+                return 1;
+            }
+            break;
+
+        case 'n':
+            /* issue at most this many spin-down and spin-up commands per window */
+            if (group_limit(optarg) != 0) {
+                fprintf(stderr, "error: -n requires <max>[:<ms>]\n");
+                return 1;
+            }
+            break;
+
         case 'l':
             logfile = optarg;
-            have_logfile = 1;
             break;
 
+        case 'b':
+            /* measure probe cycles instead of spinning down disks */
+            if ((bench_cycles = atoi(optarg)) <= 0) {
+                fprintf(stderr, "error: -b requires a number of cycles\n");
+                return 1;
+            }
+            break;
+
+        case 'm':
+            /* serve per-disk counters on localhost */
+            if ((metrics_port = atoi(optarg)) <= 0 || metrics_port > 65535) {
+                fprintf(stderr, "error: -m requires a port number\n");
+                return 1;
+            }
+            break;
+
+        case 'F':
+            /* report what hd-idle itself costs every this many minutes */
+            if ((profile_minutes = atoi(optarg)) <= 0) {
+                fprintf(stderr, "error: -F requires a number of minutes\n");
+                return 1;
+            }
+            break;
+
+        case 'P':
+            /* adapt spin-downs to the idle gaps seen so far */
+            if ((policy_break_even = atoi(optarg)) <= 0) {
+                fprintf(stderr, "error: -P requires a break-even time in seconds\n");
+                return 1;
+            }
+            break;
+
+        case 'S':
+            /* keep the disk state across restarts */
+            snapshot_path = optarg;
+            break;
+
+        case 'V':
+            /* report the volumes whose i/o keeps a disk awake */
+            volumes_enabled = 1;
+            break;
+
+        case 'N':
+            /* also put nvme disks into their deepest non-operational power state */
+            nvme_power = 1;
+            break;
+
+        case 'R':
+            /* record the i/o of the disks for -x */
+            trace_path = optarg;
+            break;
+
+        case 'x':
+            /* replay a recorded trace against various policies instead of running the main loop */
+            simulate_path = optarg;
+            break;
+
+        case 'A':
+            /* report the disk state to a collector */
+            agent_spec = optarg;
+            break;
+
+        case 'K':
+            /* key that authenticates the policy pushed by the collector */
+            key_path = optarg;
+            break;
+
+        case 'C':
+            /* collect the disk state of the agents instead of running the main loop */
+            if ((collector_port = atoi(optarg)) <= 0 || collector_port > 65535) {
+                fprintf(stderr, "error: -C requires a port number\n");
+                return 1;
+            }
+            break;
+
+        case 'f':
+            /* per-disk settings by serial number, wwn or guid */
+            config_path = optarg;
+            break;
+
+        case 'p':
+            /* probe PhysicalDrive0..254 on every poll instead of tracking device arrival/removal */
+            probe_drives = 1;
+            break;
+
+        case 'c':
+            /* issue ata check power mode only to verify a spin-down or when the power state is inconclusive */
+            lazy_power_check = 1;
+            break;
+
+        case 'e':
+            /* detect disk activity through kernel disk i/o events (etw) */
+            use_etw = 1;
+            break;
+
+        case 's':
+            /* run as a service (started by the service control manager) */
+            run_service = 1;
+            break;
+
+        case 'I':
+            /* install as a service running with the other options */
+            return service_install(argc, argv);
+
+        case 'U':
+            return service_uninstall();
+
         case 'd':
-            debug = 1;
+            verbosity = V_DEBUG;
+            have_verbosity = 1;
+            break;
+
+        case 'v':
+            verbosity = atoi(optarg);
+            if (verbosity < V_ERROR || verbosity > V_DEBUG) {
+                fprintf(stderr, "error: -v requires a level of 0 (errors), 1 (state transitions) or 2 (debug)\n");
+                return 1;
+            }
+            have_verbosity = 1;
             break;
 
         case 'h':
-            printf("usage: hd-idle [-t <disk>] [-a <name>] [-i <idle_time>] [-l <logfile>] [-d] [-h]\n");
+            printf("usage: hd-idle [-t <disk>] [-w <disk>[,<disk>...]:<minutes>] [-a <name>] [-i <idle_time>] [-T <condition>:<seconds>[,...]] [-o <ops>] [-k <kbytes>] [-g <group>[:<policy>]] [-n <max>[:<ms>]] [-l <logfile>] [-b <cycles>] [-m <port>] [-F <minutes>] [-P <break_even>] [-S <snapshot>] [-f <config>] [-R <trace>] [-x <trace>] [-A <host:port>] [-C <port>] [-K <keyfile>] [-p] [-c] [-e] [-s] [-I] [-U] [-V] [-N] [-v <level>] [-d] [-h]\n");
             return 0;
 
         case ':':
@@ -257,8 +430,55 @@ int main(int argc, char *argv[]) {
             return 1;
         }
     }
+    if (simulate_path != NULL) {
+        return trace_simulate(simulate_path);
+    }
+    if (run_service && !have_verbosity) {
+        /* no console to print to; state transitions go to the event log */
+        verbosity = V_ERROR;
+    }
+
+    /* the main loop runs until stop_event is set (service stop or ctrl+c) */
+    if ((stop_event = CreateEvent(NULL, TRUE, FALSE, NULL)) == NULL) {
+        fprintf(stderr, "cannot create stop event; error %lu\n", GetLastError());
+        return 2;
+    }
+    if (run_service) {
+        return service_run();
+    }
+    SetConsoleCtrlHandler(console_handler, TRUE);
+    return hd_idle_run();
+}
+
+/* stop the main loop on ctrl+c or when the console is closed; ctrl+break
+ * prints the self-profile */
+static BOOL WINAPI console_handler(DWORD type)
+{
+    switch (type) {
+    case CTRL_BREAK_EVENT:
+        profile_request();
+        return TRUE;
+    case CTRL_C_EVENT:
+    case CTRL_CLOSE_EVENT:
+        SetEvent(stop_event);
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+#endif
+
+/* set up and run the main loop until stop_event is set; returns the exit code */
+int hd_idle_run(void)
+{
+    IDLE_TIME *it;
+    int min_idle_time;
+    int sleep_time;
+    ULONGLONG next_discovery = 0;
 
-    /* set sleep time to 1/10th of the shortest idle time */
+    /* set sleep time to 1/10th of the shortest idle time; with -p this is the
+     * interval for probing new disks, the disks themselves are scheduled
+     * individually (see probe_next_poll()) */
     min_idle_time = 1 << 30;
     for (it = it_root; it != NULL; it = it->next) {
         if (it->idle_time != 0 && it->idle_time < min_idle_time) {
@@ -270,196 +490,703 @@ int main(int argc, char *argv[]) {
     }
     if (sleep_time > 10) sleep_time = 10;
 
-    /* main loop: probe for idle disks and stop them */
-    for (;;) {
-    DISKSTATS tmp;
-    memset(&tmp, 0x00, sizeof(tmp));
+    /* subscribe to kernel disk i/o events */
+    if (use_etw) {
+        if (etw_init() != 0) {
+            fprintf(stderr, "kernel disk events not available; using disk performance counters instead\n");
+        } else {
+            atexit(etw_exit);
+        }
+    }
+
+    /* start the logfile writer */
+    if (logfile != NULL && log_open(logfile) != 0) {
+        fprintf(stderr, "cannot write logfile %s\n", logfile);
+        return 2;
+    }
+
+    /* serve the per-disk counters */
+    if (metrics_port != 0 && metrics_init(metrics_port) != 0) {
+        fprintf(stderr, "cannot serve metrics on port %d\n", metrics_port);
+        return 2;
+    }
+
+    /* the main loop waits on this timer instead of sleeping */
+    if ((wait_timer = CreateWaitableTimer(NULL, FALSE, NULL)) == NULL) {
+        fprintf(stderr, "cannot create timer; error %lu\n", GetLastError());
+        return 2;
+    }
+
+    /* allocate the disk table */
+    ds_capacity = MAX_DISKS;
+    if ((ds_table = (DISKSTATS*)calloc(ds_capacity, sizeof(*ds_table))) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+
+    /* read the per-disk settings and watch them for changes */
+    if (config_path != NULL && config_open(config_path) != 0) {
+        fprintf(stderr, "cannot read config file %s\n", config_path);
+        return 2;
+    }
 
-    for (int i = 0; i < 255; ++i) {
+    /* collect the disk state of other hosts instead of managing the disks of this one */
+    if (key_path != NULL && policy_key_open(key_path) != 0) {
+        fprintf(stderr, "cannot read key file %s\n", key_path);
+        return 1;
+    }
+    if (collector_port != 0) {
+        return collector_run(collector_port, config_path);
+    }
+
+    /* report the disk state to a collector */
+    if (agent_spec != NULL && agent_init(agent_spec) != 0) {
+        fprintf(stderr, "cannot report to collector %s\n", agent_spec);
+        return 2;
+    }
+
+    /* load the disk state saved by a previous run */
+    if (snapshot_path != NULL && snapshot_open(snapshot_path) != 0) {
+        fprintf(stderr, "cannot open snapshot file %s\n", snapshot_path);
+        return 2;
+    }
+
+    /* record the i/o of the disks */
+    if (trace_path != NULL && trace_open(trace_path) != 0) {
+        fprintf(stderr, "cannot record trace %s\n", trace_path);
+        return 2;
+    }
+
+    /* enumerate the disks once and track arrivals and removals from then on,
+     * unless probing was requested or device notifications are not available */
+    if (!probe_drives && devices_init() != 0) {
+        fprintf(stderr, "device notifications not available; probing PhysicalDrive0..254 instead\n");
+        probe_drives = 1;
+    }
+
+    /* measure probe cycles over the present disks instead of running the main loop */
+    if (bench_cycles > 0) {
+        if (probe_drives && probe_new_disks() != 0) {
+            return(2);
+        }
+        return bench_run(bench_cycles);
+    }
+
+    /* take spin-up requests of jobs that are about to use the disks */
+    if (control_init() != 0) {
+        fprintf(stderr, "cannot serve spin-up requests; is another hd-idle running?\n");
+    }
+
+    /* count what the main loop costs */
+    if (profile_init(profile_minutes) != 0) {
+        fprintf(stderr, "cannot create event; error %lu\n", GetLastError());
+        return 2;
+    }
+
+    /* from here on, console output must not block the main loop (see console.cpp) */
+    if (!service_mode) {
+        console_open();
+    }
+
+    /* main loop: probe the disks that are due and stop the idle ones */
+    for (;;) {
+        ULONGLONG now = device_ops->ticks();    /* the clock of the schedule */
+        LONGLONG clock = profile_clock();
         DISKSTATS *ds;
-        time_t now = time(NULL);
-        sprintf(tmp.name, "\\\\.\\PhysicalDrive%d", i);
+        DWORD timeout;
+        int outstanding, what;
+
+        if (probe_drives && now >= next_discovery) {
+            if (probe_new_disks() != 0) {
+                return(2);
+            }
+            next_discovery = now + sleep_time * 1000;
+        }
+
+        /* query the due disks concurrently, then evaluate the results that
+         * arrived within the deadline; a disk that is slow to answer is
+         * evaluated on a later pass and does not delay the others */
+        while ((ds = sched_pop_due(now)) != NULL) {
+            group_prepare(ds, now);
+            probe_start(ds);
+        }
+        profile_phase(PHASE_DISPATCH, &clock);
+        outstanding = probe_wait(PROBE_DEADLINE);
+        profile_phase(PHASE_WAIT, &clock);
+        for (ds = first_diskstats(); ds != NULL; ds = next_diskstats(ds)) {
+            if (ds->probe.state == PROBE_DONE) {
+                probe_evaluate(ds);
+                control_probed(ds);
+                if (ds->in_use) {
+                    log_disk_state(ds->drive, ds->spun_down);
+                    if (etw_active) {
+                        etw_disk_state(ds->drive, ds->spun_down);
+                    }
+                    if (!ds->ignored && !sched_insert(ds, probe_next_poll(ds))) {
+                        fprintf(stderr, "out of memory\n");
+                        return(2);
+                    }
+                }
+            }
+        }
+
+        /* a disk that arrived under the number of one of these was not taken yet */
+        if (reap_diskstats() > 0 && !probe_drives) {
+            devices_enumerate();
+        }
+        profile_phase(PHASE_EVALUATE, &clock);
+
+        snapshot_save(0);
+        trace_save(0);
+        agent_update(GetTickCount64());
+        profile_phase(PHASE_PERSIST, &clock);
+
+        /* wait until the next disk is due; a disk arrival or removal ends the wait early */
+        timeout = sched_timeout(device_ops->ticks());
+        if (config_handle() != NULL) {
+            DWORD reload = config_poll(GetTickCount64());
+            if (timeout > reload) {
+                timeout = reload;
+            }
+        }
+        if (metrics_handle() != NULL) {
+            DWORD expiry = metrics_poll(GetTickCount64());
+            if (timeout > expiry) {
+                timeout = expiry;
+            }
+        }
+        if (control_handle() != NULL) {
+            DWORD expiry = control_poll(GetTickCount64());
+            if (timeout > expiry) {
+                timeout = expiry;
+            }
+        }
+        if (profile_handle() != NULL) {
+            DWORD report = profile_poll(GetTickCount64());
+            if (timeout > report) {
+                timeout = report;
+            }
+        }
+        if (outstanding > 0 && timeout > PROBE_DEADLINE) {
+            timeout = PROBE_DEADLINE;
+        }
+        if (probe_drives && timeout > (DWORD)sleep_time * 1000) {
+            timeout = sleep_time * 1000;
+        }
+        what = wait_events(timeout);
+        profile.wakeups[what]++;
+        switch (what) {
+        case WAIT_STOP:
+            probe_wait(PROBE_DEADLINE);
+            snapshot_save(1);
+            trace_close();
+            agent_close();
+            log_close();
+            return 0;
+        case WAIT_DEVICES:
+            devices_enumerate();
+            if (volumes_enabled) {
+                volumes_changed();
+            }
+            break;
+        case WAIT_METRICS:
+            metrics_serve();
+            break;
+        case WAIT_CONFIG:
+            config_changed();
+            break;
+        case WAIT_AGENT:
+            agent_receive();
+            break;
+        case WAIT_CONTROL:
+            control_service();
+            break;
+        case WAIT_PROFILE:
+            profile_report();
+            break;
+        }
+    }
+}
+
+/* Wait for the timer, a disk arrival or removal, a metrics request, a
+ * config change, a datagram of the collector, a spin-up request, a
+ * request for the self-profile or stop_event. The timer may
+ * be delayed by up to 1/100th of the timeout (at most 100ms), so that its expiry can
+ * be coalesced with other timers of the system and does not cause an extra
+ * wakeup of its own.
+ */
+static int wait_events(DWORD timeout_ms)
+{
+    HANDLE handles[8];
+    int what[8];
+    DWORD count = 0;
+    DWORD r;
+
+    what[count] = WAIT_STOP;
+    handles[count++] = stop_event;
+    what[count] = WAIT_TIMER;
+    handles[count++] = wait_timer;
+    if (!probe_drives) {
+        what[count] = WAIT_DEVICES;
+        handles[count++] = devices_handle();
+    }
+    if (metrics_handle() != NULL) {
+        what[count] = WAIT_METRICS;
+        handles[count++] = metrics_handle();
+    }
+    if (config_handle() != NULL) {
+        what[count] = WAIT_CONFIG;
+        handles[count++] = config_handle();
+    }
+    if (agent_handle() != NULL) {
+        what[count] = WAIT_AGENT;
+        handles[count++] = agent_handle();
+    }
+    if (control_handle() != NULL) {
+        what[count] = WAIT_CONTROL;
+        handles[count++] = control_handle();
+    }
+    what[count] = WAIT_PROFILE;
+    handles[count++] = profile_handle();
+
+    if (timeout_ms == INFINITE) {
+        CancelWaitableTimer(wait_timer);
+    } else {
+        LARGE_INTEGER due;
+        due.QuadPart = -(LONGLONG)timeout_ms * 10000;   /* relative, in 100ns units */
+        ULONG tolerance = (timeout_ms / 100 < 100) ? timeout_ms / 100 : 100;
+        if (!SetWaitableTimerEx(wait_timer, &due, 0, NULL, NULL, NULL, tolerance)) {
+            SetWaitableTimer(wait_timer, &due, 0, NULL, NULL, FALSE);
+        }
+    }
+
+    r = WaitForMultipleObjects(count, handles, FALSE, INFINITE);
+    return (r < WAIT_OBJECT_0 + count) ? what[r - WAIT_OBJECT_0] : WAIT_TIMER;
+}
+
+
+/* Probe PhysicalDrive0..254 for disks that are not yet in the list. This stops
+ * at the first drive number that does not exist and is only used when device
+ * arrival/removal notifications are not available (or -p is given).
+ */
+static int probe_new_disks(void)
+{
+    char name[sizeof(DISKSTATS::name)];
+
+    for (int i = 0; i < 255 && i < ds_capacity; ++i) {
+        if (get_diskstats(i) != NULL || ds_table[i].removed) {
+            continue;
+        }
+        sprintf(name, "\\\\.\\PhysicalDrive%d", i);
 
         // open physical drive i  (must not set GENERIC_READ or GENERIC_WRITE, as otherwise the device will be woken up)
-        HANDLE hDevice = CreateFile(tmp.name, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+        HANDLE hDevice = drive_open(name, 0);
         if (hDevice == INVALID_HANDLE_VALUE) {
             DWORD error = GetLastError();
             switch (error) {
             case ERROR_FILE_NOT_FOUND:
                 break;  // reached end of PhysicalDriveX list
             case ERROR_ACCESS_DENIED:
-                printf("probing %s: application requires admin privileges\n", tmp.name);
+                console_printf(V_ERROR, "probing %s: application requires admin privileges\n", name);
                 break;
             }
             break;
         }
 
-        // check if drive is already asleep, if so do not wake it up
-        // this check often does not work for wd red hdds; behaviour is unclear
-        BOOL fOn, r = GetDevicePowerState(hDevice, &fOn);
-        if (r == 0 || fOn == FALSE) {
-            dprintf("probing %s: asleep\n", tmp.name);
-            /* get previous statistics for this disk */
-            ds = get_diskstats(tmp.name);
-            if (ds != NULL) {
-                ds->spun_down = true;
-            }
+        /* new disk; add it to the linked list, it takes over the handle */
+        if (new_diskstats(i, hDevice) == NULL) {
+            fprintf(stderr, "out of memory\n");
             CloseHandle(hDevice);
-            continue;
+            return(-1);
         }
+    }
+    return(0);
+}
+
+
+/* The device backend of the disks of this host: the requests of a probe go
+ * to the drives through the cached handles (see drive_meta_handle()) and the
+ * power commands of their BACKEND (backend.cpp).
+ */
+const DEVICE_OPS device_win32 = { "win32", probe_query, spindown_run, epc_run, filetime_now, tick_count };
 
-        // check if drive is a fixed drive
-        char vol[sizeof(DISKSTATS::name) + 1];
-        strcpy(vol, tmp.name);
-        strcat(vol, "\\");
-        UINT type = GetDriveTypeA(vol);
-        if (type != DRIVE_FIXED) {
-            switch (type) {
-            case DRIVE_UNKNOWN:  	dprintf("probing %s: drive unknown\n", tmp.name); break;		// The drive type cannot be determined.
-            case DRIVE_NO_ROOT_DIR: dprintf("probing %s: root path invalid\n", tmp.name); break;	// The root path is invalid; for example, there is no volume mounted at the specified path.
-            case DRIVE_REMOVABLE:	dprintf("probing %s: removable media\n", tmp.name); break;		// The drive has removable media; for example, a floppy drive, thumb drive, or flash card reader.
-            case DRIVE_FIXED:		dprintf("probing %s: fixed drive\n", tmp.name); break;			// The drive has fixed media; for example, a hard disk drive or an ssd drive.
-            case DRIVE_REMOTE:		dprintf("probing %s: network drive\n", tmp.name); break;		// The drive is a remote(network) drive.
-            case DRIVE_CDROM:		dprintf("probing %s: cdrom drive\n", tmp.name); break;			// The drive is a CD-ROM drive.
-            case DRIVE_RAMDISK:		dprintf("probing %s: ramdisk\n", tmp.name); break;				// The drive is a RAM-Disk
-            default:				dprintf("probing %s: unknown drive type\n", tmp.name); break;
+static ULONGLONG tick_count(void)
+{
+    return GetTickCount64();
+}
+
+/* query power state and read/write counts of a disk (runs on a worker thread;
+ * the worker is the only user of the disk's handles while the probe runs) */
+static void probe_query(DISKSTATS *ds)
+{
+    PROBE *p = &ds->probe;
+
+    p->status = PROBE_OK;
+    p->error = 0;
+    p->ata = -1;
+    p->etw_last_io = 0;
+    p->wake_ms = -1;
+    p->woken = 0;
+
+    // the capabilities and power commands of a new disk are detected once
+    if (p->backend == NULL && (p->backend = caps_detect(ds)) == NULL) {
+        p->status = PROBE_FAILED;
+        p->error = GetLastError();
+        return;
+    }
+    if (!caps_spindown(ds, p->backend)) {
+        p->status = PROBE_IGNORED;
+        return;
+    }
+
+    // spin up a disk whose group is being woken up; the queries below then see it running
+    if (p->wake) {
+        p->woken = p->backend->wake(ds);
+    }
+
+    // when kernel disk events are available, no request has to be sent to the
+    // drive except for spinning it down; otherwise query its power state first
+    if (!etw_active) {
+        // use the cached metadata-only handle, reopening it if a previous request failed
+        HANDLE hDevice = drive_meta_handle(ds);
+        if (hDevice == INVALID_HANDLE_VALUE) {
+            p->error = GetLastError();
+            switch (p->error) {
+            case ERROR_FILE_NOT_FOUND:  p->status = PROBE_MISSING; break;
+            case ERROR_ACCESS_DENIED:   p->status = PROBE_DENIED; break;
+            default:                    p->status = PROBE_FAILED; break;
             }
-            continue;
+            return;
         }
 
-        // check ata power mode; if it wakes up your drive, just disable this part
-        char *ata_power_mode_string = "";
-        int ata = ata_check_power_mode(tmp.name);
-        switch (ata) {
-        case 0x00:  case 0x01:
-            ata_power_mode_string = "standby mode";
-            break;
-        case 0x80:  case 0x81:  case 0x82:  case 0x83:
-            ata_power_mode_string = "idle mode";
-            break;
-        case 0xff:
-            ata_power_mode_string = "active or idle mode";
-            break;
+        // check if drive is already asleep, if so do not wake it up
+        // this check often does not work for wd red hdds; behaviour is unclear
+        // a failure does not mean that the handle is stale (some drives fail
+        // this on every poll), so the handles are kept; only the error is noted
+        BOOL fOn, r = GetDevicePowerState(hDevice, &fOn);
+        if (r == 0) {
+            p->error = GetLastError();
         }
-
-        // query read and write counts
-        DISK_PERFORMANCE disk_performance;
-        DWORD bytesReturned = 0;
-        BOOL result = DeviceIoControl(
-            hDevice,                    // handle to device
-            IOCTL_DISK_PERFORMANCE,     // dwIoControlCode
-            NULL,                       // lpInBuffer
-            0,                          // nInBufferSize
-            &disk_performance,          // output buffer
-            sizeof(disk_performance),   // size of output buffer
-            &bytesReturned,             // number of bytes returned
-            NULL                        // OVERLAPPED structure
-        );
-        if (result == FALSE || bytesReturned <= 0) {
-            DWORD error = GetLastError();
-            dprintf("probing %s: cannot query read/write counts  result %d  bytesReturned %d error 0x%dx\n", tmp.name, result, bytesReturned, error);
-            CloseHandle(hDevice);
-            /* if error code is "invalid function", make sure disk performance counters are enabled */
-            static bool tried_diskperf = false;
-            if (error == 1 && tried_diskperf == false) {
-                tried_diskperf = true;
-                int res = system("diskperf -YD");
+        if (r == 0 && lazy_power_check) {
+            // power state is inconclusive, ask the drive itself
+            p->ata = p->backend->check_power(ds);
+            if (p->ata < 0 || p->ata == 0x00 || p->ata == 0x01) {
+                p->status = PROBE_ASLEEP;
+                return;
             }
-            continue;
+        } else if (r == 0 || fOn == FALSE) {
+            p->status = PROBE_ASLEEP;
+            return;
         }
-        CloseHandle(hDevice);
+    }
+
+    // read and write counts of the volumes on the disk, for attributing its activity
+    if (volumes_enabled) {
+        volumes_query(ds);
+    }
+
+    // take read and write counts from the kernel disk events
+    if (etw_active) {
+        etw_query(ds->drive, p);
+        return;
+    }
 
-        tmp.reads = disk_performance.ReadCount;
-        tmp.writes = disk_performance.WriteCount;
+    // check power mode; if it wakes up your drive, use -c to issue it only when needed
+    if (p->ata < 0 && (!lazy_power_check || ds->verify_spindown)) {
+        p->ata = p->backend->check_power(ds);
+    }
 
-        /* get previous statistics for this disk */
-        ds = get_diskstats(tmp.name);
+    // query read and write counts
+    DWORD bytesReturned = 0;
+    BOOL result = profile_ioctl(
+        drive_meta_handle(ds),      // handle to device (reopened if the ata check dropped it)
+        IOCTL_DISK_PERFORMANCE,     // dwIoControlCode
+        NULL,                       // lpInBuffer
+        0,                          // nInBufferSize
+        &p->perf,                   // output buffer
+        sizeof(p->perf),            // size of output buffer
+        &bytesReturned,             // number of bytes returned
+        NULL                        // OVERLAPPED structure
+    );
+    if (result == FALSE || bytesReturned <= 0) {
+        p->error = GetLastError();
+        drive_failed(ds, p->error);
+        p->status = PROBE_NO_COUNTERS;
+        return;
+    }
+}
 
-        if (ds == NULL) {
-            dprintf("probing %s: reads: %u, writes: %u, new disk - %s\n", tmp.name, tmp.reads, tmp.writes, ata_power_mode_string);
+/* the spin-down pipeline (see spindown_start() in probe.cpp); runs on a worker thread */
+static void spindown_run(DISKSTATS *ds)
+{
+    PROBE *p = &ds->probe;
 
-            /* new disk; just add it to the linked list */
-            if ((ds = (DISKSTATS*)malloc(sizeof(*ds))) == NULL) {
-                fprintf(stderr, "out of memory\n");
-                return(2);
-            }
-            memcpy(ds, &tmp, sizeof(*ds));
-            ds->last_io = now;
-            ds->spinup = ds->last_io;
-            ds->next = ds_root;
-            ds_root = ds;
-
-            /* find idle time for this disk (falling-back to default; default means
-                * 'it->name == NULL' and this entry will always be the last due to the
-                * way this single-linked list is built when parsing command line
-                * arguments)
-                */
-            for (it = it_root; it != NULL; it = it->next) {
-                if (it->name == NULL || !strcmp(ds->name, it->name)) {
-                    ds->idle_time = it->idle_time;
-                    break;
-                }
-            }
+    p->status = PROBE_OK;
+    p->error = 0;
+    p->ata = -1;
+    p->standby_ok = 0;
+
+    HANDLE hDevice = drive_rw_handle(ds);
+    if (hDevice == INVALID_HANDLE_VALUE) {
+        p->error = GetLastError();
+        p->status = PROBE_FAILED;
+        return;
+    }
+    if (!FlushFileBuffers(hDevice)) {
+        dprintf("spindown %s: failed to flush file buffers / write cache\n", ds->name);
+    }
 
+    if (p->backend == NULL && (p->backend = caps_detect(ds)) == NULL) {
+        p->error = GetLastError();
+        p->status = PROBE_FAILED;
+        return;
+    }
+    if (p->backend->standby == NULL) {
+        p->error = ERROR_NOT_SUPPORTED;
+        return;
+    }
+    p->standby_ok = p->backend->standby(ds);
+    if (!p->standby_ok) {
+        p->error = GetLastError();
+        if (p->backend == &backend_ata && (p->error == ERROR_INVALID_FUNCTION || p->error == ERROR_NOT_SUPPORTED)) {
+            /* no ata pass-through to this disk (e.g. some usb bridges); fall back to scsi */
+            p->backend = &backend_scsi;
+            p->standby_ok = p->backend->standby(ds);
+            p->error = p->standby_ok ? 0 : GetLastError();
         }
-        else if (ds->reads == tmp.reads && ds->writes == tmp.writes) {
-            if (!ds->spun_down) {
-                dprintf("probing %s: reads: %u, writes: %u, elapsed %llu / %d - %s\n", tmp.name, tmp.reads, tmp.writes, now - ds->last_io, ds->idle_time, ata_power_mode_string);
-                /* no activity on this disk and still running */
-                if (ds->idle_time != 0 && now - ds->last_io >= ds->idle_time) {
-                    ata_set_standby_mode(ds->name);
-                    ds->spindown = now;
-                    ds->spun_down = 1;
-                }
-            } else {
-                dprintf("probing %s: reads: %u, writes: %u, elapsed %llu / %d spun_down %u - %s\n", tmp.name, tmp.reads, tmp.writes, now - ds->last_io, ds->idle_time, ds->spun_down, ata_power_mode_string);
-            }
+    }
+
+    if (p->standby_ok) {
+        p->ata = p->backend->check_power(ds);
+    }
+}
+
+/* get DISKSTATS entry by drive number */
+DISKSTATS *get_diskstats(int drive)
+{
+    if (drive < 0 || drive >= ds_capacity || !ds_table[drive].in_use) {
+        return(NULL);
+    }
+    return(&ds_table[drive]);
+}
+
+/* iterate over the disks in the table; entries stay valid when a disk is
+ * removed during the iteration */
+static DISKSTATS *find_diskstats(DISKSTATS *ds)
+{
+    for (; ds < ds_table + ds_end; ++ds) {
+        if (ds->in_use) {
+            return(ds);
         }
-        else {
-            dprintf("probing %s: reads: %u, writes: %u, elapsed %llu / %d - %s\n", tmp.name, tmp.reads, tmp.writes, now - ds->last_io, ds->idle_time, ata_power_mode_string);
-            /* disk had some activity */
-            if (ds->spun_down) {
-                /* disk was spun down, thus it has just spun up */
-                ds->spinup = now;
-            }
-            ds->reads = tmp.reads;
-            ds->writes = tmp.writes;
-            ds->last_io = now;
-            ds->spun_down = 0;
+    }
+    return(NULL);
+}
+
+DISKSTATS *first_diskstats(void)
+{
+    return(find_diskstats(ds_table));
+}
+
+DISKSTATS *next_diskstats(DISKSTATS *ds)
+{
+    return(find_diskstats(ds + 1));
+}
+
+/* create DISKSTATS entry for a new disk; the entry takes over the given
+ * metadata handle */
+DISKSTATS *new_diskstats(int drive, HANDLE h_meta)
+{
+    DISKSTATS *ds;
+
+    if (drive < 0 || drive >= ds_capacity) {
+        fprintf(stderr, "drive number %d exceeds disk table\n", drive);
+        return(NULL);
+    }
+    ds = &ds_table[drive];
+    if (ds->removed) {
+        if (ds->probe.state == PROBE_RUNNING) {
+            /* taken again once the probe of the disk that had the number has returned */
+            dprintf("%s: previous disk still being probed\n", ds->name);
+            return(NULL);
         }
+        free_diskstats(ds);
     }
-    sleep(sleep_time);
+    memset(ds, 0x00, sizeof(*ds));
+    if ((ds->probe.done = CreateEvent(NULL, TRUE, FALSE, NULL)) == NULL) {
+        return(NULL);
+    }
+    sprintf(ds->name, "\\\\.\\PhysicalDrive%d", drive);
+    ds->drive = drive;
+    ds->new_disk = 1;
+    ds->h_meta = h_meta;
+    ds->h_rw = INVALID_HANDLE_VALUE;
+    ds->sched_pos = -1;
+    ds->probe.epc = -1;
+    ds->epc_tier = -1;
+    idle_settings(ds);
+
+    /* probe the new disk right away */
+    if (!sched_insert(ds, device_ops->ticks())) {
+        CloseHandle(ds->probe.done);
+        return(NULL);
     }
 
-    return 0;
+    ds->in_use = 1;
+    if (drive >= ds_end) {
+        ds_end = drive + 1;
+    }
+    return(ds);
 }
 
+/* take over the idle time and thresholds given on the command line for a disk */
+void idle_settings(DISKSTATS *ds)
+{
+    IDLE_TIME *it;
+
+    /* find idle time for this disk (falling-back to default; default means
+     * 'it->name == NULL' and this entry will always be the last due to the
+     * way this single-linked list is built when parsing command line
+     * arguments)
+     */
+    for (it = it_root; it != NULL; it = it->next) {
+        if (it->name == NULL || it->drive == ds->drive) {
+            ds->idle_time = it->idle_time;
+            ds->min_ops = it->min_ops;
+            ds->min_kbytes = it->min_kbytes;
+            ds->group = it->group;
+            memcpy(ds->tiers, it->tiers, sizeof(ds->tiers));
+            ds->ntiers = it->ntiers;
+            break;
+        }
+    }
+}
 
-/* get DISKSTATS entry by name of disk */
-static DISKSTATS *get_diskstats(const char *name)
+/* release the handles of an entry that is no longer in use */
+static void free_diskstats(DISKSTATS *ds)
 {
-    DISKSTATS *ds;
+    CloseHandle(ds->probe.done);
+    drive_close(ds);
+    volumes_unmap(ds);
+    ds->removed = 0;
 
-    for (ds = ds_root; ds != NULL; ds = ds->next) {
-        if (!strcmp(ds->name, name)) {
-            return(ds);
+    while (ds_end > 0 && !ds_table[ds_end - 1].in_use && !ds_table[ds_end - 1].removed) {
+        --ds_end;
+    }
+}
+
+/* remove DISKSTATS entry of a disk that has disappeared; while a worker is
+ * still using the entry (e.g. a spin-down that hangs on a bridge that has
+ * gone away), it is only marked, so that the other disks are not held up */
+void remove_diskstats(DISKSTATS *ds)
+{
+    sched_remove(ds);
+    ds->in_use = 0;
+    if (ds->probe.state == PROBE_RUNNING) {
+        dprintf("%s: freed once its probe has returned\n", ds->name);
+        ds->removed = 1;
+        return;
+    }
+    free_diskstats(ds);
+}
+
+/* free the entries of removed disks whose probes have returned; returns
+ * their number */
+int reap_diskstats(void)
+{
+    int reaped = 0;
+
+    for (DISKSTATS *ds = ds_table; ds < ds_table + ds_end; ++ds) {
+        if (ds->removed && ds->probe.state != PROBE_RUNNING) {
+            free_diskstats(ds);
+            ++reaped;
         }
     }
+    return reaped;
+}
 
-    return(NULL);
+/* convert a FILETIME (100ns units since 1601) to time_t and back */
+time_t filetime_to_time(LONGLONG ft)
+{
+    return (time_t)((ft - 116444736000000000LL) / 10000000LL);
 }
 
-/* spin-down a disk */
-static void spindown_disk(const char *name)
+LONGLONG time_to_filetime(time_t t)
+{
+    return (LONGLONG)t * 10000000LL + 116444736000000000LL;
+}
+
+/* current time as FILETIME */
+LONGLONG filetime_now(void)
+{
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    return ((LONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
+
+/* Drive registry: each DISKSTATS entry keeps a metadata-only handle (which
+ * does not wake up the drive) and a read/write handle (for pass-through
+ * commands) open across polls. Handles are opened on first use and closed
+ * again only when a request fails in a way that indicates a stale handle, or
+ * when the device is removed. The commands to a disk (ata_command(),
+ * backend.cpp) never open handles of their own, so no error path can leak
+ * one; only -t, the benchmark and the device enumeration open short-lived
+ * handles, and close them on every path.
+ */
+static HANDLE drive_open(const char *name, DWORD access)
+{
+    InterlockedIncrement(&profile.opens);
+    return CreateFile(name, access, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+}
+
+HANDLE drive_meta_handle(DISKSTATS *ds)
+{
+    if (ds->h_meta == INVALID_HANDLE_VALUE) {
+        ds->h_meta = drive_open(ds->name, 0);
+    }
+    return ds->h_meta;
+}
+
+HANDLE drive_rw_handle(DISKSTATS *ds)
+{
+    if (ds->h_rw == INVALID_HANDLE_VALUE) {
+        ds->h_rw = drive_open(ds->name, GENERIC_READ | GENERIC_WRITE);
+    }
+    return ds->h_rw;
+}
+
+static void drive_close(DISKSTATS *ds)
 {
-    DWORD dwBytesReturned = 0;
-    int   iReply;
-    char  io_req[6], io_repl[100];
+    if (ds->h_meta != INVALID_HANDLE_VALUE) {
+        CloseHandle(ds->h_meta);
+        ds->h_meta = INVALID_HANDLE_VALUE;
+    }
+    if (ds->h_rw != INVALID_HANDLE_VALUE) {
+        CloseHandle(ds->h_rw);
+        ds->h_rw = INVALID_HANDLE_VALUE;
+    }
+}
 
-    /* SCSI stop unit command */
-    memcpy(&io_req, "\x1b\x00\x00\x00\x00\x00", 6);
-    memset(&io_repl, 0x00, sizeof(io_repl));
+/* a request on a cached handle failed; unless the device merely does not
+ * support the request, drop the handles so they are reopened on next use
+ * (preserves the last error code for the caller) */
+void drive_failed(DISKSTATS *ds, DWORD error)
+{
+    ds->failed_ioctls++;
+    switch (error) {
+    case ERROR_INVALID_FUNCTION:
+    case ERROR_NOT_SUPPORTED:
+    case ERROR_INVALID_PARAMETER:
+        break;
+    default:
+        drive_close(ds);
+        break;
+    }
+    SetLastError(error);
+}
 
+/* spin-down a disk */
+static void spindown_disk(const char *name)
+{
     HANDLE hDevice = CreateFile(name,        // drive to open
         GENERIC_READ | GENERIC_WRITE,        // read and write access to the drive => set to 0 if only metadata is to be queried
         FILE_SHARE_READ | FILE_SHARE_WRITE,  // share mode           
@@ -480,205 +1207,158 @@ static void spindown_disk(const char *name)
         dprintf("stop %s => failed to flush file buffers / write cache\n", name);
     }
 
-    SCSI_PASS_THROUGH s = { 0 };
-    memcpy(s.Cdb, io_req, sizeof(io_req));
-    s.CdbLength = sizeof(io_req);
-    s.DataIn = SCSI_IOCTL_DATA_IN;
-    s.TimeOutValue = 30;
-    s.Length = sizeof(SCSI_PASS_THROUGH);
-    s.ScsiStatus = 0x00;
-    s.SenseInfoOffset = 0;
-    s.SenseInfoLength = 0;
-    s.DataBufferOffset = NULL;
-    s.DataTransferLength = 0;
-
-    iReply = DeviceIoControl(hDevice, IOCTL_SCSI_PASS_THROUGH_DIRECT, &s, sizeof(s), &io_repl, sizeof(io_repl), &dwBytesReturned, (LPOVERLAPPED)NULL);
-    // io_repl[] : 0x38 0x00 0x00 0x00 0x00 0x00 0x06 0x00 0x01 0x00 0x00 0x00 0x00 0x00 0x00 0x00 0x1e 0x00 0x00 0x00 0x00 0x00 0x00 0x00 0x00 0x02 0x00 0x00 ...
-    if (iReply == 0) {
-        dprintf("stop %s => failed to pass scsi stop unit command  iReply %d\n", name, iReply);
-    } else {
-        dprintf("stop %s => success\n", name);
-    }
-
+    scsi_start_stop(hDevice, name, 0x00);
     CloseHandle(hDevice);
 }
 
 
-static int ata_check_power_mode(const char *name)
+/* Issue an ata command on the cached read/write handle of a disk: taskfile
+ * holds the registers (features, sector count, lba low/mid/high, device,
+ * command) and receives them with the status in place of the command after
+ * completion; len bytes (at most 512) are read into data unless len is 0.
+ * Returns false if the command could not be issued; an aborted command is
+ * only told by the status. The handle stays owned by the drive registry on
+ * every path; failures that indicate a stale handle drop it through
+ * drive_failed().
+ */
+bool ata_taskfile(DISKSTATS *ds, UCHAR taskfile[8], void *data, ULONG len, ULONG timeout, const char *what)
 {
-    // open physical drive i  (if GENERIC_READ or GENERIC_WRITE is set, the device will be woken up)
-    //HANDLE hDevice = CreateFile(name, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);  
-    HANDLE hDevice = CreateFile(name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
-    //HANDLE hDevice = CreateFile(name, READ_CONTROL, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
-    //HANDLE hDevice = CreateFile(name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    // if GENERIC_READ or GENERIC_WRITE is set, the device will be woken up when opening it; the cached handle is opened once
+    const char *name = ds->name;
+    HANDLE hDevice = drive_rw_handle(ds);
     if (hDevice == INVALID_HANDLE_VALUE) {
         DWORD error = GetLastError();
         switch (error) {
         case ERROR_FILE_NOT_FOUND:
-            dprintf("ata_check_power_mode(%s): ERROR_FILE_NOT_FOUND\n", name);
+            dprintf("%s(%s): ERROR_FILE_NOT_FOUND\n", what, name);
             break;  // PhysicalDriveX does not exist
         case ERROR_ACCESS_DENIED:
-            dprintf("ata_check_power_mode(%s): ERROR_ACCESS_DENIED\n", name);
-            dprintf("ata_check_power_mode(%s): application requires admin privileges\n", name);
+            dprintf("%s(%s): ERROR_ACCESS_DENIED\n", what, name);
+            dprintf("%s(%s): application requires admin privileges\n", what, name);
             break;
         default:
-            dprintf("ata_check_power_mode(%s): error 0x%lx\n", name, error);
+            dprintf("%s(%s): error 0x%lx\n", what, name, error);
         }
-        return -1;
+        SetLastError(error);
+        return false;
     }
 
     DWORD cb = 0;
-    ATA_PASS_THROUGH_EX cmd = { sizeof(ATA_PASS_THROUGH_EX), 0 };
-    //cmd.AtaFlags = ATA_FLAGS_DRDY_REQUIRED; /*  Require drive to be ready  */
-    cmd.TimeOutValue = 3;                   /*  Arbitrary timeout (seconds)  */
-    cmd.CurrentTaskFile[6] = 0xE5;          /*  "Check Power Mode" in command register  */
-    if (DeviceIoControl(hDevice, IOCTL_ATA_PASS_THROUGH, &cmd, sizeof(cmd), &cmd, sizeof(cmd), &cb, 0) == 0) {
+    struct ATA_REQUEST {
+        ATA_PASS_THROUGH_EX apt;
+        UCHAR               data[512];      /*  DataBufferOffset points here  */
+    } cmd;
+    DWORD size = (len > 0) ? sizeof(cmd) : sizeof(cmd.apt);
+    if (len > sizeof(cmd.data)) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+    memset(&cmd.apt, 0x00, sizeof(cmd.apt));
+    cmd.apt.Length = sizeof(ATA_PASS_THROUGH_EX);
+    //cmd.apt.AtaFlags = ATA_FLAGS_DRDY_REQUIRED; /*  Require drive to be ready  */
+    cmd.apt.TimeOutValue = timeout;             /*  seconds  */
+    memcpy(cmd.apt.CurrentTaskFile, taskfile, sizeof(cmd.apt.CurrentTaskFile));
+    if (len > 0) {
+        cmd.apt.AtaFlags = ATA_FLAGS_DATA_IN;
+        cmd.apt.DataTransferLength = len;
+        cmd.apt.DataBufferOffset = offsetof(ATA_REQUEST, data);
+    }
+    if (profile_ioctl(hDevice, IOCTL_ATA_PASS_THROUGH, &cmd, size, &cmd, size, &cb, 0) == 0) {
         DWORD error = GetLastError();
         switch (error) {
         case ERROR_INVALID_FUNCTION:
-            dprintf("ata_check_power_mode(%s): ERROR_INVALID_FUNCTION\n", name);
+            dprintf("%s(%s): ERROR_INVALID_FUNCTION\n", what, name);
             break;
         case ERROR_NOT_SUPPORTED:
-            dprintf("ata_check_power_mode(%s): ERROR_NOT_SUPPORTED\n", name);
+            dprintf("%s(%s): ERROR_NOT_SUPPORTED\n", what, name);
             break;
         case ERROR_ACCESS_DENIED:
-            dprintf("ata_check_power_mode(%s): ERROR_ACCESS_DENIED\n", name);
-            dprintf("ata_check_power_mode(%s): application requires admin privileges\n", name);
+            dprintf("%s(%s): ERROR_ACCESS_DENIED\n", what, name);
+            dprintf("%s(%s): application requires admin privileges\n", what, name);
             break;
         }
+        drive_failed(ds, error);
+        return false;
+    }
+    memcpy(taskfile, cmd.apt.CurrentTaskFile, sizeof(cmd.apt.CurrentTaskFile));
+    if (len > 0) {
+        memcpy(data, cmd.data, len);
+    }
+    return true;
+}
+
+/* Issue an ata command without data or parameters; returns the sector count
+ * register, or -1 if the command failed. */
+static int ata_command(DISKSTATS *ds, UCHAR command, ULONG timeout, const char *what)
+{
+    UCHAR taskfile[8] = { 0 };
+
+    taskfile[6] = command;      /*  command register  */
+    if (!ata_taskfile(ds, taskfile, NULL, 0, timeout, what)) {
         return -1;
     }
-    CloseHandle(hDevice);
+    return taskfile[1];
+}
 
+int ata_check_power_mode(DISKSTATS *ds)
+{
     /*  FF in sector count register means the drive is active or idle (and therefore spinning)  */
     // 00h	Device is in Standby mode.
     // 40h  Device is in NV Cache Power Mode and the spindle is spun down or spinning down.
     // 41h  Device is in NV Cache Power Mode and the spindle is spun up or spinning up.
     // 80h  Device is in Idle mode.
     // FFh  Device is in Active mode or Idle mode.
-    //dprintf("ata_check_power_mode(%s): CurrentTaskFile[0] = 0x%02x  CurrentTaskFile[1] = 0x%02x\n", name, cmd.CurrentTaskFile[0], cmd.CurrentTaskFile[1]);
-    return cmd.CurrentTaskFile[1];
+    return ata_command(ds, 0xE5, 3, "ata_check_power_mode");    /*  "CHECK POWER MODE"  */
 }
 
 
-static bool ata_set_idle_mode(const char *name)
+bool ata_set_idle_mode(DISKSTATS *ds)
 {
-    // open physical drive i
-    HANDLE hDevice = CreateFile(name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
-    if (hDevice == INVALID_HANDLE_VALUE) {
-        DWORD error = GetLastError();
-        switch (error) {
-        case ERROR_FILE_NOT_FOUND:
-            dprintf("ata_set_idle_mode(%s): ERROR_FILE_NOT_FOUND\n", name);
-            break;  // PhysicalDriveX does not exist
-        case ERROR_ACCESS_DENIED:
-            dprintf("ata_set_idle_mode(%s): ERROR_ACCESS_DENIED\n", name);
-            dprintf("ata_set_idle_mode(%s): application requires admin privileges\n", name);
-            break;
-        default:
-            dprintf("ata_set_idle_mode(%s): error 0x%lx\n", name, error);
-        }
+    if (ata_command(ds, 0xE1, 3, "ata_set_idle_mode") < 0) {  /*  "IDLE IMMEDIATE"  */
         return false;
     }
-
-    DWORD cb = 0;
-    ATA_PASS_THROUGH_EX cmd = { sizeof(ATA_PASS_THROUGH_EX), 0 };
-    //cmd.AtaFlags = ATA_FLAGS_DRDY_REQUIRED; /*  Require drive to be ready  */
-    cmd.TimeOutValue = 3;                   /*  Arbitrary timeout (seconds)  */
-    cmd.CurrentTaskFile[6] = 0xE1;          /*  "IDLE IMMEDIATE" in command register */
-    if (DeviceIoControl(hDevice, IOCTL_ATA_PASS_THROUGH, &cmd, sizeof(cmd), &cmd, sizeof(cmd), &cb, 0) == 0) {
-        DWORD error = GetLastError();
-        switch (error) {
-        case ERROR_INVALID_FUNCTION:
-            dprintf("ata_set_idle_mode(%s): ERROR_INVALID_FUNCTION\n", name);
-            break;
-        case ERROR_NOT_SUPPORTED:
-            dprintf("ata_set_idle_mode(%s): ERROR_NOT_SUPPORTED\n", name);
-            break;
-        case ERROR_ACCESS_DENIED:
-            dprintf("ata_set_idle_mode(%s): ERROR_ACCESS_DENIED\n", name);
-            dprintf("ata_set_idle_mode(%s): application requires admin privileges\n", name);
-            break;
-        }
-        return false;
-    }
-
-    CloseHandle(hDevice);
-    dprintf("ata_set_idle_mode(%s): SUCCESS\n", name);
+    dprintf("ata_set_idle_mode(%s): SUCCESS\n", ds->name);
     return true;
 }
 
 
-static bool ata_set_standby_mode(const char *name)
+bool ata_set_standby_mode(DISKSTATS *ds)
 {
-    // open physical drive i
-    HANDLE hDevice = CreateFile(name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
-    if (hDevice == INVALID_HANDLE_VALUE) {
-        DWORD error = GetLastError();
-        switch (error) {
-        case ERROR_FILE_NOT_FOUND:
-            dprintf("ata_set_standby_mode(%s): ERROR_FILE_NOT_FOUND\n", name);
-            break;  // PhysicalDriveX does not exist
-        case ERROR_ACCESS_DENIED:
-            dprintf("ata_set_standby_mode(%s): ERROR_ACCESS_DENIED\n", name);
-            dprintf("ata_set_standby_mode(%s): application requires admin privileges\n", name);
-            break;
-        default:
-            dprintf("ata_set_standby_mode(%s): error 0x%lx\n", name, error);
-        }
+    // the write cache has been flushed by spindown_run(); runs on a worker, so allow for a slow drive
+    if (ata_command(ds, 0xE0, SPINDOWN_TIMEOUT, "ata_set_standby_mode") < 0) {   /*  "STANDBY IMMEDIATE"  */
         return false;
     }
-
-    BOOL flushed = FlushFileBuffers(hDevice);
-    if (flushed == FALSE) {
-        dprintf("ata_set_standby_mode(%s): failed to flush file buffers / write cache\n", name);
-    }
-
-    DWORD cb = 0;
-    ATA_PASS_THROUGH_EX cmd = { sizeof(ATA_PASS_THROUGH_EX), 0 };
-    //cmd.AtaFlags = ATA_FLAGS_DRDY_REQUIRED; /*  Require drive to be ready  */
-    cmd.TimeOutValue = 3;                   /*  Arbitrary timeout (seconds)  */
-    cmd.CurrentTaskFile[6] = 0xE0;          /*  "STANDBY IMMEDIATE" in command register */
-    if (DeviceIoControl(hDevice, IOCTL_ATA_PASS_THROUGH, &cmd, sizeof(cmd), &cmd, sizeof(cmd), &cb, 0) == 0) {
-        DWORD error = GetLastError();
-        switch (error) {
-        case ERROR_INVALID_FUNCTION:
-            dprintf("ata_set_standby_mode(%s): ERROR_INVALID_FUNCTION\n", name);
-            break;
-        case ERROR_NOT_SUPPORTED:
-            dprintf("ata_set_standby_mode(%s): ERROR_NOT_SUPPORTED\n", name);
-            break;
-        case ERROR_ACCESS_DENIED:
-            dprintf("ata_set_standby_mode(%s): ERROR_ACCESS_DENIED\n", name);
-            dprintf("ata_set_standby_mode(%s): application requires admin privileges\n", name);
-            break;
-        }
-        return false;
-    }
-
-    CloseHandle(hDevice);
-    dprintf("ata_set_standby_mode(%s): SUCCESS\n", name);
+    dprintf("ata_set_standby_mode(%s): SUCCESS\n", ds->name);
     return true;
 }
 
 
 /* Resolve disk names specified as "/dev/disk/by-xxx" or some other symlink.
- * Please note that this function is only called during command line parsing
- * and hd-idle per se does not support dynamic disk additions or removals at
- * runtime.
- *
- * This might change in the future but would require some fiddling to avoid
- * needless overhead -- after all, this was designed to run on tiny embedded
- * devices, too.
+ * Please note that this function is only called during command line parsing;
+ * disks added at runtime (see devices.cpp) are matched against the names
+ * resolved here when they arrive.
  */
 static char *disk_name(char *path)
 {
-    if (debug) {
-        printf("using %s for %s\n", path, path);
-    }
+    dprintf("using %s for %s\n", path, path);
     return path;
 }
 
+/* Get the drive number of a disk name like \\.\PhysicalDriveN. The disk
+ * table is indexed by drive number, so an idle time given for a disk is
+ * matched once when the disk arrives, without comparing names.
+ */
+static int disk_number(const char *name)
+{
+    int drive;
+    char c;
+
+    if (sscanf(name, "\\\\.\\PhysicalDrive%d%c", &drive, &c) == 1 && drive >= 0) {
+        return drive;
+    }
+    return -1;
+}
+
 /* print hex dump to stderr (e.g. sense buffers) */
 static void phex(const void *p, int len, const char *fmt, ...)
 {
@@ -0,0 +1,430 @@
+/*
+ * hd-idle.h - declarations shared between the hd-idle modules
+ *
+ * Copyright (c) 2007 Christian Mueller.
+ * Copyright (c) 2022 RalfOGit
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef HD_IDLE_H
+#define HD_IDLE_H
+
+#include <stdio.h>
+#include <time.h>
+#include <Windows.h>
+
+#define DEFAULT_IDLE_TIME 60
+#define MAX_DISKS         256   /* size of the disk table, i.e. highest drive number + 1 */
+#define MAX_POLL_INTERVAL 300   /* s; cap of the per-disk poll interval (1/10th of its idle time) */
+#define SPUNDOWN_POLL_FACTOR 4  /* spun-down disks are polled this many times less often */
+#define PROBE_DEADLINE    5000  /* ms to wait for the probes of one poll; ata pass-through times out after 3s */
+#define SPINUP_BUCKETS    10    /* spin-up latency histogram: bucket i <= 125ms << i, the last one unbounded */
+#define GAP_BUCKETS       18    /* idle gap histogram: bucket i holds 2^i .. 2^(i+1)-1 s, the last one unbounded */
+#define SPINDOWN_TIMEOUT  30    /* s; timeout of the standby immediate / stop unit command */
+#define SPINDOWN_BACKOFF  30    /* s before retrying a failed spin-down; doubles with every failure */
+#define SPINDOWN_BACKOFF_MAX 3600
+#define MAX_GROUPS        32    /* drive groups given with -g */
+#define MAX_VOLUMES       8     /* volumes per disk attributed with -V */
+#define EPC_TIERS         4     /* idle tiers per disk (-T): idle_a, idle_b, idle_c, standby_y */
+#define GROUP_TOGETHER    0x01  /* group policy: spin the members down together */
+#define GROUP_WAKE        0x02  /* group policy: spin up the members when one of them spins up */
+
+/* verbosity levels of console output (-v) */
+#define V_ERROR           0     /* errors only */
+#define V_STATE           1     /* state transitions: spin-down, spin-up, arrival, removal */
+#define V_DEBUG           2     /* every probe (-d) */
+
+#define dprintf(...)      do { if (verbosity >= V_DEBUG) console_printf(V_DEBUG, __VA_ARGS__); } while (0)
+
+/* typedefs and structures */
+
+/* an ata power condition entered after the given idle time (epc.cpp) */
+typedef struct EPC_TIER {
+    UCHAR              condition;   /* power condition id: 0x81 idle_a .. 0x83 idle_c, 0x01 standby_y */
+    int                after;       /* seconds of idle time */
+} EPC_TIER;
+
+typedef struct IDLE_TIME {
+    struct IDLE_TIME  *next;
+    char              *name;
+    int                drive;       /* drive number resolved from name, -1 if none */
+    int                idle_time;
+    unsigned int       min_ops;     /* i/os per minute that do not count as activity */
+    unsigned int       min_kbytes;  /* kbytes per minute that do not count as activity */
+    int                group;       /* index of the -g group, -1 if none */
+    char              *group_spec;  /* group= of a -f entry, resolved by config_groups() */
+    EPC_TIER           tiers[EPC_TIERS];    /* in order of idle time */
+    int                ntiers;
+} IDLE_TIME;
+
+/* events of a -R trace (trace.cpp) */
+enum { TRACE_START, TRACE_STOP, TRACE_IO, TRACE_SPINDOWN, TRACE_SPINUP };
+
+/* what ended a wait of the main loop */
+enum { WAIT_TIMER, WAIT_STOP, WAIT_DEVICES, WAIT_METRICS, WAIT_CONFIG, WAIT_AGENT, WAIT_CONTROL, WAIT_PROFILE };
+
+/* phases of a pass of the main loop (profile.cpp) */
+enum { PHASE_DISPATCH, PHASE_WAIT, PHASE_EVALUATE, PHASE_PERSIST };
+#define PROFILE_WAITS     (WAIT_PROFILE + 1)
+#define PROFILE_PHASES    (PHASE_PERSIST + 1)
+
+/* counters of what hd-idle itself costs (profile.cpp) */
+typedef struct PROFILE {
+    unsigned long      wakeups[PROFILE_WAITS];      /* main loop waits ended, by WAIT_* */
+    LONGLONG           phase_ticks[PROFILE_PHASES]; /* QueryPerformanceCounter() ticks by PHASE_* */
+    volatile LONG      ioctls;      /* any thread */
+    volatile LONG      opens;       /* drive handles */
+    volatile LONG      console_bytes;
+    volatile LONG      log_bytes;
+} PROFILE;
+
+/* state and result of the latest probe of a disk; a probe runs on a thread
+ * pool worker, so all disks are probed concurrently */
+enum { PROBE_IDLE, PROBE_RUNNING, PROBE_DONE };
+enum { PROBE_OK, PROBE_MISSING, PROBE_DENIED, PROBE_FAILED, PROBE_ASLEEP, PROBE_IGNORED, PROBE_NO_COUNTERS };
+
+/* what a disk is and supports; static while it is present, so it is filled in
+ * once by its first probe (backend.cpp) */
+typedef struct CAPS {
+    int                known;
+    UINT               drive_type;  /* GetDriveTypeA() */
+    int                bus_type;    /* STORAGE_BUS_TYPE, -1 if unknown */
+    int                removable;   /* removable media */
+    int                rotational;  /* incurs a seek penalty: 1 hdd, 0 ssd, -1 unknown */
+    char               serial[64];  /* identity matched by the -f file (config.cpp); "" if unknown */
+    char               wwn[40];
+    char               guid[40];
+    int                epc;         /* extended power conditions: 0 not yet known, EPC_NONE, EPC_OK (epc.cpp) */
+} CAPS;
+
+/* power commands of a kind of disk (backend.cpp); power modes in the ata
+ * encoding (0x00 standby, 0x80 idle, 0xff active) or -1 if unknown */
+struct DISKSTATS;
+typedef struct BACKEND {
+    const char        *name;
+    int              (*check_power)(struct DISKSTATS *ds);
+    bool             (*standby)(struct DISKSTATS *ds);     /* NULL if the disk has no standby */
+    bool             (*wake)(struct DISKSTATS *ds);
+} BACKEND;
+
+/* a volume on a disk and its counters (volumes.cpp) */
+typedef struct VOLUME_REF {
+    char               name[64];    /* mount point, e.g. "D:", or the volume guid path */
+    HANDLE             h;           /* opened without access rights */
+    DWORD              reads;       /* counters of the latest probe */
+    DWORD              writes;
+    DWORD              prev_reads;  /* counters of the probe before */
+    DWORD              prev_writes;
+    unsigned int       activity;    /* probes that found the disk active with i/o on this volume */
+} VOLUME_REF;
+
+typedef struct PROBE {
+    volatile LONG      state;       /* PROBE_IDLE, PROBE_RUNNING or PROBE_DONE */
+    HANDLE             done;        /* signaled when a running probe has completed */
+    time_t             time;        /* completion time */
+    LONGLONG           time_ft;     /* completion time as FILETIME */
+    int                status;      /* PROBE_OK, ... */
+    DWORD              error;
+    int                ata;         /* ata power mode or -1 */
+    DISK_PERFORMANCE   perf;
+    LONGLONG           etw_last_io; /* FILETIME of the last i/o seen by etw, 0 if unknown */
+    ULONG              latency_us;  /* duration of the probe */
+    LONG               wake_ms;     /* spin-up latency measured by etw, -1 if none */
+    int                wake;        /* spin the disk up before querying it (group.cpp) */
+    int                woken;       /* the spin-up command succeeded */
+    int                spindown;    /* run the spin-down pipeline instead of a query */
+    int                joined;      /* the spin-down follows a group member */
+    const BACKEND     *backend;     /* of the disk; detected by its first probe, ata may fall back to scsi */
+    int                standby_ok;  /* the spin-down command succeeded */
+    int                epc;         /* enter this idle tier instead of a query (epc.cpp), -1 if none */
+    int                epc_ok;      /* the power condition has been entered */
+} PROBE;
+
+typedef struct DISKSTATS {
+    char               name[50];
+    int                drive;       /* drive number, i.e. index into ds_table */
+    int                idle_time;
+    time_t             last_io;
+    LONGLONG           last_io_ft;  /* last_io as FILETIME, with sub-second precision */
+    time_t             spindown;
+    time_t             spinup;
+    unsigned int       in_use : 1;
+    unsigned int       removed : 1;     /* gone while probed; freed by reap_diskstats() */
+    unsigned int       spun_down : 1;
+    unsigned int       new_disk : 1;
+    unsigned int       present : 1;     /* seen by the latest device enumeration */
+    unsigned int       verify_spindown : 1; /* confirm the last spin-down with the next probe */
+    unsigned int       restored : 1;    /* state taken over from the snapshot, not yet probed */
+    unsigned int       join_spindown : 1; /* a group member was spun down; follow it if idle */
+    unsigned int       wake_pending : 1;  /* a group member was spun up; spin up as well */
+    unsigned int       held : 1;        /* spin-down held back by the -n limit */
+    unsigned int       ignored : 1;     /* can never be spun down; not probed any more */
+    unsigned int       volumes_mapped : 1;  /* volumes looked up (-V) */
+    unsigned int       spindown_failures;   /* consecutive failed spin-downs */
+    time_t             spindown_retry;      /* no spin-down before this time after a failure */
+    time_t             hold_until;          /* no spin-down before this time; requested through the pipe (control.cpp) */
+    time_t             volumes_retry;       /* no new look-up of the volumes before this time (-V) */
+    int                group;       /* index of the -g group, -1 if none */
+    const BACKEND     *backend;     /* NULL until the first probe has detected it */
+    CAPS               caps;        /* written by the worker of the first probe only */
+    int                nvme_standby_ps;     /* nvme power state used as standby */
+    VOLUME_REF         volumes[MAX_VOLUMES];
+    int                nvolumes;
+    int                volumes_top;     /* volume with the most i/o when last reported, -1 none of them, -2 not yet */
+    unsigned int       reads;
+    unsigned int       writes;
+    ULONGLONG          bytes;       /* bytes read and written */
+    time_t             sampled;     /* time reads, writes and bytes were taken */
+    LONGLONG           sampled_ft;
+    LONGLONG           idle_ref;    /* IdleTime and QueryTime when they were taken */
+    LONGLONG           query_ref;
+    unsigned int       min_ops;
+    unsigned int       min_kbytes;
+    EPC_TIER           tiers[EPC_TIERS];
+    int                ntiers;
+    int                epc_tier;    /* deepest tier entered since the last i/o, -1 if none */
+    HANDLE             h_meta;      /* cached metadata-only handle (no access rights) */
+    HANDLE             h_rw;        /* cached read/write handle for ata pass-through */
+    PROBE              probe;
+    ULONGLONG          next_due;    /* GetTickCount64() time of the next probe */
+    int                sched_pos;   /* position in the schedule heap, -1 if not queued */
+
+    /* counters exported by metrics.cpp */
+    unsigned int       spindowns;
+    unsigned int       spinups;
+    ULONGLONG          spun_down_secs;      /* completed spun-down periods */
+    ULONGLONG          running_secs;        /* completed periods from spin-up to spin-down */
+    ULONGLONG          last_running_secs;
+    unsigned int       probes;
+    ULONGLONG          probe_us_total;
+    ULONG              probe_us_max;
+    unsigned int       failed_ioctls;
+
+    /* spin-up latency: histogram, sum and count */
+    LONGLONG           io_time;             /* ReadTime + WriteTime of the latest counters */
+    unsigned int       spinup_hist[SPINUP_BUCKETS];
+    ULONGLONG          spinup_ms_total;
+    unsigned int       spinup_count;
+
+    /* idle gaps by hour of day and log2 of their length (policy.cpp) */
+    unsigned short     gap_hist[24][GAP_BUCKETS];
+} DISKSTATS;
+
+/* device backend of the probes (probe.cpp): what is sent to the disks, on
+ * the worker of a probe, and the clocks the decisions are taken by */
+typedef struct DEVICE_OPS {
+    const char        *name;
+    void             (*query)(DISKSTATS *ds);       /* power state and counters into ds->probe */
+    void             (*spindown)(DISKSTATS *ds);    /* the spin-down pipeline */
+    void             (*epc)(DISKSTATS *ds);         /* enter the idle tier ds->probe.epc */
+    LONGLONG         (*now)(void);                  /* FILETIME */
+    ULONGLONG        (*ticks)(void);                /* GetTickCount64() ms */
+} DEVICE_OPS;
+
+/* group.cpp */
+int                group_add       (const char *spec);
+bool               group_valid     (const char *spec);
+void               group_freeze    (void);
+void               group_reset     (void);
+int                group_limit     (const char *spec);
+int                group_policy    (DISKSTATS *ds);
+const char        *group_name      (DISKSTATS *ds);
+bool               group_issue     (ULONGLONG now);
+ULONGLONG          group_retry     (void);
+void               group_spun_down (DISKSTATS *ds);
+bool               group_join      (DISKSTATS *ds, LONGLONG idle_ms);
+void               group_spun_up   (DISKSTATS *ds);
+void               group_prepare   (DISKSTATS *ds, ULONGLONG now);
+
+/* hd-idle.cpp */
+extern IDLE_TIME  *it_root;
+extern DISKSTATS  *ds_table;
+extern int         ds_capacity;
+extern int         ds_end;
+extern int         lazy_power_check;
+extern const DEVICE_OPS device_win32;
+DISKSTATS         *get_diskstats   (int drive);
+DISKSTATS         *new_diskstats   (int drive, HANDLE h_meta);
+void               remove_diskstats(DISKSTATS *ds);
+int                reap_diskstats  (void);
+void               idle_settings   (DISKSTATS *ds);
+DISKSTATS         *first_diskstats (void);
+DISKSTATS         *next_diskstats  (DISKSTATS *ds);
+time_t             filetime_to_time(LONGLONG ft);
+LONGLONG           time_to_filetime(time_t t);
+LONGLONG           filetime_now    (void);
+int                hd_idle_run     (void);
+HANDLE             drive_meta_handle(DISKSTATS *ds);
+HANDLE             drive_rw_handle (DISKSTATS *ds);
+void               drive_failed    (DISKSTATS *ds, DWORD error);
+bool               ata_taskfile    (DISKSTATS *ds, UCHAR taskfile[8], void *data, ULONG len, ULONG timeout, const char *what);
+int                ata_check_power_mode(DISKSTATS *ds);
+bool               ata_set_idle_mode(DISKSTATS *ds);
+bool               ata_set_standby_mode(DISKSTATS *ds);
+
+/* agent.cpp */
+int                agent_init      (const char *spec);
+HANDLE             agent_handle    (void);
+void               agent_update    (ULONGLONG now);
+void               agent_receive   (void);
+void               agent_close     (void);
+int                collector_run   (int port, const char *policy);
+int                policy_key_open (const char *path);
+
+/* backend.cpp */
+extern const BACKEND backend_ata;
+extern const BACKEND backend_scsi;
+extern const BACKEND backend_nvme;
+extern const BACKEND backend_none;
+extern int         nvme_power;
+const BACKEND     *caps_detect     (DISKSTATS *ds);
+bool               caps_spindown   (DISKSTATS *ds, const BACKEND *backend);
+bool               scsi_start_stop (HANDLE hDevice, const char *name, UCHAR cdb4);
+
+/* bench.cpp */
+int                bench_run       (int cycles);
+
+/* config.cpp */
+extern unsigned int config_loads;
+int                config_open     (const char *path);
+HANDLE             config_handle   (void);
+void               config_changed  (void);
+DWORD              config_poll     (ULONGLONG now);
+void               config_apply    (DISKSTATS *ds);
+int                config_update   (const char *line);
+void               config_identify (DISKSTATS *ds, HANDLE hDevice);
+
+/* control.cpp */
+int                control_init    (void);
+HANDLE             control_handle  (void);
+void               control_service (void);
+void               control_probed  (DISKSTATS *ds);
+DWORD              control_poll    (ULONGLONG now);
+int                control_wake    (const char *spec);
+
+/* console.cpp */
+extern int         verbosity;
+void               console_open    (void);
+void               console_close   (void);
+void               console_printf  (int level, const char *fmt, ...);
+
+/* devices.cpp */
+int                devices_init    (void);
+void               devices_enumerate(void);
+HANDLE             devices_handle  (void);
+int                volume_disks    (const char *path, int *drives, int max);
+int                volume_handle_disks(HANDLE hVolume, int *drives, int max);
+
+/* epc.cpp */
+#define EPC_NONE           1
+#define EPC_OK             2
+int                epc_parse       (const char *spec, EPC_TIER *tiers);
+const char        *epc_name        (UCHAR condition);
+int                epc_due         (DISKSTATS *ds, LONGLONG idle_ms);
+LONGLONG           epc_next        (DISKSTATS *ds, LONGLONG now_ft);
+void               epc_start       (DISKSTATS *ds, int tier);
+void               epc_run         (DISKSTATS *ds);
+void               epc_evaluate    (DISKSTATS *ds);
+
+/* etw.cpp */
+extern int         etw_active;
+int                etw_init        (void);
+void               etw_exit        (void);
+void               etw_query       (int drive, PROBE *p);
+void               etw_disk_state  (int drive, int spun_down);
+
+/* service.cpp */
+extern HANDLE      stop_event;
+extern int         service_mode;
+int                service_run     (void);
+int                service_install (int argc, char *argv[]);
+int                service_uninstall(void);
+void               lprintf         (const char *fmt, ...);
+
+/* log.cpp */
+int                log_open        (const char *path);
+void               log_close       (void);
+void               log_line        (const char *line);
+void               log_disk_state  (int drive, int spun_down);
+
+/* metrics.cpp */
+int                metrics_init    (int port);
+HANDLE             metrics_handle  (void);
+void               metrics_serve   (void);
+DWORD              metrics_poll    (ULONGLONG now);
+
+/* mock.cpp */
+extern const DEVICE_OPS device_mock;
+int                mock_script     (const char *spec);
+int                mock_bench      (int disks, int hours);
+
+/* policy.cpp */
+extern int         policy_break_even;
+void               policy_record   (DISKSTATS *ds, time_t prev_io, time_t io);
+bool               policy_active   (DISKSTATS *ds, unsigned int ops, ULONGLONG bytes, time_t elapsed, bool busy);
+LONGLONG           policy_next_probe(DISKSTATS *ds, LONGLONG now_ft);
+bool               policy_spindown (DISKSTATS *ds, LONGLONG idle_ms);
+
+/* snapshot.cpp */
+int                snapshot_open   (const char *path);
+void               snapshot_restore(DISKSTATS *ds);
+void               snapshot_resume (DISKSTATS *ds, unsigned int reads, unsigned int writes, time_t now);
+void               snapshot_save   (int force);
+
+/* trace.cpp */
+int                trace_open      (const char *path);
+void               trace_event     (DISKSTATS *ds, int event, LONGLONG time_ft, unsigned int value);
+void               trace_io        (DISKSTATS *ds, LONGLONG time_ft, unsigned int reads, unsigned int writes, ULONGLONG bytes);
+void               trace_save      (int force);
+void               trace_close     (void);
+int                trace_simulate  (const char *path);
+
+/* volumes.cpp */
+extern int         volumes_enabled;
+void               volumes_map     (DISKSTATS *ds);
+void               volumes_unmap   (DISKSTATS *ds);
+void               volumes_query   (DISKSTATS *ds);
+void               volumes_attribute(DISKSTATS *ds, bool active);
+void               volumes_changed (void);
+
+/* probe.cpp */
+extern const DEVICE_OPS *device_ops;
+ULONGLONG          probe_next_poll (DISKSTATS *ds);
+void               probe_start     (DISKSTATS *ds);
+int                probe_wait      (DWORD timeout_ms);
+void               probe_evaluate  (DISKSTATS *ds);
+
+/* profile.cpp */
+extern PROFILE     profile;
+int                profile_init    (int minutes);
+HANDLE             profile_handle  (void);
+const char        *profile_wait_name(int what);
+void               profile_request (void);
+LONGLONG           profile_clock   (void);
+void               profile_phase   (int phase, LONGLONG *start);
+BOOL               profile_ioctl   (HANDLE h, DWORD code, LPVOID in, DWORD in_size, LPVOID out, DWORD out_size, LPDWORD returned, LPOVERLAPPED ov);
+double             profile_cpu_secs(void);
+void               profile_report  (void);
+DWORD              profile_poll    (ULONGLONG now);
+
+/* scheduler.cpp */
+bool               sched_insert    (DISKSTATS *ds, ULONGLONG due);
+void               sched_remove    (DISKSTATS *ds);
+DISKSTATS         *sched_next      (void);
+DISKSTATS         *sched_pop_due   (ULONGLONG now);
+DWORD              sched_timeout   (ULONGLONG now);
+
+#endif
@@ -0,0 +1,190 @@
+/*
+ * log.cpp - buffered logfile writer for hd-idle
+ *
+ * Copyright (c) 2022 RalfOGit
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The lines for the -l logfile are put into a ring buffer by the main loop and
+ * written by a background thread. The writer waits LOG_FLUSH_DELAY after the
+ * first new line, so that the lines of a poll end up in one write, and it holds
+ * writes back while a disk containing the logfile is spun down; they are
+ * written as soon as that disk spins up again for some other reason. Thus the
+ * logfile can be placed on a monitored disk without causing spin-ups itself.
+ * If the ring buffer overflows meanwhile, the oldest lines are dropped.
+ */
+
+#include "hd-idle.h"
+#include <string.h>
+#include <errno.h>
+
+#define LOG_LINES           256     /* lines in the ring buffer */
+#define LOG_LINE_SIZE       256
+#define LOG_FLUSH_DELAY     5000    /* ms to collect lines before writing them */
+#define LOG_MAX_DISKS       8
+
+static char             log_ring[LOG_LINES][LOG_LINE_SIZE];
+static char             log_batch[LOG_LINES * LOG_LINE_SIZE];
+static int              log_head = 0;           /* oldest line */
+static int              log_count = 0;
+static unsigned int     log_dropped = 0;
+static CRITICAL_SECTION log_lock;
+
+static const char      *log_path = NULL;
+static HANDLE           log_thread = NULL;
+static HANDLE           log_event = NULL;       /* auto-reset; new lines or hold released */
+static HANDLE           log_stop_event = NULL;  /* manual-reset */
+
+/* disks holding the logfile and which of them are spun down */
+static int              log_disks[LOG_MAX_DISKS];
+static int              log_disk_down[LOG_MAX_DISKS];
+static int              log_ndisks = 0;
+static volatile LONG    log_held = 0;
+
+/* write the buffered lines to the logfile */
+static void log_flush(void)
+{
+    size_t len = 0;
+    unsigned int dropped;
+    FILE *fp;
+
+    EnterCriticalSection(&log_lock);
+    for (; log_count > 0; --log_count) {
+        size_t n = strlen(log_ring[log_head]);
+        memcpy(log_batch + len, log_ring[log_head], n);
+        len += n;
+        log_head = (log_head + 1) % LOG_LINES;
+    }
+    dropped = log_dropped;
+    log_dropped = 0;
+    LeaveCriticalSection(&log_lock);
+
+    if (len == 0 && dropped == 0) {
+        return;
+    }
+    if ((fp = fopen(log_path, "a")) == NULL) {
+        dprintf("log: cannot open %s; %s\n", log_path, strerror(errno));
+        return;
+    }
+    if (dropped > 0) {
+        fprintf(fp, "(%u lines dropped)\n", dropped);
+    }
+    fwrite(log_batch, 1, len, fp);
+    fclose(fp);
+    InterlockedExchangeAdd(&profile.log_bytes, (LONG)len);
+}
+
+static DWORD WINAPI log_writer(LPVOID param)
+{
+    HANDLE handles[2] = { log_stop_event, log_event };
+
+    for (;;) {
+        if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0) {
+            break;
+        }
+        /* collect more lines, so that they are written in one batch */
+        if (WaitForSingleObject(log_stop_event, LOG_FLUSH_DELAY) == WAIT_OBJECT_0) {
+            break;
+        }
+        if (!log_held) {
+            log_flush();
+        }
+    }
+
+    /* write what is left, even if the disk has to be woken up for it */
+    log_flush();
+    return 0;
+}
+
+/* start writing to the given logfile; returns 0 on success */
+int log_open(const char *path)
+{
+    log_path = path;
+    log_ndisks = volume_disks(path, log_disks, LOG_MAX_DISKS);
+    for (int i = 0; i < log_ndisks; ++i) {
+        dprintf("log: %s is on \\\\.\\PhysicalDrive%d\n", path, log_disks[i]);
+    }
+
+    InitializeCriticalSection(&log_lock);
+    if ((log_event = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL ||
+        (log_stop_event = CreateEvent(NULL, TRUE, FALSE, NULL)) == NULL ||
+        (log_thread = CreateThread(NULL, 0, log_writer, NULL, 0, NULL)) == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+/* stop the writer after it has written the remaining lines */
+void log_close(void)
+{
+    if (log_thread == NULL) {
+        return;
+    }
+    SetEvent(log_stop_event);
+    WaitForSingleObject(log_thread, INFINITE);
+    CloseHandle(log_thread);
+    log_thread = NULL;
+}
+
+/* add a line to the ring buffer, prefixed with the current date and time */
+void log_line(const char *line)
+{
+    time_t now;
+    struct tm *tm;
+    char *slot;
+
+    if (log_thread == NULL) {
+        return;
+    }
+    now = time(NULL);
+    tm = localtime(&now);
+
+    EnterCriticalSection(&log_lock);
+    if (log_count == LOG_LINES) {
+        /* overwrite the oldest line */
+        log_head = (log_head + 1) % LOG_LINES;
+        --log_count;
+        ++log_dropped;
+    }
+    slot = log_ring[(log_head + log_count++) % LOG_LINES];
+    snprintf(slot, LOG_LINE_SIZE, "%04d-%02d-%02d %02d:%02d:%02d %s",
+             tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec, line);
+    if (strlen(slot) == LOG_LINE_SIZE - 1) {
+        slot[LOG_LINE_SIZE - 2] = '\n';    /* truncated */
+    }
+    LeaveCriticalSection(&log_lock);
+
+    SetEvent(log_event);
+}
+
+/* tell the writer whether a disk is spun down; writes are held back while a
+ * disk containing the logfile is */
+void log_disk_state(int drive, int spun_down)
+{
+    LONG held = 0;
+
+    for (int i = 0; i < log_ndisks; ++i) {
+        if (log_disks[i] == drive) {
+            log_disk_down[i] = spun_down;
+        }
+        held |= log_disk_down[i];
+    }
+    if (InterlockedExchange(&log_held, held) && !held && log_thread != NULL) {
+        /* the disk is running again; write the held lines with the next batch */
+        SetEvent(log_event);
+    }
+}
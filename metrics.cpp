@@ -0,0 +1,343 @@
+/*
+ * metrics.cpp - per-disk counters as a local prometheus endpoint
+ *
+ * Copyright (c) 2022 RalfOGit
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * With -m <port>, hd-idle listens on 127.0.0.1:<port> and answers every http
+ * request with the counters of all disks in the prometheus text format. The
+ * listening socket is signaled through an event that the main loop waits on
+ * together with its timer, so requests are served on the main thread and the
+ * disk table is never read while it is being changed. The connections are
+ * non-blocking and signal the same event, so a slow or stalled scraper never
+ * holds up the main loop; one that has not been answered completely within
+ * METRICS_TIMEOUT is dropped.
+ */
+
+#include <winsock2.h>
+#include "hd-idle.h"
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#pragma comment(lib, "ws2_32.lib")
+
+#define METRICS_TIMEOUT     5000    /* ms for a request to arrive and its answer to be sent */
+#define METRICS_CLIENTS     4       /* connections served at a time */
+
+enum { METRICS_IDLE, METRICS_READING, METRICS_WRITING };
+
+typedef struct METRICS_CLIENT {
+    int                state;
+    SOCKET             s;
+    ULONGLONG          started;     /* GetTickCount64() time of the accept */
+    char               header[128];
+    size_t             header_len;
+    char              *body;        /* the metrics at the time of the request */
+    size_t             body_len;
+    size_t             sent;        /* of header and body */
+} METRICS_CLIENT;
+
+static SOCKET   metrics_socket = INVALID_SOCKET;
+static WSAEVENT metrics_event = NULL;
+static METRICS_CLIENT metrics_clients[METRICS_CLIENTS];
+
+static char    *metrics_buf = NULL;
+static size_t   metrics_len = 0;
+static size_t   metrics_size = 0;
+
+/* listen on the given local port; returns 0 on success */
+int metrics_init(int port)
+{
+    struct sockaddr_in addr;
+    WSADATA wsa;
+
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        return -1;
+    }
+    if ((metrics_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == INVALID_SOCKET) {
+        return -1;
+    }
+    memset(&addr, 0x00, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(metrics_socket, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(metrics_socket, 4) != 0) {
+        dprintf("metrics: cannot listen on port %d; error %d\n", port, WSAGetLastError());
+        closesocket(metrics_socket);
+        metrics_socket = INVALID_SOCKET;
+        return -1;
+    }
+
+    /* also makes the listening socket non-blocking */
+    if ((metrics_event = WSACreateEvent()) == NULL || WSAEventSelect(metrics_socket, metrics_event, FD_ACCEPT) != 0) {
+        closesocket(metrics_socket);
+        metrics_socket = INVALID_SOCKET;
+        return -1;
+    }
+    return 0;
+}
+
+/* event that is signaled when a connection is pending, NULL without -m */
+HANDLE metrics_handle(void)
+{
+    return metrics_event;
+}
+
+static void metrics_printf(const char *fmt, ...)
+{
+    va_list va;
+    int n;
+
+    for (;;) {
+        va_start(va, fmt);
+        n = vsnprintf(metrics_buf + metrics_len, metrics_size - metrics_len, fmt, va);
+        va_end(va);
+        if (n >= 0 && metrics_len + n < metrics_size) {
+            metrics_len += n;
+            return;
+        }
+        size_t size = (metrics_size == 0) ? 16384 : 2 * metrics_size;
+        char *buf = (char*)realloc(metrics_buf, size);
+        if (buf == NULL) {
+            return;
+        }
+        metrics_buf = buf;
+        metrics_size = size;
+    }
+}
+
+static void metrics_header(const char *name, const char *type, const char *help)
+{
+    metrics_printf("# HELP hd_idle_%s %s\n# TYPE hd_idle_%s %s\n", name, help, name, type);
+}
+
+/* one line per disk for the given metric; value is an expression of ds */
+#define METRICS_DISKS(metric, fmt, value) \
+    for (ds = first_diskstats(); ds != NULL; ds = next_diskstats(ds)) { \
+        metrics_printf("hd_idle_" metric "{disk=\"%s\"} " fmt "\n", ds->name + 4, value); \
+    }
+
+/* a label value with backslashes and quotes escaped */
+static const char *metrics_label(const char *value, char *buf, size_t size)
+{
+    size_t len = 0;
+
+    for (; *value != '\0' && len + 2 < size; ++value) {
+        if (*value == '\\' || *value == '"') {
+            buf[len++] = '\\';
+        }
+        buf[len++] = *value;
+    }
+    buf[len] = '\0';
+    return buf;
+}
+
+static void metrics_format(void)
+{
+    time_t now = time(NULL);
+    DISKSTATS *ds;
+
+    metrics_len = 0;
+
+    metrics_header("idle_time_seconds", "gauge", "Configured idle time before spin-down.");
+    METRICS_DISKS("idle_time_seconds", "%d", ds->idle_time);
+
+    metrics_header("spun_down", "gauge", "1 if the disk is spun down.");
+    METRICS_DISKS("spun_down", "%d", (int)ds->spun_down);
+
+    metrics_header("spindowns_total", "counter", "Spin-downs issued by hd-idle.");
+    METRICS_DISKS("spindowns_total", "%u", ds->spindowns);
+
+    metrics_header("spinups_total", "counter", "Spin-ups detected after a spin-down.");
+    METRICS_DISKS("spinups_total", "%u", ds->spinups);
+
+    metrics_header("spun_down_seconds_total", "counter", "Time spent spun down.");
+    METRICS_DISKS("spun_down_seconds_total", "%llu", ds->spun_down_secs + (ds->spun_down ? (unsigned long long)(now - ds->spindown) : 0ULL));
+
+    metrics_header("running_seconds_total", "counter", "Time from spin-up to the next spin-down, over all completed periods.");
+    METRICS_DISKS("running_seconds_total", "%llu", ds->running_secs);
+
+    metrics_header("last_running_seconds", "gauge", "Time from the latest spin-up to the spin-down that followed it.");
+    METRICS_DISKS("last_running_seconds", "%llu", ds->last_running_secs);
+
+    metrics_header("probes_total", "counter", "Completed probes.");
+    METRICS_DISKS("probes_total", "%u", ds->probes);
+
+    metrics_header("probe_seconds_total", "counter", "Time spent in probes.");
+    METRICS_DISKS("probe_seconds_total", "%.6f", ds->probe_us_total / 1e6);
+
+    metrics_header("probe_max_seconds", "gauge", "Longest probe.");
+    METRICS_DISKS("probe_max_seconds", "%.6f", ds->probe_us_max / 1e6);
+
+    metrics_header("failed_ioctls_total", "counter", "Failed requests to the disk.");
+    METRICS_DISKS("failed_ioctls_total", "%u", ds->failed_ioctls);
+
+    if (volumes_enabled) {
+        char label[2 * sizeof(VOLUME_REF::name)];
+        metrics_header("volume_activity_total", "counter", "Probes that found the disk active with i/o on the volume (-V).");
+        for (ds = first_diskstats(); ds != NULL; ds = next_diskstats(ds)) {
+            for (int i = 0; i < ds->nvolumes; ++i) {
+                metrics_printf("hd_idle_volume_activity_total{disk=\"%s\",volume=\"%s\"} %u\n", ds->name + 4,
+                               metrics_label(ds->volumes[i].name, label, sizeof(label)), ds->volumes[i].activity);
+            }
+        }
+    }
+
+    metrics_header("self_cpu_seconds_total", "counter", "Cpu time of hd-idle itself.");
+    metrics_printf("hd_idle_self_cpu_seconds_total %.3f\n", profile_cpu_secs());
+
+    metrics_header("self_wakeups_total", "counter", "Wakeups of the main loop by cause.");
+    for (int i = 0; i < PROFILE_WAITS; ++i) {
+        metrics_printf("hd_idle_self_wakeups_total{cause=\"%s\"} %lu\n", profile_wait_name(i), profile.wakeups[i]);
+    }
+
+    metrics_header("self_ioctls_total", "counter", "Requests issued to disks and volumes.");
+    metrics_printf("hd_idle_self_ioctls_total %ld\n", profile.ioctls);
+
+    metrics_header("self_output_bytes_total", "counter", "Bytes written to the console and the logfile.");
+    metrics_printf("hd_idle_self_output_bytes_total{to=\"console\"} %ld\n", profile.console_bytes);
+    metrics_printf("hd_idle_self_output_bytes_total{to=\"log\"} %ld\n", profile.log_bytes);
+
+    metrics_header("spinup_latency_seconds", "histogram", "Time the first i/o after a spin-down waited for the disk to spin up.");
+    for (ds = first_diskstats(); ds != NULL; ds = next_diskstats(ds)) {
+        unsigned int count = 0;
+        for (int i = 0; i < SPINUP_BUCKETS - 1; ++i) {
+            count += ds->spinup_hist[i];
+            metrics_printf("hd_idle_spinup_latency_seconds_bucket{disk=\"%s\",le=\"%.3f\"} %u\n", ds->name + 4, (125L << i) / 1000.0, count);
+        }
+        metrics_printf("hd_idle_spinup_latency_seconds_bucket{disk=\"%s\",le=\"+Inf\"} %u\n", ds->name + 4, ds->spinup_count);
+        metrics_printf("hd_idle_spinup_latency_seconds_sum{disk=\"%s\"} %.3f\n", ds->name + 4, ds->spinup_ms_total / 1000.0);
+        metrics_printf("hd_idle_spinup_latency_seconds_count{disk=\"%s\"} %u\n", ds->name + 4, ds->spinup_count);
+    }
+}
+
+static void metrics_close(METRICS_CLIENT *c)
+{
+    shutdown(c->s, SD_SEND);
+    closesocket(c->s);
+    free(c->body);
+    c->body = NULL;
+    c->state = METRICS_IDLE;
+
+    /* FD_ACCEPT is not signaled again for a connection that has been waiting
+     * in the backlog since all slots were taken; have it accepted now */
+    SetEvent(metrics_event);
+}
+
+/* read the request and send the answer as far as the socket takes them */
+static void metrics_client(METRICS_CLIENT *c)
+{
+    char request[1024];
+    int n;
+
+    if (c->state == METRICS_READING) {
+        /* the request itself does not matter; every path returns the metrics */
+        if ((n = recv(c->s, request, sizeof(request), 0)) == SOCKET_ERROR) {
+            if (WSAGetLastError() != WSAEWOULDBLOCK) {
+                metrics_close(c);
+            }
+            return;
+        }
+        if (n == 0) {
+            metrics_close(c);
+            return;
+        }
+        metrics_format();
+        c->body = metrics_buf;      /* the next request formats into a new buffer */
+        c->body_len = metrics_len;
+        metrics_buf = NULL;
+        metrics_len = metrics_size = 0;
+        n = snprintf(c->header, sizeof(c->header),
+                     "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %u\r\n\r\n",
+                     (unsigned)c->body_len);
+        c->header_len = (size_t)n;
+        c->sent = 0;
+        c->state = METRICS_WRITING;
+    }
+    while (c->sent < c->header_len + c->body_len) {
+        const char *p = (c->sent < c->header_len) ? c->header + c->sent : c->body + (c->sent - c->header_len);
+        size_t len = (c->sent < c->header_len) ? c->header_len - c->sent : c->header_len + c->body_len - c->sent;
+
+        if ((n = send(c->s, p, (int)len, 0)) == SOCKET_ERROR) {
+            if (WSAGetLastError() != WSAEWOULDBLOCK) {
+                metrics_close(c);
+            }
+            return;     /* FD_WRITE signals the event once there is room again */
+        }
+        c->sent += n;
+    }
+    metrics_close(c);
+}
+
+/* accept the pending connections and serve all of them as far as possible */
+void metrics_serve(void)
+{
+    SOCKET s;
+
+    WSAResetEvent(metrics_event);
+    for (;;) {
+        METRICS_CLIENT *c = NULL;
+
+        for (int i = 0; i < METRICS_CLIENTS && c == NULL; ++i) {
+            if (metrics_clients[i].state == METRICS_IDLE) {
+                c = &metrics_clients[i];
+            }
+        }
+        if (c == NULL) {
+            /* the others wait in the backlog until a connection is done */
+            break;
+        }
+        if ((s = accept(metrics_socket, NULL, NULL)) == INVALID_SOCKET) {
+            break;
+        }
+        /* accepted sockets inherit the event selection (and are non-blocking); they
+         * only need to signal that a request has arrived, there is room to send or
+         * the scraper has gone */
+        WSAEventSelect(s, metrics_event, FD_READ | FD_WRITE | FD_CLOSE);
+        c->s = s;
+        c->started = GetTickCount64();
+        c->state = METRICS_READING;
+    }
+    for (int i = 0; i < METRICS_CLIENTS; ++i) {
+        if (metrics_clients[i].state != METRICS_IDLE) {
+            metrics_client(&metrics_clients[i]);
+        }
+    }
+}
+
+/* drop the connections that have taken too long; returns the ms until the
+ * next one times out, INFINITE if none is open */
+DWORD metrics_poll(ULONGLONG now)
+{
+    DWORD timeout = INFINITE;
+
+    for (int i = 0; i < METRICS_CLIENTS; ++i) {
+        METRICS_CLIENT *c = &metrics_clients[i];
+        if (c->state == METRICS_IDLE) {
+            continue;
+        }
+        if (now >= c->started + METRICS_TIMEOUT) {
+            dprintf("metrics: dropping a connection after %d ms\n", METRICS_TIMEOUT);
+            metrics_close(c);
+        } else if (timeout > c->started + METRICS_TIMEOUT - now) {
+            timeout = (DWORD)(c->started + METRICS_TIMEOUT - now);
+        }
+    }
+    return timeout;
+}
@@ -0,0 +1,462 @@
+/*
+ * mock.cpp - simulated disks for measuring the decisions of hd-idle
+ *
+ * Copyright (c) 2022 RalfOGit
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * device_mock is a device backend (see probe.cpp) without disks: every disk
+ * follows a script of phases that is repeated over and over,
+ *
+ *   <ops>/<seconds>[,<ops>/<seconds>...]
+ *
+ * i.e. this many i/os per second for this many seconds, 0 for idle; e.g.
+ * "20/60,0/3540" is a minute of i/o every hour. The counters the probes see
+ * (i/os, bytes, idle and query time, i/o time) are computed from the script
+ * up to the time of the probe; a disk that is spun down spins up with its
+ * next i/o and adds MOCK_SPINUP_MS to the i/o time. Its clock is simulated
+ * as well, so a day of decisions takes as long as the decisions themselves.
+ *
+ * hd-idle-bench, the second project of hd-idle.sln, is built from the same
+ * sources with HD_IDLE_BENCH defined and runs mock_bench() instead of the
+ * main loop of hd-idle:
+ *
+ *   hd-idle-bench [-n <disks>] [-H <hours>] [-i <idle_time>] [-P <break_even>] [-s <script>]... [-d]
+ *
+ * The disks get the -s scripts (or MOCK_SCRIPTS) in turn, each at its own
+ * offset into its script. The loop is that of hd_idle_run(): the due disks
+ * are taken from the schedule, probed through the thread pool and evaluated,
+ * and the clock is advanced to the next disk that is due. Reported are the
+ * decisions (evaluated probes) per second of wall time and the memory per
+ * disk, both its DISKSTATS and what the process grew by while setting up
+ * the disks (events, schedule), so changes to the scheduler and the data
+ * layout can be compared.
+ */
+
+#include "hd-idle.h"
+#include <Psapi.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MOCK_DISKS          4096
+#define MOCK_HOURS          24
+#define MOCK_PHASES         16      /* per script */
+#define MOCK_MAX_SCRIPTS    16
+#define MOCK_IO_MS          5       /* time of an i/o of a running disk */
+#define MOCK_SPINUP_MS      8000
+#define MOCK_IO_BYTES       65536
+
+/* a busy disk, daily and hourly jobs, an occasional access, a disk nobody uses */
+static const char *MOCK_SCRIPTS[] = { "50/5,0/25", "20/60,0/3540", "5/10,0/14390", "100/600,0/85800", "0/86400" };
+
+typedef struct MOCK_PHASE {
+    int                ops;         /* per second, 0 if idle */
+    int                secs;
+} MOCK_PHASE;
+
+typedef struct MOCK_SCRIPT {
+    MOCK_PHASE         phases[MOCK_PHASES];
+    int                nphases;
+    LONGLONG           cycle;       /* FILETIME units */
+} MOCK_SCRIPT;
+
+typedef struct MOCK_DISK {
+    const MOCK_SCRIPT *script;
+    int                phase;
+    LONGLONG           phase_end;   /* FILETIME */
+    LONGLONG           counted;     /* FILETIME up to which the counters are computed */
+    LONGLONG           ops_frac;    /* i/os * FILETIME units not yet counted */
+    unsigned int       reads;
+    unsigned int       writes;
+    ULONGLONG          bytes;
+    LONGLONG           idle_time;   /* 100ns units, like DISK_PERFORMANCE */
+    LONGLONG           query_time;
+    LONGLONG           io_time;
+    int                standby;
+} MOCK_DISK;
+
+static int  mock_check_power(DISKSTATS *ds);
+static bool mock_standby    (DISKSTATS *ds);
+static bool mock_wake       (DISKSTATS *ds);
+static void mock_query      (DISKSTATS *ds);
+static void mock_spindown   (DISKSTATS *ds);
+static void mock_epc        (DISKSTATS *ds);
+static LONGLONG  mock_now   (void);
+static ULONGLONG mock_ticks (void);
+
+static const BACKEND backend_mock = { "mock", mock_check_power, mock_standby, mock_wake };
+const DEVICE_OPS device_mock = { "mock", mock_query, mock_spindown, mock_epc, mock_now, mock_ticks };
+
+static MOCK_DISK     *mock_disks = NULL;        /* indexed by drive number */
+static MOCK_SCRIPT    mock_scripts[MOCK_MAX_SCRIPTS];
+static int            mock_nscripts = 0;
+static LONGLONG       mock_ft;                  /* simulated clock; only the main thread advances it, */
+static ULONGLONG      mock_tick;                /* and only while no probe is running */
+
+/* add a script of <ops>/<seconds>[,...] phases; returns 0 or -1 if it is invalid */
+int mock_script(const char *spec)
+{
+    MOCK_SCRIPT *sc = &mock_scripts[mock_nscripts];
+    const char *p = spec;
+
+    if (mock_nscripts == MOCK_MAX_SCRIPTS) {
+        return -1;
+    }
+    sc->nphases = 0;
+    sc->cycle = 0;
+    while (*p != '\0') {
+        MOCK_PHASE *ph = &sc->phases[sc->nphases];
+        char *end;
+
+        if (sc->nphases == MOCK_PHASES) {
+            return -1;
+        }
+        ph->ops = (int)strtol(p, &end, 10);
+        if (end == p || *end != '/' || ph->ops < 0) {
+            return -1;
+        }
+        p = end + 1;
+        ph->secs = (int)strtol(p, &end, 10);
+        if (end == p || (*end != ',' && *end != '\0') || ph->secs <= 0) {
+            return -1;
+        }
+        p = (*end == ',') ? end + 1 : end;
+        sc->cycle += ph->secs * 10000000LL;
+        sc->nphases++;
+    }
+    if (sc->nphases == 0) {
+        return -1;
+    }
+    mock_nscripts++;
+    return 0;
+}
+
+/* compute the counters of a disk up to the given time */
+static void mock_advance(MOCK_DISK *m, LONGLONG now)
+{
+    while (m->counted < now) {
+        const MOCK_PHASE *ph = &m->script->phases[m->phase];
+        LONGLONG end = (m->phase_end < now) ? m->phase_end : now;
+        LONGLONG span = end - m->counted;
+
+        if (ph->ops > 0) {
+            unsigned int ops;
+
+            m->ops_frac += span * ph->ops;
+            ops = (unsigned int)(m->ops_frac / 10000000LL);
+            m->ops_frac %= 10000000LL;
+            if (ops > 0) {
+                m->reads += ops - ops / 2;
+                m->writes += ops / 2;
+                m->bytes += (ULONGLONG)ops * MOCK_IO_BYTES;
+                m->io_time += ops * MOCK_IO_MS * 10000LL;
+                if (m->standby) {
+                    /* the i/os wait for the disk to spin up */
+                    m->standby = 0;
+                    m->io_time += ops * MOCK_SPINUP_MS * 10000LL;
+                }
+            }
+        } else {
+            m->idle_time += span;
+        }
+        m->query_time += span;
+        m->counted = end;
+        if (end == m->phase_end) {
+            m->phase = (m->phase + 1) % m->script->nphases;
+            m->phase_end += m->script->phases[m->phase].secs * 10000000LL;
+        }
+    }
+}
+
+static int mock_check_power(DISKSTATS *ds)
+{
+    return mock_disks[ds->drive].standby ? 0x00 : 0xff;
+}
+
+static bool mock_standby(DISKSTATS *ds)
+{
+    mock_disks[ds->drive].standby = 1;
+    return true;
+}
+
+static bool mock_wake(DISKSTATS *ds)
+{
+    MOCK_DISK *m = &mock_disks[ds->drive];
+
+    if (m->standby) {
+        m->standby = 0;
+        m->io_time += MOCK_SPINUP_MS * 10000LL;
+    }
+    return true;
+}
+
+/* runs on the worker of a probe, like probe_query() */
+static void mock_query(DISKSTATS *ds)
+{
+    PROBE *p = &ds->probe;
+    MOCK_DISK *m = &mock_disks[ds->drive];
+
+    p->status = PROBE_OK;
+    p->error = 0;
+    p->ata = -1;
+    p->etw_last_io = 0;
+    p->wake_ms = -1;
+    p->woken = 0;
+
+    if (p->backend == NULL) {
+        ds->caps.known = 1;
+        ds->caps.drive_type = DRIVE_FIXED;
+        ds->caps.bus_type = -1;
+        ds->caps.rotational = 1;
+        p->backend = &backend_mock;
+    }
+    if (p->wake) {
+        p->woken = p->backend->wake(ds);
+    }
+    mock_advance(m, mock_ft);
+    if (m->standby) {
+        p->status = PROBE_ASLEEP;
+        return;
+    }
+    p->ata = p->backend->check_power(ds);
+
+    memset(&p->perf, 0x00, sizeof(p->perf));
+    p->perf.ReadCount = m->reads;
+    p->perf.WriteCount = m->writes;
+    p->perf.BytesRead.QuadPart = (LONGLONG)m->bytes;
+    p->perf.ReadTime.QuadPart = m->io_time;
+    p->perf.IdleTime.QuadPart = m->idle_time;
+    p->perf.QueryTime.QuadPart = m->query_time;
+}
+
+static void mock_spindown(DISKSTATS *ds)
+{
+    PROBE *p = &ds->probe;
+
+    p->status = PROBE_OK;
+    p->error = 0;
+    if (p->backend == NULL) {
+        p->backend = &backend_mock;
+    }
+    mock_advance(&mock_disks[ds->drive], mock_ft);
+    p->standby_ok = p->backend->standby(ds);
+    p->ata = p->backend->check_power(ds);
+}
+
+/* simulated disks have no extended power conditions */
+static void mock_epc(DISKSTATS *ds)
+{
+    ds->probe.status = PROBE_OK;
+    ds->probe.error = ERROR_NOT_SUPPORTED;
+    ds->probe.epc_ok = 0;
+}
+
+static LONGLONG mock_now(void)
+{
+    return mock_ft;
+}
+
+static ULONGLONG mock_ticks(void)
+{
+    return mock_tick;
+}
+
+/* private bytes of the process */
+static SIZE_T mock_private_bytes(void)
+{
+    PROCESS_MEMORY_COUNTERS_EX pmc;
+
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&pmc, sizeof(pmc))) {
+        return 0;
+    }
+    return pmc.PrivateUsage;
+}
+
+/* evaluate the completed probes and queue their disks again; returns the number evaluated */
+static unsigned int mock_evaluate(void)
+{
+    unsigned int n = 0;
+
+    for (DISKSTATS *ds = first_diskstats(); ds != NULL; ds = next_diskstats(ds)) {
+        if (ds->probe.state == PROBE_DONE) {
+            probe_evaluate(ds);
+            ++n;
+            if (ds->in_use && !ds->ignored && !sched_insert(ds, probe_next_poll(ds))) {
+                return n;
+            }
+        }
+    }
+    return n;
+}
+
+/* run the decisions over simulated disks for the given time; returns the exit code */
+int mock_bench(int disks, int hours)
+{
+    LARGE_INTEGER freq, start, end;
+    ULONGLONG decisions = 0, until;
+    unsigned int spindowns = 0, spinups = 0;
+    SIZE_T before, after;
+    DISKSTATS *ds;
+    double secs;
+
+    if (mock_nscripts == 0) {
+        for (size_t i = 0; i < sizeof(MOCK_SCRIPTS) / sizeof(MOCK_SCRIPTS[0]); ++i) {
+            mock_script(MOCK_SCRIPTS[i]);
+        }
+    }
+    device_ops = &device_mock;
+    mock_ft = filetime_now();
+    mock_tick = GetTickCount64();
+
+    before = mock_private_bytes();
+    ds_capacity = disks;
+    ds_table = (DISKSTATS*)calloc(ds_capacity, sizeof(*ds_table));
+    mock_disks = (MOCK_DISK*)calloc(disks, sizeof(*mock_disks));
+    if (ds_table == NULL || mock_disks == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    for (int i = 0; i < disks; ++i) {
+        MOCK_DISK *m = &mock_disks[i];
+
+        /* start each disk at its own offset into its script */
+        m->script = &mock_scripts[i % mock_nscripts];
+        m->counted = mock_ft - (LONGLONG)((i * 104729ULL) % (ULONGLONG)(m->script->cycle / 10000000LL)) * 10000000LL;
+        m->phase_end = m->counted + m->script->phases[0].secs * 10000000LL;
+        mock_advance(m, mock_ft);
+        if (new_diskstats(i, INVALID_HANDLE_VALUE) == NULL) {
+            fprintf(stderr, "out of memory\n");
+            return 2;
+        }
+    }
+    after = mock_private_bytes();
+
+    printf("simulating %d disks with %d scripts for %d h\n", disks, mock_nscripts, hours);
+    until = mock_tick + hours * 3600000ULL;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+    for (;;) {
+        unsigned int n;
+
+        while ((ds = sched_pop_due(mock_tick)) != NULL) {
+            group_prepare(ds, mock_tick);
+            probe_start(ds);
+        }
+        /* spin-downs started by the evaluation complete at the same time */
+        do {
+            probe_wait(PROBE_DEADLINE);
+            decisions += (n = mock_evaluate());
+        } while (n > 0);
+
+        if ((ds = sched_next()) == NULL || ds->next_due > until) {
+            break;
+        }
+        if (ds->next_due > mock_tick) {
+            mock_ft += (LONGLONG)(ds->next_due - mock_tick) * 10000;
+            mock_tick = ds->next_due;
+        }
+    }
+    QueryPerformanceCounter(&end);
+    secs = (double)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+
+    for (ds = first_diskstats(); ds != NULL; ds = next_diskstats(ds)) {
+        spindowns += ds->spindowns;
+        spinups += ds->spinups;
+    }
+    printf("%llu decisions in %.3f s: %.0f decisions/s, %.2f us each; %u spin-downs, %u spin-ups\n",
+           decisions, secs, (secs > 0) ? decisions / secs : 0.0, (decisions > 0) ? secs * 1e6 / decisions : 0.0,
+           spindowns, spinups);
+    printf("memory per disk: %u bytes of DISKSTATS, %u bytes of simulated state, %.0f bytes of the process in total\n",
+           (unsigned int)sizeof(DISKSTATS), (unsigned int)sizeof(MOCK_DISK),
+           (after > before) ? (double)(after - before) / disks : 0.0);
+    return 0;
+}
+
+#ifdef HD_IDLE_BENCH
+extern char       *optarg;
+extern int         optopt;
+extern int         getopt          (int nargc, char *const nargv[], const char *ostr);
+
+int main(int argc, char *argv[])
+{
+    static IDLE_TIME it;
+    int disks = MOCK_DISKS;
+    int hours = MOCK_HOURS;
+    int opt;
+
+    it.drive = -1;
+    it.idle_time = DEFAULT_IDLE_TIME;
+    it.group = -1;
+    it_root = &it;
+    verbosity = V_ERROR;
+
+    while ((opt = getopt(argc, argv, "n:H:i:P:s:dh")) != -1) {
+        switch (opt) {
+
+        case 'n':
+            if ((disks = atoi(optarg)) <= 0) {
+                fprintf(stderr, "error: -n requires a number of disks\n");
+                return 1;
+            }
+            break;
+
+        case 'H':
+            if ((hours = atoi(optarg)) <= 0) {
+                fprintf(stderr, "error: -H requires a number of hours\n");
+                return 1;
+            }
+            break;
+
+        case 'i':
+            it.idle_time = atoi(optarg);
+            break;
+
+        case 'P':
+            if ((policy_break_even = atoi(optarg)) <= 0) {
+                fprintf(stderr, "error: -P requires a break-even time in seconds\n");
+                return 1;
+            }
+            break;
+
+        case 's':
+            if (mock_script(optarg) != 0) {
+                fprintf(stderr, "error: -s requires <ops>/<seconds>[,<ops>/<seconds>...] (at most %d scripts of %d phases)\n",
+                        MOCK_MAX_SCRIPTS, MOCK_PHASES);
+                return 1;
+            }
+            break;
+
+        case 'd':
+            verbosity = V_DEBUG;
+            break;
+
+        case 'h':
+            printf("usage: hd-idle-bench [-n <disks>] [-H <hours>] [-i <idle_time>] [-P <break_even>] [-s <script>]... [-d] [-h]\n");
+            return 0;
+
+        case ':':
+            fprintf(stderr, "error: option -%c requires an argument\n", optopt);
+            return 1;
+
+        case '?':
+            fprintf(stderr, "error: unknown option -%c\n", optopt);
+            return 1;
+        }
+    }
+    return mock_bench(disks, hours);
+}
+#endif
@@ -0,0 +1,184 @@
+/*
+ * policy.cpp - adaptive spin-down policy for hd-idle
+ *
+ * Copyright (c) 2022 RalfOGit
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * By default a disk is spun down once it has been idle for its idle time.
+ * With -P <break_even>, every disk keeps a histogram of the idle gaps between
+ * i/o bursts, by the hour of day in which the gap started and log2 of its
+ * length in seconds. From the gaps seen in the current hour that were at
+ * least as long as the current one, the policy estimates whether the gap will
+ * end within the break-even window, i.e. the time a disk has to stay down to
+ * be worth spinning down at all:
+ *
+ * - likely to end within the window: the spin-down is deferred, but by no
+ *   more than one window past the idle time;
+ * - likely to last longer than the idle time plus the window: the disk is
+ *   spun down early, after a quarter of its idle time at the earliest.
+ *
+ * Without enough samples for the hour, the fixed idle time applies.
+ *
+ * The decisions taken on every probe (does the i/o count as activity, spin
+ * down now, when to probe next) are made here only, from the state in
+ * DISKSTATS, so that the simulation of recorded traces (trace.cpp) takes the
+ * same decisions as the main loop.
+ */
+
+#include "hd-idle.h"
+
+#define POLICY_MIN_SAMPLES  8       /* gaps needed in an hour before predicting */
+#define POLICY_DEFER        0.5     /* defer if the gap ends within the window at least this likely */
+#define POLICY_EARLY        0.9     /* spin down early if a long gap is at least this likely */
+
+int policy_break_even = 0;          /* s; 0 = fixed idle time */
+
+/* add an idle gap of a disk that ended with an i/o at io */
+void policy_record(DISKSTATS *ds, time_t prev_io, time_t io)
+{
+    time_t gap = io - prev_io;
+    struct tm *tm;
+    int bucket = 0;
+
+    if (gap <= 0 || (tm = localtime(&prev_io)) == NULL) {
+        return;
+    }
+    while (bucket < GAP_BUCKETS - 1 && gap >= (2LL << bucket)) {
+        ++bucket;
+    }
+
+    unsigned short *hist = ds->gap_hist[tm->tm_hour];
+    if (hist[bucket] == 0xffff) {
+        /* age the hour instead of overflowing */
+        for (int i = 0; i < GAP_BUCKETS; ++i) {
+            hist[i] /= 2;
+        }
+    }
+    hist[bucket]++;
+}
+
+/* does i/o since the previous probe count as activity? ops and bytes are
+ * the deltas over elapsed seconds; busy if requests are still queued */
+bool policy_active(DISKSTATS *ds, unsigned int ops, ULONGLONG bytes, time_t elapsed, bool busy)
+{
+    if (ops == 0) {
+        return false;
+    }
+    if (ds->spun_down || busy || (ds->min_ops == 0 && ds->min_kbytes == 0)) {
+        return true;
+    }
+    if (elapsed <= 0) {
+        elapsed = 1;
+    }
+
+    ULONGLONG ops_rate = (ULONGLONG)ops * 60 / elapsed;
+    ULONGLONG kbytes_rate = bytes / 1024 * 60 / elapsed;
+    if ((ds->min_ops == 0 || ops_rate <= ds->min_ops) && (ds->min_kbytes == 0 || kbytes_rate <= ds->min_kbytes)) {
+        dprintf("probing %s: ignoring %u i/os, %llu bytes in %llu s\n", ds->name, ops, bytes, (unsigned long long)elapsed);
+        return false;
+    }
+    return true;
+}
+
+/* ms from now_ft (FILETIME) until a disk is to be probed again */
+LONGLONG policy_next_probe(DISKSTATS *ds, LONGLONG now_ft)
+{
+    LONGLONG tier = epc_next(ds, now_ft);      /* ms until the next idle tier, -1 if none */
+    LONGLONG left;
+    time_t interval;
+
+    if (ds->idle_time == 0) {
+        return (tier >= 0 && tier < MAX_POLL_INTERVAL * 1000LL) ? tier : MAX_POLL_INTERVAL * 1000LL;
+    }
+    if ((interval = ds->idle_time / 10) == 0) {
+        interval = 1;
+    }
+    if (interval > MAX_POLL_INTERVAL) {
+        interval = MAX_POLL_INTERVAL;
+    }
+
+    if (ds->spun_down && !ds->verify_spindown && !(group_policy(ds) & GROUP_WAKE)) {
+        interval *= SPUNDOWN_POLL_FACTOR;
+        if (interval > MAX_POLL_INTERVAL) {
+            interval = MAX_POLL_INTERVAL;
+        }
+    } else if (!ds->new_disk) {
+        /* past the idle time, the adaptive policy may still defer the spin-down */
+        /* rounded up, so the threshold has been reached when the disk is probed */
+        left = ds->last_io_ft + ds->idle_time * 10000000LL - now_ft;
+        left = (left > 0) ? (left + 9999) / 10000 : -1;
+        if (tier >= 0 && (left < 0 || tier < left)) {
+            left = tier;
+        }
+        if (left >= 0 && left < interval * 1000LL) {
+            return left;
+        }
+    }
+    return interval * 1000LL;
+}
+
+/* should a disk that has been idle for the given time be spun down now? */
+bool policy_spindown(DISKSTATS *ds, LONGLONG idle_ms)
+{
+    time_t idle = (time_t)(idle_ms / 1000);
+    bool reached = idle_ms >= ds->idle_time * 1000LL;
+    time_t window = policy_break_even;
+    unsigned int longer = 0, within = 0, beyond = 0;
+    struct tm *tm;
+
+    if (ds->idle_time == 0) {
+        return false;
+    }
+    if (window == 0 || idle < ds->idle_time / 4 || idle >= ds->idle_time + window ||
+        (tm = localtime(&ds->last_io)) == NULL) {
+        return reached;
+    }
+
+    /* bucket i holds the gaps of 2^i .. 2^(i+1)-1 s (the first one from 1s, the last one unbounded) */
+    unsigned short *hist = ds->gap_hist[tm->tm_hour];
+    for (int i = 0; i < GAP_BUCKETS; ++i) {
+        time_t lo = (i == 0) ? 1 : (1LL << i);
+        time_t hi = (i == GAP_BUCKETS - 1) ? (time_t)1 << 62 : (2LL << i) - 1;
+        if (hi < idle) {
+            continue;       /* ended before the current gap got this long */
+        }
+        longer += hist[i];
+        if (lo <= idle + window) {
+            within += hist[i];
+        }
+        if (hi > ds->idle_time + window) {     /* the whole gap, not what is left of it */
+            beyond += hist[i];
+        }
+    }
+    if (longer < POLICY_MIN_SAMPLES) {
+        return reached;
+    }
+
+    if (reached) {
+        if (within >= POLICY_DEFER * longer) {
+            dprintf("policy %s: deferring spin-down; %u of %u gaps ended within %d s\n", ds->name, within, longer, (int)window);
+            return false;
+        }
+        return true;
+    }
+    if (beyond >= POLICY_EARLY * longer) {
+        dprintf("policy %s: early spin-down; %u of %u gaps lasted longer than %d s\n", ds->name, beyond, longer, (int)(ds->idle_time + window));
+        return true;
+    }
+    return false;
+}
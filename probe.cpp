@@ -0,0 +1,507 @@
+/*
+ * probe.cpp - probing disks and the spin-down state machine
+ *
+ * Copyright (c) 2022 RalfOGit
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * A probe takes the power state and the counters of a disk on a thread pool
+ * worker; evaluating it on the main thread decides whether the disk has been
+ * active, has spun up, or is to be spun down or put into an idle tier. The
+ * requests to the disk itself are left to a device backend (DEVICE_OPS): a
+ * query, the spin-down pipeline and entering an idle tier, plus the clocks
+ * the decisions are based on. device_win32 (hd-idle.cpp) sends them to the
+ * disks; device_mock (mock.cpp) simulates disks from scripted counters, so
+ * the decisions can be run and measured without disks or admin rights.
+ */
+
+#include "hd-idle.h"
+#include <stdlib.h>
+
+static void CALLBACK probe_worker  (PTP_CALLBACK_INSTANCE instance, PVOID context);
+static void        spindown_start  (DISKSTATS *ds, bool joined);
+static void        spindown_evaluate(DISKSTATS *ds);
+static long        spinup_latency  (DISKSTATS *ds);
+static bool        disk_active     (DISKSTATS *ds, time_t now);
+static void        take_counters   (DISKSTATS *ds, time_t now);
+static LONGLONG    last_io_estimate(DISKSTATS *ds);
+static LONGLONG    last_io_latest  (DISKSTATS *ds);
+
+const DEVICE_OPS  *device_ops = &device_win32;
+
+/* Time of the next probe of a disk (GetTickCount64() ms, as given by the
+ * device backend). The poll interval of a disk is 1/10th of its idle time
+ * (1s .. MAX_POLL_INTERVAL); disks that are spun down (and verified) or never
+ * spun down are polled SPUNDOWN_POLL_FACTOR times less often. A running disk
+ * is also probed right when it reaches its spin-down threshold, counted from
+ * the latest time its last i/o can have been (see last_io_latest()): with etw
+ * this is to the millisecond; without, the spin-down is at most one poll
+ * interval late, but never early.
+ */
+ULONGLONG probe_next_poll(DISKSTATS *ds)
+{
+    ULONGLONG now = device_ops->ticks();
+
+    if (ds->idle_time != 0 && (ds->held || (ds->wake_pending && ds->spun_down))) {
+        /* a power command is held back by the -n limit */
+        ULONGLONG retry = group_retry();
+        return (retry > now) ? retry : now;
+    }
+    return now + policy_next_probe(ds, device_ops->now());
+}
+
+/* start probing a disk on a thread pool worker, unless the previous probe
+ * is still outstanding */
+void probe_start(DISKSTATS *ds)
+{
+    if (ds->probe.state != PROBE_IDLE) {
+        return;
+    }
+    ds->probe.state = PROBE_RUNNING;
+    ds->probe.backend = ds->backend;
+    ResetEvent(ds->probe.done);
+    if (!TrySubmitThreadpoolCallback(probe_worker, ds, NULL)) {
+        probe_worker(NULL, ds);
+    }
+}
+
+/* wait for the running probes, but no longer than the given time in total;
+ * returns the number of probes still outstanding */
+int probe_wait(DWORD timeout_ms)
+{
+    ULONGLONG deadline = GetTickCount64() + timeout_ms;
+    DISKSTATS *ds;
+    int outstanding = 0;
+
+    for (ds = first_diskstats(); ds != NULL; ds = next_diskstats(ds)) {
+        if (ds->probe.state == PROBE_RUNNING) {
+            ULONGLONG now = GetTickCount64();
+            WaitForSingleObject(ds->probe.done, (now < deadline) ? (DWORD)(deadline - now) : 0);
+            if (ds->probe.state == PROBE_RUNNING) {
+                dprintf("probing %s: no answer within %lu ms\n", ds->name, timeout_ms);
+                ++outstanding;
+            }
+        }
+    }
+    return outstanding;
+}
+
+static void CALLBACK probe_worker(PTP_CALLBACK_INSTANCE instance, PVOID context)
+{
+    DISKSTATS *ds = (DISKSTATS*)context;
+    LARGE_INTEGER freq, start, end;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+    if (ds->probe.spindown) {
+        device_ops->spindown(ds);
+    } else if (ds->probe.epc >= 0) {
+        device_ops->epc(ds);
+    } else {
+        device_ops->query(ds);
+    }
+    QueryPerformanceCounter(&end);
+    ds->probe.latency_us = (ULONG)((end.QuadPart - start.QuadPart) * 1000000 / freq.QuadPart);
+    ds->probe.time_ft = device_ops->now();
+    ds->probe.time = filetime_to_time(ds->probe.time_ft);
+    InterlockedExchange(&ds->probe.state, PROBE_DONE);
+    SetEvent(ds->probe.done);
+}
+
+/* evaluate the result of a completed probe and spin the disk down once it
+ * has been idle long enough */
+void probe_evaluate(DISKSTATS *ds)
+{
+    PROBE *p = &ds->probe;
+    time_t now = p->time;
+    unsigned int reads, writes;
+    bool join = ds->join_spindown;
+    int tier;
+
+    p->state = PROBE_IDLE;
+    if (p->backend != ds->backend) {
+        dprintf("probing %s: using %s power commands\n", ds->name, p->backend->name);
+        if (ds->backend == NULL) {
+            /* identified by this probe; settings and saved state by serial number, wwn or guid */
+            config_apply(ds);
+            if (ds->new_disk) {
+                snapshot_restore(ds);
+            }
+        }
+        ds->backend = p->backend;
+    }
+    if (p->spindown) {
+        spindown_evaluate(ds);
+        return;
+    }
+    if (p->epc >= 0) {
+        epc_evaluate(ds);
+        return;
+    }
+    p->wake = 0;
+    ds->join_spindown = 0;
+    ds->held = 0;
+    ds->probes++;
+    ds->probe_us_total += p->latency_us;
+    if (p->latency_us > ds->probe_us_max) {
+        ds->probe_us_max = p->latency_us;
+    }
+
+    switch (p->status) {
+    case PROBE_MISSING:
+        lprintf("%s: removed\n", ds->name);
+        trace_event(ds, TRACE_STOP, p->time_ft, 0);
+        remove_diskstats(ds);
+        return;
+    case PROBE_DENIED:
+        console_printf(V_ERROR, "probing %s: application requires admin privileges\n", ds->name);
+        return;
+    case PROBE_FAILED:
+        dprintf("probing %s: cannot open device; error %lu\n", ds->name, p->error);
+        return;
+    case PROBE_ASLEEP:
+        dprintf("probing %s: asleep\n", ds->name);
+        if (!ds->spun_down) {
+            lprintf("%s: found spun down\n", ds->name);
+            ds->spindown = now;
+        }
+        ds->spun_down = true;
+        ds->verify_spindown = 0;
+        return;
+    case PROBE_IGNORED:
+        /* can never be spun down; not probed again while the disk is present */
+        ds->ignored = 1;
+        if (ds->caps.drive_type != DRIVE_FIXED) {
+            switch (ds->caps.drive_type) {
+            case DRIVE_UNKNOWN:  	dprintf("probing %s: drive unknown\n", ds->name); break;		// The drive type cannot be determined.
+            case DRIVE_NO_ROOT_DIR: dprintf("probing %s: root path invalid\n", ds->name); break;	// The root path is invalid; for example, there is no volume mounted at the specified path.
+            case DRIVE_REMOVABLE:	dprintf("probing %s: removable media\n", ds->name); break;		// The drive has removable media; for example, a floppy drive, thumb drive, or flash card reader.
+            case DRIVE_FIXED:		dprintf("probing %s: fixed drive\n", ds->name); break;			// The drive has fixed media; for example, a hard disk drive or an ssd drive.
+            case DRIVE_REMOTE:		dprintf("probing %s: network drive\n", ds->name); break;		// The drive is a remote(network) drive.
+            case DRIVE_CDROM:		dprintf("probing %s: cdrom drive\n", ds->name); break;			// The drive is a CD-ROM drive.
+            case DRIVE_RAMDISK:		dprintf("probing %s: ramdisk\n", ds->name); break;				// The drive is a RAM-Disk
+            default:				dprintf("probing %s: unknown drive type\n", ds->name); break;
+            }
+        } else if (ds->caps.removable) {
+            dprintf("probing %s: removable media\n", ds->name);
+        } else if (ds->caps.rotational == 0) {
+            dprintf("probing %s: ssd\n", ds->name);
+        } else {
+            dprintf("probing %s: no standby power state\n", ds->name);
+        }
+        return;
+    case PROBE_NO_COUNTERS:
+        dprintf("probing %s: cannot query read/write counts  error 0x%lx\n", ds->name, p->error);
+        /* if error code is "invalid function", make sure disk performance counters are enabled */
+        static bool tried_diskperf = false;
+        if (p->error == 1 && tried_diskperf == false) {
+            tried_diskperf = true;
+            int res = system("diskperf -YD");
+        }
+        return;
+    }
+
+    char *ata_power_mode_string = "";
+    switch (p->ata) {
+    case 0x00:  case 0x01:
+        ata_power_mode_string = "standby mode";
+        break;
+    case 0x80:  case 0x81:  case 0x82:  case 0x83:
+        ata_power_mode_string = "idle mode";
+        break;
+    case 0xff:
+        ata_power_mode_string = "active or idle mode";
+        break;
+    }
+
+    /* the first probe after a spin-down confirms that the drive is in standby;
+     * if it is not, the spin-down is repeated once the disk is found idle */
+    if (ds->verify_spindown) {
+        ds->verify_spindown = 0;
+        if (p->ata == 0x00 || p->ata == 0x01) {
+            dprintf("probing %s: spin-down verified\n", ds->name);
+        } else if (p->ata >= 0) {
+            dprintf("probing %s: spin-down not confirmed (power mode 0x%02x)\n", ds->name, p->ata);
+            ds->spun_down = 0;
+        }
+    }
+
+    /* spun up together with its group; it is about to be accessed */
+    if (p->woken && ds->spun_down) {
+        lprintf("%s: spun up with group %s\n", ds->name, group_name(ds));
+        trace_event(ds, TRACE_SPINUP, p->time_ft, 0);
+        ds->spinup = now;
+        ds->spinups++;
+        ds->spun_down_secs += ds->spinup - ds->spindown;
+        ds->last_io = now;
+        ds->last_io_ft = p->time_ft;
+        ds->spun_down = 0;
+        ds->epc_tier = -1;
+    }
+
+    reads = p->perf.ReadCount;
+    writes = p->perf.WriteCount;
+
+    /* the i/o since the counters were taken, for -R */
+    if (!ds->new_disk && (reads != ds->reads || writes != ds->writes)) {
+        trace_io(ds, last_io_estimate(ds), reads - ds->reads, writes - ds->writes,
+                 (ULONGLONG)(p->perf.BytesRead.QuadPart + p->perf.BytesWritten.QuadPart) - ds->bytes);
+    }
+
+    if (ds->new_disk) {
+        trace_event(ds, TRACE_START, p->time_ft, 0);
+        dprintf("probing %s: reads: %u, writes: %u, new disk - %s\n", ds->name, reads, writes, ata_power_mode_string);
+
+        /* first counter snapshot of a new disk */
+        if (ds->restored) {
+            /* continue with the state saved by a previous run, if it still holds */
+            snapshot_resume(ds, reads, writes, now);
+            ds->last_io_ft = time_to_filetime(ds->last_io);
+        } else {
+            ds->last_io = now;
+            ds->last_io_ft = p->time_ft;
+            ds->spinup = ds->last_io;
+            ds->spun_down = 0;
+        }
+        take_counters(ds, now);
+        ds->new_disk = 0;
+        if (volumes_enabled) {
+            volumes_attribute(ds, false);
+        }
+    }
+    else if (!disk_active(ds, now)) {
+        if (volumes_enabled) {
+            volumes_attribute(ds, false);
+        }
+        if (ds->reads != reads || ds->writes != writes) {
+            /* below the activity thresholds; the i/o is not counted, but does not add up either */
+            take_counters(ds, now);
+        }
+        if (!ds->spun_down) {
+            dprintf("probing %s: reads: %u, writes: %u, elapsed %llu / %d - %s\n", ds->name, reads, writes, now - ds->last_io, ds->idle_time, ata_power_mode_string);
+            /* no activity on this disk and still running */
+            LONGLONG idle_ms = (p->time_ft - ds->last_io_ft) / 10000;
+            if (now < ds->spindown_retry) {
+                dprintf("probing %s: backing off for %llu s after %u failed spin-downs\n", ds->name,
+                        (unsigned long long)(ds->spindown_retry - now), ds->spindown_failures);
+            } else if (now < ds->hold_until) {
+                dprintf("probing %s: held running for %llu s on request\n", ds->name, (unsigned long long)(ds->hold_until - now));
+            } else if (policy_spindown(ds, idle_ms) || (join && group_join(ds, idle_ms))) {
+                if (!group_issue(device_ops->ticks())) {
+                    dprintf("probing %s: spin-down held back by the command limit\n", ds->name);
+                    ds->held = 1;
+                } else {
+                    spindown_start(ds, join);
+                }
+            } else if ((tier = epc_due(ds, idle_ms)) >= 0) {
+                /* not yet due for a spin-down, but for a lower power condition */
+                epc_start(ds, tier);
+            }
+        } else {
+            dprintf("probing %s: reads: %u, writes: %u, elapsed %llu / %d spun_down %u - %s\n", ds->name, reads, writes, now - ds->last_io, ds->idle_time, ds->spun_down, ata_power_mode_string);
+        }
+    }
+    else {
+        dprintf("probing %s: reads: %u, writes: %u, elapsed %llu / %d - %s\n", ds->name, reads, writes, now - ds->last_io, ds->idle_time, ata_power_mode_string);
+        /* disk had some activity */
+        if (volumes_enabled) {
+            volumes_attribute(ds, true);
+        }
+        LONGLONG last_io_ft = last_io_latest(ds);
+        time_t last_io = filetime_to_time(last_io_ft);
+        if (ds->spun_down) {
+            /* disk was spun down, thus it has just spun up */
+            long latency = spinup_latency(ds);
+            ds->spinup = last_io;
+            lprintf("%s: spun up after %llu s; spin-up latency %ld ms\n", ds->name, (unsigned long long)(ds->spinup - ds->spindown), latency);
+            trace_event(ds, TRACE_SPINUP, last_io_ft, (latency > 0) ? (unsigned int)latency : 0);
+            ds->spinups++;
+            ds->spun_down_secs += ds->spinup - ds->spindown;
+            group_spun_up(ds);
+        }
+        policy_record(ds, ds->last_io, last_io);
+        take_counters(ds, now);
+        ds->last_io = last_io;
+        ds->last_io_ft = last_io_ft;
+        ds->spun_down = 0;
+        ds->epc_tier = -1;      /* the i/o has taken the disk out of its idle tier */
+    }
+    if (!ds->spun_down) {
+        ds->wake_pending = 0;
+    }
+}
+
+
+/* Spin-down pipeline: flush, standby immediate (or scsi stop unit) and one
+ * check power mode to confirm it, as one request on the worker of the disk's
+ * probe (device_ops->spindown), so the other disks keep being probed meanwhile. The disk counts as
+ * spun down once the result has been evaluated; a failed or unconfirmed
+ * spin-down is retried after SPINDOWN_BACKOFF, doubling with every failure.
+ */
+static void spindown_start(DISKSTATS *ds, bool joined)
+{
+    ds->probe.spindown = 1;
+    ds->probe.joined = joined;
+    probe_start(ds);
+}
+
+static void spindown_evaluate(DISKSTATS *ds)
+{
+    PROBE *p = &ds->probe;
+    time_t now = p->time;
+    bool confirmed = (p->ata == 0x00 || p->ata == 0x01);
+
+    p->spindown = 0;
+
+    if (!p->standby_ok || (p->ata >= 0 && !confirmed)) {
+        time_t backoff = SPINDOWN_BACKOFF;
+        for (unsigned int i = 0; i < ds->spindown_failures && backoff < SPINDOWN_BACKOFF_MAX; ++i) {
+            backoff *= 2;
+        }
+        if (backoff > SPINDOWN_BACKOFF_MAX) {
+            backoff = SPINDOWN_BACKOFF_MAX;
+        }
+        ds->spindown_failures++;
+        ds->spindown_retry = now + backoff;
+        if (!p->standby_ok) {
+            lprintf("%s: spin-down failed; error %lu, retrying in %lld s\n", ds->name, p->error, (long long)backoff);
+        } else {
+            lprintf("%s: spin-down not confirmed (power mode 0x%02x), retrying in %lld s\n", ds->name, p->ata, (long long)backoff);
+        }
+        return;
+    }
+
+    lprintf("%s: spun down after %llu s idle%s\n", ds->name, (unsigned long long)(now - ds->last_io),
+            p->joined ? " with its group" : "");
+    trace_event(ds, TRACE_SPINDOWN, p->time_ft, 0);
+    ds->spindowns++;
+    ds->last_running_secs = now - ds->spinup;
+    ds->running_secs += ds->last_running_secs;
+    ds->spindown = now;
+    ds->spun_down = 1;
+    ds->spindown_failures = 0;
+    ds->spindown_retry = 0;
+    /* scsi, or the check is not supported: confirm with the next probe */
+    ds->verify_spindown = !confirmed;
+    group_spun_down(ds);
+}
+
+
+/* Did the disk have any activity since its counters were taken? With -o or
+ * -k, i/o below both thresholds (per minute) does not count, unless requests
+ * are still queued or the disk was spun down (then it has spun up anyway).
+ * The deltas are wrap-safe: 32-bit for the counts, 64-bit for the bytes.
+ */
+static bool disk_active(DISKSTATS *ds, time_t now)
+{
+    PROBE *p = &ds->probe;
+    unsigned int ops = (p->perf.ReadCount - ds->reads) + (p->perf.WriteCount - ds->writes);
+    ULONGLONG bytes = (ULONGLONG)(p->perf.BytesRead.QuadPart + p->perf.BytesWritten.QuadPart) - ds->bytes;
+    time_t elapsed = (now > ds->sampled) ? now - ds->sampled : 1;
+
+    return policy_active(ds, ops, bytes, elapsed, p->perf.QueueDepth > 0);
+}
+
+/* take the counters of the latest probe as the reference for the next one */
+static void take_counters(DISKSTATS *ds, time_t now)
+{
+    PROBE *p = &ds->probe;
+
+    ds->reads = p->perf.ReadCount;
+    ds->writes = p->perf.WriteCount;
+    ds->bytes = (ULONGLONG)(p->perf.BytesRead.QuadPart + p->perf.BytesWritten.QuadPart);
+    ds->io_time = p->perf.ReadTime.QuadPart + p->perf.WriteTime.QuadPart;
+    ds->idle_ref = p->perf.IdleTime.QuadPart;
+    ds->query_ref = p->perf.QueryTime.QuadPart;
+    ds->sampled = now;
+    ds->sampled_ft = p->time_ft;
+}
+
+/* Time of the last i/o of a disk that had activity since its counters were
+ * taken (FILETIME), for the -R trace. With etw, it is known exactly. Otherwise
+ * the kernel's idle accounting is used: IdleTime grows with QueryTime while
+ * no request is queued, so the disk has been idle for at most the growth of
+ * IdleTime since the counters were taken. The latest i/o is estimated in the
+ * middle of that range; the error is at most half the idle time seen between
+ * the two probes, instead of the whole poll interval. The ratio of the two
+ * deltas is applied to the wall clock, so the unit of the counters does not
+ * matter. The i/o may as well have been right before the probe, so spin-down
+ * decisions use last_io_latest() instead.
+ */
+static LONGLONG last_io_estimate(DISKSTATS *ds)
+{
+    PROBE *p = &ds->probe;
+    LONGLONG dq, di, wall;
+
+    if (p->etw_last_io != 0) {
+        return p->etw_last_io;
+    }
+    dq = p->perf.QueryTime.QuadPart - ds->query_ref;
+    di = p->perf.IdleTime.QuadPart - ds->idle_ref;
+    wall = p->time_ft - ds->sampled_ft;
+    if (p->perf.QueueDepth > 0 || ds->query_ref == 0 || dq <= 0 || di <= 0 || wall <= 0) {
+        /* still busy, or no idle accounting */
+        return p->time_ft;
+    }
+    if (di > dq) {
+        di = dq;
+    }
+    return p->time_ft - (LONGLONG)((double)wall * di / dq / 2);
+}
+
+/* Latest time the last i/o of such a disk can have been (FILETIME): exact with
+ * etw, otherwise the time of the probe. The idle time counts from here, so a
+ * disk is never spun down before its idle time has passed. */
+static LONGLONG last_io_latest(DISKSTATS *ds)
+{
+    PROBE *p = &ds->probe;
+
+    return (p->etw_last_io != 0) ? p->etw_last_io : p->time_ft;
+}
+
+/* Spin-up latency of a disk that has just spun up, in ms, added to its
+ * histogram. With etw, it is the response time of the first i/o after the
+ * spin-down. Otherwise it is estimated as the average i/o time (ReadTime and
+ * WriteTime of the disk performance counters) since the previous probe: the
+ * i/os issued while the disk spins up all wait for it, which dominates the
+ * average as long as the poll interval is short. -1 if not known.
+ */
+static long spinup_latency(DISKSTATS *ds)
+{
+    PROBE *p = &ds->probe;
+    long ms = p->wake_ms;
+
+    if (ms < 0 && !etw_active) {
+        LONGLONG io_time = p->perf.ReadTime.QuadPart + p->perf.WriteTime.QuadPart;
+        unsigned int ios = (p->perf.ReadCount - ds->reads) + (p->perf.WriteCount - ds->writes);
+        if (ios > 0 && io_time > ds->io_time) {
+            ms = (long)((io_time - ds->io_time) / 10000 / ios);   /* 100ns units */
+        }
+    }
+    if (ms < 0) {
+        return -1;
+    }
+
+    int bucket = 0;
+    while (bucket < SPINUP_BUCKETS - 1 && ms > (125L << bucket)) {
+        ++bucket;
+    }
+    ds->spinup_hist[bucket]++;
+    ds->spinup_ms_total += ms;
+    ds->spinup_count++;
+    return ms;
+}
@@ -0,0 +1,182 @@
+/*
+ * profile.cpp - what hd-idle itself costs
+ *
+ * Copyright (c) 2022 RalfOGit
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * hd-idle is meant to save energy, so it should not keep the cpu out of its
+ * idle states itself. A few counters are therefore kept all the time (an
+ * interlocked increment each): the wakeups of the main loop by cause, the
+ * time of each phase of a pass (starting the probes, waiting for them,
+ * evaluating them, saving state), the ioctls issued (profile_ioctl() takes
+ * the place of DeviceIoControl()), the drive handles opened and the bytes
+ * written to the console and the logfile. The report adds the cpu time and
+ * handle count of the process (GetProcessTimes(), GetProcessHandleCount()).
+ * It is printed every -F minutes, on ctrl+break, and when the service gets
+ * the control code SERVICE_CONTROL_PROFILE ("sc control hd-idle 128"); the
+ * counters are also served with -m.
+ */
+
+#include "hd-idle.h"
+#include <string.h>
+
+PROFILE profile;
+
+static HANDLE       profile_event = NULL;   /* auto-reset; a report is requested */
+static ULONGLONG    profile_started;        /* GetTickCount64() */
+static ULONGLONG    profile_interval = 0;   /* ms between reports, 0 if only on request */
+static ULONGLONG    profile_due = 0;
+static LONGLONG     profile_freq;
+
+static const char  *profile_waits[] = { "timer", "stop", "devices", "metrics", "config", "agent", "control", "profile" };
+static const char  *profile_phases[] = { "dispatch", "wait", "evaluate", "persist" };
+
+const char *profile_wait_name(int what)
+{
+    return profile_waits[what];
+}
+
+/* start counting; reports every minutes (0: only on request) */
+int profile_init(int minutes)
+{
+    LARGE_INTEGER freq;
+
+    QueryPerformanceFrequency(&freq);
+    profile_freq = freq.QuadPart;
+    profile_started = GetTickCount64();
+    profile_interval = minutes * 60000ULL;
+    profile_due = (profile_interval != 0) ? profile_started + profile_interval : 0;
+    if ((profile_event = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+/* event that is signaled when a report is requested */
+HANDLE profile_handle(void)
+{
+    return profile_event;
+}
+
+/* ask the main loop for a report; any thread */
+void profile_request(void)
+{
+    if (profile_event != NULL) {
+        SetEvent(profile_event);
+    }
+}
+
+LONGLONG profile_clock(void)
+{
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+/* add the time since *start to a phase and start the next one */
+void profile_phase(int phase, LONGLONG *start)
+{
+    LONGLONG now = profile_clock();
+
+    profile.phase_ticks[phase] += now - *start;
+    *start = now;
+}
+
+/* DeviceIoControl(), counted */
+BOOL profile_ioctl(HANDLE h, DWORD code, LPVOID in, DWORD in_size, LPVOID out, DWORD out_size, LPDWORD returned, LPOVERLAPPED ov)
+{
+    InterlockedIncrement(&profile.ioctls);
+    return DeviceIoControl(h, code, in, in_size, out, out_size, returned, ov);
+}
+
+static double filetime_secs(const FILETIME *ft)
+{
+    return (((ULONGLONG)ft->dwHighDateTime << 32) | ft->dwLowDateTime) / 1e7;
+}
+
+/* cpu seconds of the process so far, -1 if unknown */
+double profile_cpu_secs(void)
+{
+    FILETIME created, exited, kernel, user;
+
+    if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) {
+        return -1;
+    }
+    return filetime_secs(&kernel) + filetime_secs(&user);
+}
+
+/* print the counters */
+void profile_report(void)
+{
+    ULONGLONG now = GetTickCount64();
+    double secs = (now - profile_started) / 1000.0;
+    double hours = secs / 3600.0;
+    double cpu = profile_cpu_secs();
+    unsigned long wakeups = 0;
+    ULONGLONG probes = 0, probe_us = 0;
+    DWORD handles = 0;
+    char line[256];
+    size_t len = 0;
+
+    if (secs <= 0) {
+        return;
+    }
+    for (int i = 0; i < PROFILE_WAITS; ++i) {
+        wakeups += profile.wakeups[i];
+    }
+    for (DISKSTATS *ds = first_diskstats(); ds != NULL; ds = next_diskstats(ds)) {
+        probes += ds->probes;
+        probe_us += ds->probe_us_total;
+    }
+    GetProcessHandleCount(GetCurrentProcess(), &handles);
+
+    lprintf("self-profile over %.0f s: cpu %.3f s (%.4f%% of a core), %lu wakeups (%.1f/h), %ld ioctls (%.1f/h)\n",
+            secs, cpu, (cpu >= 0) ? 100.0 * cpu / secs : 0.0, wakeups, wakeups / hours, profile.ioctls, profile.ioctls / hours);
+    for (int i = 0; i < PROFILE_WAITS; ++i) {
+        if (profile.wakeups[i] > 0 && len < sizeof(line)) {
+            len += snprintf(line + len, sizeof(line) - len, "%s %s %lu", (len == 0) ? "" : ",", profile_waits[i], profile.wakeups[i]);
+        }
+    }
+    lprintf("self-profile: wakeups by cause:%s\n", (len > 0) ? line : " none");
+    len = 0;
+    for (int i = 0; i < PROFILE_PHASES; ++i) {
+        if (len < sizeof(line)) {
+            len += snprintf(line + len, sizeof(line) - len, "%s %s %.1f us", (i == 0) ? "" : ",", profile_phases[i],
+                            (wakeups > 0) ? profile.phase_ticks[i] * 1e6 / profile_freq / wakeups : 0.0);
+        }
+    }
+    lprintf("self-profile: main loop per wakeup:%s; probes %llu, %.1f us each on the workers\n", line,
+            probes, (probes > 0) ? (double)probe_us / probes : 0.0);
+    lprintf("self-profile: %ld drive handles opened, %lu handles open, output %ld bytes to the console, %ld bytes to the logfile\n",
+            profile.opens, handles, profile.console_bytes, profile.log_bytes);
+}
+
+/* print the periodic report when it is due; returns the ms until the next
+ * one, INFINITE if there is none */
+DWORD profile_poll(ULONGLONG now)
+{
+    if (profile_due == 0) {
+        return INFINITE;
+    }
+    if (now >= profile_due) {
+        profile_report();
+        profile_due = now + profile_interval;
+    }
+    return (DWORD)(profile_due - now);
+}
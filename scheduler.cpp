@@ -0,0 +1,144 @@
+/*
+ * scheduler.cpp - per-disk poll scheduling for hd-idle
+ *
+ * Copyright (c) 2022 RalfOGit
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Every disk has its own next-due time. The disks are kept in a binary
+ * min-heap ordered by that time, so the main loop can sleep exactly until the
+ * next disk is due and only probes the disks that are due when it wakes up.
+ * A disk is taken out of the heap while it is being probed and put back with
+ * its new due time after the result has been evaluated.
+ */
+
+#include "hd-idle.h"
+#include <stdlib.h>
+
+static DISKSTATS **sched_heap = NULL;
+static int         sched_count = 0;
+static int         sched_size = 0;
+
+static void sched_set(int pos, DISKSTATS *ds)
+{
+    sched_heap[pos] = ds;
+    ds->sched_pos = pos;
+}
+
+static void sched_up(int pos)
+{
+    DISKSTATS *ds = sched_heap[pos];
+
+    while (pos > 0) {
+        int parent = (pos - 1) / 2;
+        if (sched_heap[parent]->next_due <= ds->next_due) {
+            break;
+        }
+        sched_set(pos, sched_heap[parent]);
+        pos = parent;
+    }
+    sched_set(pos, ds);
+}
+
+static void sched_down(int pos)
+{
+    DISKSTATS *ds = sched_heap[pos];
+
+    for (;;) {
+        int child = 2 * pos + 1;
+        if (child >= sched_count) {
+            break;
+        }
+        if (child + 1 < sched_count && sched_heap[child + 1]->next_due < sched_heap[child]->next_due) {
+            ++child;
+        }
+        if (ds->next_due <= sched_heap[child]->next_due) {
+            break;
+        }
+        sched_set(pos, sched_heap[child]);
+        pos = child;
+    }
+    sched_set(pos, ds);
+}
+
+/* queue a disk to be probed at the given time (device_ops->ticks() ms) */
+bool sched_insert(DISKSTATS *ds, ULONGLONG due)
+{
+    if (ds->sched_pos >= 0) {
+        sched_remove(ds);
+    }
+    if (sched_count == sched_size) {
+        int size = (sched_size == 0) ? 16 : 2 * sched_size;
+        DISKSTATS **heap = (DISKSTATS**)realloc(sched_heap, size * sizeof(*heap));
+        if (heap == NULL) {
+            return false;
+        }
+        sched_heap = heap;
+        sched_size = size;
+    }
+    ds->next_due = due;
+    sched_set(sched_count++, ds);
+    sched_up(ds->sched_pos);
+    return true;
+}
+
+/* take a disk out of the schedule */
+void sched_remove(DISKSTATS *ds)
+{
+    int pos = ds->sched_pos;
+
+    if (pos < 0) {
+        return;
+    }
+    ds->sched_pos = -1;
+    if (pos != --sched_count) {
+        /* move the last entry into the gap and restore the heap order */
+        DISKSTATS *last = sched_heap[sched_count];
+        sched_set(pos, last);
+        sched_up(pos);
+        sched_down(last->sched_pos);
+    }
+}
+
+/* disk that is due next, or NULL if none is queued */
+DISKSTATS *sched_next(void)
+{
+    return (sched_count > 0) ? sched_heap[0] : NULL;
+}
+
+/* take the next disk out of the schedule if it is due at the given time */
+DISKSTATS *sched_pop_due(ULONGLONG now)
+{
+    DISKSTATS *ds = sched_next();
+
+    if (ds == NULL || ds->next_due > now) {
+        return NULL;
+    }
+    sched_remove(ds);
+    return ds;
+}
+
+/* milliseconds until the next disk is due, INFINITE if none is queued */
+DWORD sched_timeout(ULONGLONG now)
+{
+    DISKSTATS *ds = sched_next();
+
+    if (ds == NULL) {
+        return INFINITE;
+    }
+    return (ds->next_due > now) ? (DWORD)(ds->next_due - now) : 0;
+}
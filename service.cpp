@@ -0,0 +1,245 @@
+/*
+ * service.cpp - windows service support for hd-idle
+ *
+ * Copyright (c) 2022 RalfOGit
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * hd-idle -I <options> installs hd-idle as an auto-start service that is run
+ * with "-s <options>"; hd-idle -U removes it again. Running as a service, there
+ * is no console: only errors are printed unless -v or -d is given and state transitions
+ * (spin-down, spin-up, disk arrival and removal) are reported to the
+ * application event log. The event source is registered at install time with
+ * hd-idle.exe itself as its message file (messages.mc, one "%1" message), so
+ * Event Viewer shows the text as is. The service is stopped through stop_event,
+ * which the main loop waits on together with its timer.
+ */
+
+#include "hd-idle.h"
+#include "messages.h"
+#include <stdarg.h>
+#include <string.h>
+
+#pragma comment(lib, "advapi32.lib")
+
+#define SERVICE_NAME        "hd-idle"
+#define SERVICE_DISPLAY     "hd-idle disk spin-down"
+#define SERVICE_DESCRIPTION "Spins down idle hard disks."
+#define SERVICE_EVENTLOG_KEY "SYSTEM\\CurrentControlSet\\Services\\EventLog\\Application\\" SERVICE_NAME
+#define SERVICE_CONTROL_PROFILE 128     /* user-defined control code: print the self-profile (profile.cpp) */
+
+HANDLE stop_event = NULL;               /* manual-reset; set to stop the main loop */
+int service_mode = 0;
+
+static SERVICE_STATUS_HANDLE service_handle = NULL;
+static SERVICE_STATUS        service_status;
+static HANDLE                event_source = NULL;
+
+static void service_report(DWORD state, DWORD exit_code, DWORD wait_hint)
+{
+    service_status.dwServiceType = SERVICE_WIN32_OWN_PROCESS;
+    service_status.dwCurrentState = state;
+    service_status.dwControlsAccepted = (state == SERVICE_RUNNING) ? SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_SHUTDOWN : 0;
+    service_status.dwWin32ExitCode = (exit_code == 0) ? NO_ERROR : ERROR_SERVICE_SPECIFIC_ERROR;
+    service_status.dwServiceSpecificExitCode = exit_code;
+    service_status.dwCheckPoint = (state == SERVICE_START_PENDING || state == SERVICE_STOP_PENDING) ? service_status.dwCheckPoint + 1 : 0;
+    service_status.dwWaitHint = wait_hint;
+    SetServiceStatus(service_handle, &service_status);
+}
+
+static DWORD WINAPI service_control(DWORD control, DWORD event_type, LPVOID event_data, LPVOID context)
+{
+    switch (control) {
+    case SERVICE_CONTROL_STOP:
+    case SERVICE_CONTROL_SHUTDOWN:
+        /* outstanding probes are given PROBE_DEADLINE to complete */
+        service_report(SERVICE_STOP_PENDING, 0, PROBE_DEADLINE + 1000);
+        SetEvent(stop_event);
+        return NO_ERROR;
+    case SERVICE_CONTROL_INTERROGATE:
+        return NO_ERROR;
+    case SERVICE_CONTROL_PROFILE:
+        profile_request();
+        return NO_ERROR;
+    default:
+        return ERROR_CALL_NOT_IMPLEMENTED;
+    }
+}
+
+static void WINAPI service_main(DWORD argc, LPSTR *argv)
+{
+    int exit_code;
+
+    if ((service_handle = RegisterServiceCtrlHandlerExA(SERVICE_NAME, service_control, NULL)) == NULL) {
+        return;
+    }
+    service_report(SERVICE_START_PENDING, 0, 3000);
+    event_source = RegisterEventSourceA(NULL, SERVICE_NAME);
+
+    service_report(SERVICE_RUNNING, 0, 0);
+    lprintf("service started\n");
+    exit_code = hd_idle_run();
+    lprintf("service stopped\n");
+
+    if (event_source != NULL) {
+        DeregisterEventSource(event_source);
+        event_source = NULL;
+    }
+    service_report(SERVICE_STOPPED, exit_code, 0);
+}
+
+/* hand the process over to the service control manager; returns when the
+ * service has stopped */
+int service_run(void)
+{
+    static SERVICE_TABLE_ENTRYA table[] = {
+        { (LPSTR)SERVICE_NAME, service_main },
+        { NULL, NULL }
+    };
+
+    service_mode = 1;
+    if (!StartServiceCtrlDispatcherA(table)) {
+        if (GetLastError() == ERROR_FAILED_SERVICE_CONTROLLER_CONNECT) {
+            fprintf(stderr, "error: -s is only used by the service control manager; install the service with -I\n");
+        } else {
+            fprintf(stderr, "error: cannot start service dispatcher; error %lu\n", GetLastError());
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/* register hd-idle.exe as the message file of the event source */
+static void eventlog_register(const char *exe)
+{
+    HKEY key;
+    DWORD types = EVENTLOG_ERROR_TYPE | EVENTLOG_WARNING_TYPE | EVENTLOG_INFORMATION_TYPE;
+    LONG rc;
+
+    rc = RegCreateKeyExA(HKEY_LOCAL_MACHINE, SERVICE_EVENTLOG_KEY, 0, NULL, REG_OPTION_NON_VOLATILE,
+                         KEY_SET_VALUE, NULL, &key, NULL);
+    if (rc != ERROR_SUCCESS) {
+        fprintf(stderr, "error: cannot create event log source; error %ld\n", rc);
+        return;
+    }
+    rc = RegSetValueExA(key, "EventMessageFile", 0, REG_EXPAND_SZ, (const BYTE *)exe, (DWORD)strlen(exe) + 1);
+    if (rc == ERROR_SUCCESS) {
+        rc = RegSetValueExA(key, "TypesSupported", 0, REG_DWORD, (const BYTE *)&types, sizeof(types));
+    }
+    RegCloseKey(key);
+    if (rc != ERROR_SUCCESS) {
+        fprintf(stderr, "error: cannot register event message file; error %ld\n", rc);
+    }
+}
+
+/* install the service; it is started with -s and the given options */
+int service_install(int argc, char *argv[])
+{
+    char cmdline[4096];
+    char exe[MAX_PATH];
+    size_t len;
+    SC_HANDLE scm, svc;
+    SERVICE_DESCRIPTIONA desc;
+
+    if (GetModuleFileNameA(NULL, exe, sizeof(exe)) == 0) {
+        fprintf(stderr, "error: cannot determine executable path; error %lu\n", GetLastError());
+        return 2;
+    }
+    sprintf(cmdline, "\"%s\" -s", exe);
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-I") == 0) {
+            continue;
+        }
+        len = strlen(cmdline);
+        if (len + strlen(argv[i]) + 4 > sizeof(cmdline)) {
+            fprintf(stderr, "error: command line too long\n");
+            return 1;
+        }
+        sprintf(cmdline + len, (strchr(argv[i], ' ') != NULL) ? " \"%s\"" : " %s", argv[i]);
+    }
+
+    if ((scm = OpenSCManagerA(NULL, NULL, SC_MANAGER_CREATE_SERVICE)) == NULL) {
+        fprintf(stderr, "error: cannot open service control manager; error %lu\n", GetLastError());
+        return 2;
+    }
+    svc = CreateServiceA(scm, SERVICE_NAME, SERVICE_DISPLAY, SERVICE_ALL_ACCESS, SERVICE_WIN32_OWN_PROCESS,
+                         SERVICE_AUTO_START, SERVICE_ERROR_NORMAL, cmdline, NULL, NULL, NULL, NULL, NULL);
+    if (svc == NULL) {
+        fprintf(stderr, "error: cannot create service; error %lu\n", GetLastError());
+        CloseServiceHandle(scm);
+        return 2;
+    }
+    desc.lpDescription = (LPSTR)SERVICE_DESCRIPTION;
+    ChangeServiceConfig2A(svc, SERVICE_CONFIG_DESCRIPTION, &desc);
+    eventlog_register(exe);
+    printf("installed service %s: %s\n", SERVICE_NAME, cmdline);
+
+    CloseServiceHandle(svc);
+    CloseServiceHandle(scm);
+    return 0;
+}
+
+/* stop and remove the service */
+int service_uninstall(void)
+{
+    SC_HANDLE scm, svc;
+    SERVICE_STATUS status;
+
+    if ((scm = OpenSCManagerA(NULL, NULL, SC_MANAGER_CONNECT)) == NULL) {
+        fprintf(stderr, "error: cannot open service control manager; error %lu\n", GetLastError());
+        return 2;
+    }
+    if ((svc = OpenServiceA(scm, SERVICE_NAME, SERVICE_STOP | DELETE)) == NULL) {
+        fprintf(stderr, "error: cannot open service; error %lu\n", GetLastError());
+        CloseServiceHandle(scm);
+        return 2;
+    }
+    ControlService(svc, SERVICE_CONTROL_STOP, &status);
+    if (!DeleteService(svc)) {
+        fprintf(stderr, "error: cannot delete service; error %lu\n", GetLastError());
+    } else {
+        printf("removed service %s\n", SERVICE_NAME);
+    }
+    RegDeleteKeyA(HKEY_LOCAL_MACHINE, SERVICE_EVENTLOG_KEY);
+    CloseServiceHandle(svc);
+    CloseServiceHandle(scm);
+    return 0;
+}
+
+/* report a state transition: to the event log when running as a service,
+ * to stdout otherwise, and to the logfile if one is given */
+void lprintf(const char *fmt, ...)
+{
+    char buf[512];
+    const char *strings[1] = { buf };
+    va_list va;
+
+    va_start(va, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, va);
+    va_end(va);
+    log_line(buf);
+
+    if (!service_mode) {
+        console_printf(V_STATE, "%s", buf);
+    } else if (event_source != NULL) {
+        size_t len = strlen(buf);
+        if (len > 0 && buf[len - 1] == '\n') {
+            buf[len - 1] = '\0';
+        }
+        ReportEventA(event_source, EVENTLOG_INFORMATION_TYPE, 0, MSG_HD_IDLE_TEXT, NULL, 1, 0, strings, NULL);
+    }
+}
@@ -0,0 +1,403 @@
+/*
+ * snapshot.cpp - disk state that survives restarts of hd-idle
+ *
+ * Copyright (c) 2022 RalfOGit
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * With -S <file>, the state of every disk (time of the last i/o, spun-down
+ * state, counters, histograms) is saved every SNAPSHOT_INTERVAL seconds and
+ * when hd-idle stops, to a binary file: a header and one record per disk
+ * that has been seen, about 1 KB each. Only the records that have changed
+ * since the previous save are written, and nothing if none has. Each record
+ * holds the drive number and the identity of its disk (serial number, wwn,
+ * guid); drive numbers
+ * change when disks are added or removed, so a disk takes over the record
+ * with its identity, wherever it is. When its first probe has identified it,
+ * a disk with a saved record continues where it left off, instead of
+ * starting over as a new disk:
+ *
+ * - no i/o since the snapshot (same counters, no reboot): last_io and the
+ *   spun-down state are kept;
+ * - after a reboot: last_io is the boot time, unless the saved one is later;
+ * - otherwise there was i/o while hd-idle was not running: last_io is now.
+ *
+ * Counters and histograms are kept in any case. The file must be on a
+ * volume that is not spun down: every save is i/o on the disks holding it,
+ * so such a disk would never become idle for longer than SNAPSHOT_INTERVAL.
+ * If hd-idle spins down one of those disks, the snapshot is therefore only
+ * saved when hd-idle stops, and a warning is printed.
+ */
+
+#include "hd-idle.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SNAPSHOT_MAGIC      "hd-idle"
+#define SNAPSHOT_VERSION    3
+#define SNAPSHOT_INTERVAL   60      /* s between saves */
+#define SNAPSHOT_MAX_DISKS  8
+
+typedef struct SNAPSHOT_HEADER {
+    char               magic[8];
+    unsigned int       version;
+    unsigned int       record_size;
+    unsigned int       records;     /* in the file, in the order of their drive numbers */
+    unsigned int       etw;         /* counters are etw counts since the session started */
+    long long          saved;       /* time_t of the latest save */
+    long long          boot;        /* time_t of the boot before the latest save */
+} SNAPSHOT_HEADER;
+
+/* 64-bit fields first, so the layout does not depend on packing */
+typedef struct SNAPSHOT_RECORD {
+    long long          last_io;
+    long long          spindown;
+    long long          spinup;
+    unsigned long long spun_down_secs;
+    unsigned long long running_secs;
+    unsigned long long last_running_secs;
+    unsigned long long probe_us_total;
+    unsigned long long spinup_ms_total;
+    unsigned int       in_use;
+    unsigned int       drive;
+    unsigned int       spun_down;
+    unsigned int       reads;
+    unsigned int       writes;
+    unsigned int       spindowns;
+    unsigned int       spinups;
+    unsigned int       probes;
+    unsigned int       probe_us_max;
+    unsigned int       failed_ioctls;
+    unsigned int       spinup_count;
+    unsigned int       spinup_hist[SPINUP_BUCKETS];
+    unsigned short     gap_hist[24][GAP_BUCKETS];
+    char               serial[64];  /* identity of the disk, see config_identify() */
+    char               wwn[40];
+    char               guid[40];
+} SNAPSHOT_RECORD;
+
+/* in memory, the records are indexed by drive number */
+typedef struct SNAPSHOT {
+    SNAPSHOT_HEADER    header;
+    SNAPSHOT_RECORD    records[MAX_DISKS];
+} SNAPSHOT;
+
+static SNAPSHOT        *snapshot = NULL;
+static HANDLE           snapshot_file = INVALID_HANDLE_VALUE;
+static unsigned char    snapshot_order[MAX_DISKS];  /* drive numbers of the records in the file */
+static unsigned int     snapshot_count = 0;
+static unsigned long long snapshot_hash[MAX_DISKS]; /* of the records as last written */
+static int              snapshot_warned = 0;
+static int              snapshot_rebooted = 0;
+static time_t           snapshot_next = 0;
+static int              snapshot_disks[SNAPSHOT_MAX_DISKS];
+static int              snapshot_ndisks = 0;
+
+static time_t boot_time(void)
+{
+    return time(NULL) - (time_t)(GetTickCount64() / 1000);
+}
+
+/* FNV-1a hash of a record, to tell whether it has changed since it was written */
+static unsigned long long snapshot_record_hash(const SNAPSHOT_RECORD *r)
+{
+    const unsigned char *p = (const unsigned char*)r;
+    unsigned long long h = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < sizeof(*r); ++i) {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/* open or create the snapshot file and load the saved records; returns 0 on success */
+int snapshot_open(const char *path)
+{
+    SNAPSHOT_RECORD r;
+    LARGE_INTEGER size;
+    DWORD cb;
+    int valid;
+
+    snapshot_file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (snapshot_file == INVALID_HANDLE_VALUE) {
+        return -1;
+    }
+    if ((snapshot = (SNAPSHOT*)calloc(1, sizeof(SNAPSHOT))) == NULL) {
+        return -1;
+    }
+    valid = GetFileSizeEx(snapshot_file, &size) &&
+            ReadFile(snapshot_file, &snapshot->header, sizeof(snapshot->header), &cb, NULL) && cb == sizeof(snapshot->header) &&
+            memcmp(snapshot->header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0 &&
+            snapshot->header.version == SNAPSHOT_VERSION &&
+            snapshot->header.record_size == sizeof(SNAPSHOT_RECORD) &&
+            snapshot->header.records <= MAX_DISKS &&
+            size.QuadPart == (LONGLONG)(sizeof(SNAPSHOT_HEADER) + snapshot->header.records * sizeof(SNAPSHOT_RECORD)) &&
+            snapshot->header.etw == (unsigned int)etw_active;
+    for (unsigned int i = 0; valid && i < snapshot->header.records; ++i) {
+        if (!ReadFile(snapshot_file, &r, sizeof(r), &cb, NULL) || cb != sizeof(r) || r.drive >= MAX_DISKS ||
+            (snapshot_count > 0 && r.drive <= snapshot_order[snapshot_count - 1])) {
+            valid = 0;
+            break;
+        }
+        snapshot->records[r.drive] = r;
+        snapshot_hash[r.drive] = snapshot_record_hash(&r);
+        snapshot_order[snapshot_count++] = (unsigned char)r.drive;
+    }
+    if (!valid) {
+        dprintf("snapshot: starting over with %s\n", path);
+        memset(snapshot, 0x00, sizeof(SNAPSHOT));
+        snapshot_count = 0;
+    } else {
+        /* boot times computed at different moments differ by a few seconds */
+        long long boot = boot_time();
+        snapshot_rebooted = (boot - snapshot->header.boot > 60 || snapshot->header.boot - boot > 60);
+        dprintf("snapshot: loaded %s, saved %lld s ago%s\n", path, (long long)time(NULL) - snapshot->header.saved,
+                snapshot_rebooted ? ", rebooted since" : "");
+    }
+
+    snapshot_ndisks = volume_disks(path, snapshot_disks, SNAPSHOT_MAX_DISKS);
+    snapshot_next = time(NULL) + SNAPSHOT_INTERVAL;
+    return 0;
+}
+
+/* 1 if the record was saved for this disk: any identity known on both sides matches and none differs */
+static int snapshot_match(const SNAPSHOT_RECORD *r, const DISKSTATS *ds)
+{
+    const char *saved[] = { r->serial, r->wwn, r->guid };
+    const char *disk[] = { ds->caps.serial, ds->caps.wwn, ds->caps.guid };
+    int matched = 0;
+    int known = 0;
+
+    for (int i = 0; i < 3; ++i) {
+        if (saved[i][0] != '\0' || disk[i][0] != '\0') {
+            known = 1;
+        }
+        if (saved[i][0] != '\0' && disk[i][0] != '\0') {
+            if (strcmp(saved[i], disk[i]) != 0) {
+                return 0;
+            }
+            matched = 1;
+        }
+    }
+    /* without any identity on either side, the drive number is all there is */
+    return matched || !known;
+}
+
+static void snapshot_identify(SNAPSHOT_RECORD *r, const DISKSTATS *ds)
+{
+    strncpy(r->serial, ds->caps.serial, sizeof(r->serial) - 1);
+    r->serial[sizeof(r->serial) - 1] = '\0';
+    strncpy(r->wwn, ds->caps.wwn, sizeof(r->wwn) - 1);
+    r->wwn[sizeof(r->wwn) - 1] = '\0';
+    strncpy(r->guid, ds->caps.guid, sizeof(r->guid) - 1);
+    r->guid[sizeof(r->guid) - 1] = '\0';
+}
+
+/* take over the saved state of a new disk, once its first probe has identified it */
+void snapshot_restore(DISKSTATS *ds)
+{
+    SNAPSHOT_RECORD *r = NULL;
+
+    if (snapshot == NULL || ds->drive < 0 || ds->drive >= MAX_DISKS) {
+        return;
+    }
+    if (snapshot->records[ds->drive].in_use && snapshot_match(&snapshot->records[ds->drive], ds)) {
+        r = &snapshot->records[ds->drive];
+    } else {
+        /* renumbered since the snapshot; only a record with an identity can be found elsewhere */
+        for (int drive = 0; drive < MAX_DISKS && r == NULL; ++drive) {
+            SNAPSHOT_RECORD *other = &snapshot->records[drive];
+            if (drive != ds->drive && other->in_use && (other->serial[0] || other->wwn[0] || other->guid[0]) &&
+                snapshot_match(other, ds)) {
+                r = other;
+            }
+        }
+    }
+    if (r == NULL) {
+        if (snapshot->records[ds->drive].in_use) {
+            dprintf("snapshot %s: the saved record is for another disk; starting over\n", ds->name);
+        }
+        return;
+    }
+    if (r != &snapshot->records[ds->drive]) {
+        dprintf("snapshot %s: taking over the record of drive %d\n", ds->name, (int)(r - snapshot->records));
+    }
+    ds->last_io = (time_t)r->last_io;
+    ds->spindown = (time_t)r->spindown;
+    ds->spinup = (time_t)r->spinup;
+    ds->spun_down = r->spun_down;
+    ds->reads = r->reads;
+    ds->writes = r->writes;
+    ds->spindowns = r->spindowns;
+    ds->spinups = r->spinups;
+    ds->spun_down_secs = r->spun_down_secs;
+    ds->running_secs = r->running_secs;
+    ds->last_running_secs = r->last_running_secs;
+    ds->probes = r->probes;
+    ds->probe_us_total = r->probe_us_total;
+    ds->probe_us_max = r->probe_us_max;
+    ds->failed_ioctls = r->failed_ioctls;
+    memcpy(ds->spinup_hist, r->spinup_hist, sizeof(ds->spinup_hist));
+    ds->spinup_ms_total = r->spinup_ms_total;
+    ds->spinup_count = r->spinup_count;
+    memcpy(ds->gap_hist, r->gap_hist, sizeof(ds->gap_hist));
+    ds->restored = 1;
+}
+
+/* first counters of a restored disk: decide how much of the saved state holds */
+void snapshot_resume(DISKSTATS *ds, unsigned int reads, unsigned int writes, time_t now)
+{
+    int unchanged = etw_active ? (reads == 0 && writes == 0) : (reads == ds->reads && writes == ds->writes);
+
+    ds->restored = 0;
+    if (unchanged && !snapshot_rebooted) {
+        dprintf("snapshot %s: no i/o since the snapshot; idle for %lld s\n", ds->name, (long long)(now - ds->last_io));
+        return;
+    }
+    if (snapshot_rebooted) {
+        time_t boot = boot_time();
+        if (ds->last_io < boot) {
+            ds->last_io = boot;
+        }
+    } else {
+        ds->last_io = now;
+    }
+    ds->spinup = ds->last_io;
+    ds->spun_down = 0;
+}
+
+/* write at the given offset of the file; false on failure */
+static bool snapshot_write(LONG offset, const void *data, DWORD len)
+{
+    DWORD cb;
+
+    return SetFilePointer(snapshot_file, offset, NULL, FILE_BEGIN) != INVALID_SET_FILE_POINTER &&
+           WriteFile(snapshot_file, data, len, &cb, NULL) && cb == len;
+}
+
+/* save the state of all disks, at most every SNAPSHOT_INTERVAL unless forced */
+void snapshot_save(int force)
+{
+    time_t now = time(NULL);
+    unsigned char order[MAX_DISKS];
+    unsigned int count = 0;
+    long long boot;
+    bool rewrite, changed = false;
+
+    if (snapshot == NULL || (!force && now < snapshot_next)) {
+        return;
+    }
+    snapshot_next = now + SNAPSHOT_INTERVAL;
+
+    /* the saves would keep a disk holding the file from ever becoming idle */
+    for (int i = 0; i < snapshot_ndisks && !force; ++i) {
+        DISKSTATS *ds = get_diskstats(snapshot_disks[i]);
+        if (ds != NULL && !ds->ignored && ds->idle_time != 0) {
+            if (!snapshot_warned) {
+                console_printf(V_ERROR, "snapshot: the file is on %s, which is spun down; saving it only when hd-idle stops\n", ds->name);
+                snapshot_warned = 1;
+            }
+            return;
+        }
+    }
+
+    for (int drive = 0; drive < MAX_DISKS; ++drive) {
+        SNAPSHOT_RECORD *r = &snapshot->records[drive];
+        DISKSTATS *ds = get_diskstats(drive);
+
+        if (ds == NULL || ds->new_disk) {
+            /* keep the records of disks that are not present (or not probed yet) */
+            continue;
+        }
+        r->in_use = 1;
+        r->drive = drive;
+        snapshot_identify(r, ds);
+        if (r->serial[0] || r->wwn[0] || r->guid[0]) {
+            /* a disk renumbered since: its record under the old number is stale now */
+            for (int other = 0; other < MAX_DISKS; ++other) {
+                SNAPSHOT_RECORD *o = &snapshot->records[other];
+                if (other != drive && o->in_use && get_diskstats(other) == NULL && snapshot_match(o, ds)) {
+                    o->in_use = 0;
+                }
+            }
+        }
+        r->last_io = ds->last_io;
+        r->spindown = ds->spindown;
+        r->spinup = ds->spinup;
+        r->spun_down = ds->spun_down;
+        r->reads = ds->reads;
+        r->writes = ds->writes;
+        r->spindowns = ds->spindowns;
+        r->spinups = ds->spinups;
+        r->spun_down_secs = ds->spun_down_secs;
+        r->running_secs = ds->running_secs;
+        r->last_running_secs = ds->last_running_secs;
+        r->probes = ds->probes;
+        r->probe_us_total = ds->probe_us_total;
+        r->probe_us_max = ds->probe_us_max;
+        r->failed_ioctls = ds->failed_ioctls;
+        memcpy(r->spinup_hist, ds->spinup_hist, sizeof(r->spinup_hist));
+        r->spinup_ms_total = ds->spinup_ms_total;
+        r->spinup_count = ds->spinup_count;
+        memcpy(r->gap_hist, ds->gap_hist, sizeof(r->gap_hist));
+    }
+
+    /* the records in the file; if the same ones as before, only the changed ones are written */
+    for (int drive = 0; drive < MAX_DISKS; ++drive) {
+        if (snapshot->records[drive].in_use) {
+            order[count++] = (unsigned char)drive;
+        }
+    }
+    rewrite = count != snapshot_count || memcmp(order, snapshot_order, count) != 0;
+    boot = boot_time();
+    if (!rewrite) {
+        for (unsigned int i = 0; i < count; ++i) {
+            SNAPSHOT_RECORD *r = &snapshot->records[order[i]];
+            unsigned long long hash = snapshot_record_hash(r);
+            if (hash != snapshot_hash[order[i]]) {
+                if (!snapshot_write((LONG)(sizeof(SNAPSHOT_HEADER) + i * sizeof(*r)), r, sizeof(*r))) {
+                    rewrite = true;
+                    break;
+                }
+                snapshot_hash[order[i]] = hash;
+                changed = true;
+            }
+        }
+    }
+    if (!rewrite && !changed && (boot - snapshot->header.boot <= 60 && snapshot->header.boot - boot <= 60)) {
+        return;
+    }
+
+    memcpy(snapshot->header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    snapshot->header.version = SNAPSHOT_VERSION;
+    snapshot->header.record_size = sizeof(SNAPSHOT_RECORD);
+    snapshot->header.records = count;
+    snapshot->header.etw = etw_active;
+    snapshot->header.saved = now;
+    snapshot->header.boot = boot;
+    snapshot_write(0, &snapshot->header, sizeof(snapshot->header));
+    if (rewrite) {
+        for (unsigned int i = 0; i < count; ++i) {
+            SNAPSHOT_RECORD *r = &snapshot->records[order[i]];
+            snapshot_write((LONG)(sizeof(SNAPSHOT_HEADER) + i * sizeof(*r)), r, sizeof(*r));
+            snapshot_hash[order[i]] = snapshot_record_hash(r);
+        }
+        SetEndOfFile(snapshot_file);
+        memcpy(snapshot_order, order, count);
+        snapshot_count = count;
+    }
+}
@@ -0,0 +1,415 @@
+/*
+ * trace.cpp - recording and simulated replay of disk i/o traces
+ *
+ * Copyright (c) 2022 RalfOGit
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * With -R <file>, every probe that sees the counters of a disk change
+ * appends a 16 byte record to a trace: the (estimated) time of the latest
+ * i/o and the read, write and kbyte deltas. Arrivals, removals, spin-downs
+ * and spin-ups (with their latency) are recorded as well. The records are
+ * buffered and written every TRACE_INTERVAL seconds, and not while a disk
+ * holding the file is spun down; recording a disk does not keep it awake.
+ *
+ * hd-idle -x <file> replays such a trace instead of running the main loop.
+ * For every disk, it probes the disk on the schedule of the main loop and
+ * takes the same decisions (policy.cpp) for its configured settings (-i,
+ * -o, -k, -P) and a range of fixed and predictive idle times. It reports
+ * spin-ups per day, the time spun down, the energy saved against a disk
+ * that never spins down, and the i/o delay added by waiting for spin-ups,
+ * based on SIM_* figures of a typical 3.5" disk and the spin-up latency
+ * measured in the trace. Periods in which hd-idle did not run (from a
+ * removal or stop to the next arrival) are left out.
+ */
+
+#include "hd-idle.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_MAGIC         "hdtrace"
+#define TRACE_VERSION       1
+#define TRACE_BUFFER        4096    /* records buffered between writes */
+#define TRACE_INTERVAL      600     /* s between writes */
+#define TRACE_MAX_DISKS     8
+
+#define SIM_IDLE_WATTS      5.0     /* spinning, idle */
+#define SIM_STANDBY_WATTS   0.8
+#define SIM_SPINUP_JOULES   150.0   /* spin-up, beyond what idling would have used */
+#define SIM_SPINUP_MS       8000    /* unless the trace has measured spin-ups */
+
+typedef struct TRACE_HEADER {
+    char               magic[8];
+    unsigned int       version;
+    unsigned int       record_size;
+} TRACE_HEADER;
+
+typedef struct TRACE_RECORD {
+    long long          time;        /* FILETIME */
+    unsigned char      drive;
+    unsigned char      event;       /* TRACE_START, ... */
+    unsigned short     reads;       /* TRACE_IO: deltas since the previous record, saturated */
+    unsigned short     writes;
+    unsigned short     value;       /* TRACE_IO: kbytes, saturated; TRACE_SPINUP: latency in ms */
+} TRACE_RECORD;
+
+typedef struct SIM_RESULT {
+    double             secs;        /* time covered by the trace */
+    double             spun_down_secs;
+    double             delay_ms;    /* added to i/os by waiting for spin-ups */
+    unsigned int       spindowns;
+    unsigned int       spinups;
+} SIM_RESULT;
+
+static const char      *trace_path = NULL;
+static TRACE_RECORD     trace_buf[TRACE_BUFFER];
+static int              trace_count = 0;
+static unsigned int     trace_dropped = 0;
+static time_t           trace_next = 0;
+static int              trace_disks[TRACE_MAX_DISKS];
+static int              trace_ndisks = 0;
+
+static unsigned short saturate(ULONGLONG value)
+{
+    return (value > 0xffff) ? 0xffff : (unsigned short)value;
+}
+
+/* start recording to the given file, appending to a trace recorded before;
+ * returns 0 on success */
+int trace_open(const char *path)
+{
+    TRACE_HEADER header;
+    FILE *fp;
+    long size;
+
+    if ((fp = fopen(path, "ab+")) == NULL) {
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    if ((size = ftell(fp)) == 0) {
+        memset(&header, 0x00, sizeof(header));
+        memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+        header.version = TRACE_VERSION;
+        header.record_size = sizeof(TRACE_RECORD);
+        fwrite(&header, sizeof(header), 1, fp);
+    } else {
+        fseek(fp, 0, SEEK_SET);
+        if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+            header.version != TRACE_VERSION || header.record_size != sizeof(TRACE_RECORD)) {
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+
+    trace_path = path;
+    trace_ndisks = volume_disks(path, trace_disks, TRACE_MAX_DISKS);
+    trace_next = time(NULL) + TRACE_INTERVAL;
+    return 0;
+}
+
+static void trace_add(DISKSTATS *ds, int event, LONGLONG time_ft, ULONGLONG reads, ULONGLONG writes, ULONGLONG value)
+{
+    TRACE_RECORD *r;
+
+    if (trace_path == NULL || ds->drive < 0 || ds->drive > 0xff) {
+        return;
+    }
+    if (trace_count == TRACE_BUFFER) {
+        trace_dropped++;
+        return;
+    }
+    r = &trace_buf[trace_count++];
+    r->time = time_ft;
+    r->drive = (unsigned char)ds->drive;
+    r->event = (unsigned char)event;
+    r->reads = saturate(reads);
+    r->writes = saturate(writes);
+    r->value = saturate(value);
+}
+
+/* record an arrival, removal, spin-down or spin-up (value: latency in ms) */
+void trace_event(DISKSTATS *ds, int event, LONGLONG time_ft, unsigned int value)
+{
+    trace_add(ds, event, time_ft, 0, 0, value);
+}
+
+/* record the i/o a probe has seen since the counters were last taken */
+void trace_io(DISKSTATS *ds, LONGLONG time_ft, unsigned int reads, unsigned int writes, ULONGLONG bytes)
+{
+    trace_add(ds, TRACE_IO, time_ft, reads, writes, (bytes + 1023) / 1024);
+}
+
+/* write the buffered records, at most every TRACE_INTERVAL unless forced or
+ * the buffer fills up */
+void trace_save(int force)
+{
+    time_t now = time(NULL);
+    FILE *fp;
+
+    if (trace_path == NULL || trace_count == 0 || (!force && now < trace_next && trace_count < TRACE_BUFFER * 3 / 4)) {
+        return;
+    }
+
+    /* hold the records back while the disk holding the file is spun down */
+    for (int i = 0; i < trace_ndisks && !force; ++i) {
+        DISKSTATS *ds = get_diskstats(trace_disks[i]);
+        if (ds != NULL && ds->spun_down) {
+            return;
+        }
+    }
+    trace_next = now + TRACE_INTERVAL;
+
+    if ((fp = fopen(trace_path, "ab")) == NULL) {
+        dprintf("trace: cannot open %s\n", trace_path);
+        return;
+    }
+    fwrite(trace_buf, sizeof(TRACE_RECORD), trace_count, fp);
+    fclose(fp);
+    if (trace_dropped > 0) {
+        dprintf("trace: %u records dropped\n", trace_dropped);
+        trace_dropped = 0;
+    }
+    trace_count = 0;
+}
+
+/* end the trace of the present disks and write what is left */
+void trace_close(void)
+{
+    LONGLONG now = filetime_now();
+
+    if (trace_path == NULL) {
+        return;
+    }
+    for (DISKSTATS *ds = first_diskstats(); ds != NULL; ds = next_diskstats(ds)) {
+        trace_event(ds, TRACE_STOP, now, 0);
+    }
+    trace_save(1);
+}
+
+/* replay the records of one disk under the given settings */
+static void sim_run(const TRACE_RECORD *recs, size_t n, DISKSTATS *ds, double spinup_ms, SIM_RESULT *res)
+{
+    LONGLONG start_ft = 0, probe_ft = 0, prev_probe_ft = 0, spindown_ft = 0, last_ft = 0;
+    LONGLONG first_io_ft = 0, last_io_ft = 0;
+    unsigned int ops = 0;
+    ULONGLONG bytes = 0;
+    bool running = false;
+
+    memset(res, 0x00, sizeof(*res));
+    memset(ds->gap_hist, 0x00, sizeof(ds->gap_hist));
+
+    for (size_t i = 0; i <= n; ++i) {
+        const TRACE_RECORD *r = (i < n) ? &recs[i] : NULL;
+        LONGLONG until;
+
+        if (r != NULL && r->drive != ds->drive) {
+            continue;
+        }
+        until = (r != NULL) ? r->time : last_ft;
+
+        /* the probes of the main loop up to this record */
+        while (running && probe_ft <= until) {
+            time_t elapsed = (time_t)((probe_ft - prev_probe_ft) / 10000000);
+            if (ops > 0 && policy_active(ds, ops, bytes, elapsed, false)) {
+                if (ds->spun_down) {
+                    /* the first i/o spun the disk up and waited for it */
+                    res->spinups++;
+                    res->spun_down_secs += (first_io_ft - spindown_ft) / 1e7;
+                    res->delay_ms += spinup_ms;
+                    ds->spun_down = 0;
+                }
+                policy_record(ds, ds->last_io, filetime_to_time(last_io_ft));
+                ds->last_io_ft = last_io_ft;
+                ds->last_io = filetime_to_time(last_io_ft);
+            } else if (!ds->spun_down && policy_spindown(ds, (probe_ft - ds->last_io_ft) / 10000)) {
+                res->spindowns++;
+                ds->spun_down = 1;
+                spindown_ft = probe_ft;
+            }
+            ops = 0;
+            bytes = 0;
+            prev_probe_ft = probe_ft;
+            LONGLONG next = policy_next_probe(ds, probe_ft);
+            probe_ft += ((next > 0) ? next : 1) * 10000;
+        }
+        if (r == NULL) {
+            break;
+        }
+        last_ft = r->time;
+
+        switch (r->event) {
+        case TRACE_IO:
+            if (ops == 0) {
+                first_io_ft = r->time;
+            }
+            ops += r->reads + r->writes;
+            bytes += r->value * 1024ULL;
+            last_io_ft = r->time;
+            break;
+        case TRACE_START:
+        case TRACE_STOP:
+            /* hd-idle stopped recording the disk; what happened meanwhile is unknown */
+            if (running) {
+                res->secs += (r->time - start_ft) / 1e7;
+                if (ds->spun_down) {
+                    res->spun_down_secs += (r->time - spindown_ft) / 1e7;
+                }
+                running = false;
+            }
+            if (r->event == TRACE_START) {
+                start_ft = prev_probe_ft = r->time;
+                ds->last_io_ft = r->time;
+                ds->last_io = filetime_to_time(r->time);
+                ds->spun_down = 0;
+                ops = 0;
+                bytes = 0;
+                probe_ft = r->time + policy_next_probe(ds, r->time) * 10000;
+                running = true;
+            }
+            break;
+        }
+    }
+    if (running) {
+        res->secs += (last_ft - start_ft) / 1e7;
+        if (ds->spun_down) {
+            res->spun_down_secs += (last_ft - spindown_ft) / 1e7;
+        }
+    }
+}
+
+static void sim_print(int idle_time, int break_even, const SIM_RESULT *res)
+{
+    double days = res->secs / 86400;
+    double saved_j = res->spun_down_secs * (SIM_IDLE_WATTS - SIM_STANDBY_WATTS) - res->spinups * SIM_SPINUP_JOULES;
+    char policy[32];
+
+    if (break_even == 0) {
+        strcpy(policy, "fixed");
+    } else {
+        snprintf(policy, sizeof(policy), "-P %d", break_even);
+    }
+    printf("  %7d s  %-9s %12.1f %9.1f %% %14.1f Wh %13.1f s\n", idle_time, policy,
+           res->spinups / days, 100.0 * res->spun_down_secs / res->secs, saved_j / 3600 / days, res->delay_ms / 1000 / days);
+}
+
+/* replay the trace in the given file against a range of policies; returns the exit code */
+int trace_simulate(const char *path)
+{
+    static const int idle_times[] = { 0, 300, 600, 1200, 1800, 3600 };     /* 0: the configured one */
+    LARGE_INTEGER freq, start, end;
+    TRACE_HEADER header;
+    TRACE_RECORD *recs;
+    DISKSTATS *ds;
+    double disk_days = 0, simulated_secs = 0;
+    size_t n;
+    long size;
+    FILE *fp;
+
+    if ((fp = fopen(path, "rb")) == NULL) {
+        fprintf(stderr, "cannot read trace %s\n", path);
+        return 2;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (size < (long)sizeof(header) || fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+        header.version != TRACE_VERSION || header.record_size != sizeof(TRACE_RECORD)) {
+        fprintf(stderr, "%s is not a trace recorded with -R\n", path);
+        fclose(fp);
+        return 2;
+    }
+    n = (size - sizeof(header)) / sizeof(TRACE_RECORD);
+    if ((recs = (TRACE_RECORD*)malloc(n * sizeof(*recs) + 1)) == NULL || (ds = (DISKSTATS*)calloc(1, sizeof(*ds))) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        fclose(fp);
+        return 2;
+    }
+    n = fread(recs, sizeof(*recs), n, fp);
+    fclose(fp);
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+    printf("simulating %s: %zu records; %.0f W idle, %.1f W standby, %.0f J per spin-up\n", path, n,
+           SIM_IDLE_WATTS, SIM_STANDBY_WATTS, SIM_SPINUP_JOULES);
+
+    for (int drive = 0; drive <= 0xff; ++drive) {
+        double spinup_ms = 0;
+        unsigned int spinups = 0, samples = 0;
+        int saved_break_even = policy_break_even;
+        int configured;
+        SIM_RESULT res;
+
+        memset(&res, 0x00, sizeof(res));
+        for (size_t i = 0; i < n; ++i) {
+            if (recs[i].drive == drive) {
+                samples++;
+                if (recs[i].event == TRACE_SPINUP && recs[i].value > 0) {
+                    spinup_ms += recs[i].value;
+                    spinups++;
+                }
+            }
+        }
+        if (samples == 0) {
+            continue;
+        }
+        spinup_ms = (spinups > 0) ? spinup_ms / spinups : SIM_SPINUP_MS;
+
+        memset(ds, 0x00, sizeof(*ds));
+        sprintf(ds->name, "\\\\.\\PhysicalDrive%d", drive);
+        ds->drive = drive;
+        idle_settings(ds);
+        ds->group = -1;
+        configured = ds->idle_time;
+
+        printf("%s: %u records, spin-up latency %.0f ms%s\n", ds->name, samples, spinup_ms, (spinups > 0) ? "" : " (assumed)");
+        printf("  idle time  policy    spin-ups/day  spun down    energy saved/day   delay/day\n");
+        for (size_t t = 0; t < sizeof(idle_times) / sizeof(idle_times[0]); ++t) {
+            if (t > 0 && idle_times[t] == configured) {
+                continue;
+            }
+            ds->idle_time = (t == 0) ? configured : idle_times[t];
+            if (ds->idle_time == 0) {
+                continue;
+            }
+
+            /* the fixed idle time, and the prediction with the given (or the energy) break-even time */
+            for (int predict = 0; predict < 2; ++predict) {
+                policy_break_even = !predict ? 0 :
+                                    (saved_break_even != 0) ? saved_break_even :
+                                    (int)(SIM_SPINUP_JOULES / (SIM_IDLE_WATTS - SIM_STANDBY_WATTS) + 0.5);
+                sim_run(recs, n, ds, spinup_ms, &res);
+                simulated_secs += res.secs;
+                if (res.secs <= 0) {
+                    break;
+                }
+                sim_print(ds->idle_time, policy_break_even, &res);
+            }
+        }
+        policy_break_even = saved_break_even;
+        disk_days += res.secs / 86400;
+    }
+
+    QueryPerformanceCounter(&end);
+    double ms = (double)(end.QuadPart - start.QuadPart) * 1000.0 / (double)freq.QuadPart;
+    printf("simulated %.1f disk-days in %.0f ms (%.0f times real time)\n", disk_days, ms,
+           (ms > 0) ? simulated_secs * 1000 / ms : 0.0);
+    free(recs);
+    free(ds);
+    return 0;
+}
@@ -0,0 +1,205 @@
+/*
+ * volumes.cpp - attribution of disk activity to volumes
+ *
+ * Copyright (c) 2022 RalfOGit
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The disk counters tell that a disk is kept awake, but not by what. With -V,
+ * the volumes of a disk are looked up once after its first probe (again
+ * later if it had none yet, as volumes arrive after their disk: on i/o, at
+ * most every VOLUMES_RETRY seconds or after a device change): every
+ * volume whose IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS includes the disk, so a
+ * volume spanning several disks is attributed to each of them. Every probe
+ * of the disk then also takes the read and write counts of its volumes
+ * (IOCTL_DISK_PERFORMANCE on a volume handle opened without access rights,
+ * which is answered by the volume manager and does not reach the disk).
+ * Whenever i/o resets the idle time of the disk, the volumes that had i/o
+ * since the previous probe are counted and printed with -d; on a Hyper-V
+ * host this names the volume holding the vhdx files that keep the disk
+ * awake. At the default verbosity, only a change of the volume with the most
+ * i/o is reported, so a busy disk does not print a line per probe.
+ */
+
+#include "hd-idle.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define VOLUMES_RETRY       600     /* s between look-ups of a disk without volumes */
+
+int volumes_enabled = 0;
+
+/* display name of a volume: its first mount point without the trailing
+ * backslash (e.g. "D:"), or its guid path if it is not mounted */
+static void volume_display_name(const char *volume, char *name, size_t size)
+{
+    char paths[MAX_PATH];
+    DWORD len = 0;
+    size_t n;
+
+    if (!GetVolumePathNamesForVolumeNameA(volume, paths, sizeof(paths), &len) || paths[0] == '\0') {
+        strncpy(paths, volume, sizeof(paths) - 1);
+        paths[sizeof(paths) - 1] = '\0';
+    }
+    if ((n = strlen(paths)) > 1 && paths[n - 1] == '\\') {
+        paths[n - 1] = '\0';
+    }
+    strncpy(name, paths, size - 1);
+    name[size - 1] = '\0';
+}
+
+/* read and write counts of a volume; false if they are not available */
+static bool volume_counters(HANDLE hVolume, DWORD *reads, DWORD *writes)
+{
+    DISK_PERFORMANCE perf;
+    DWORD cb = 0;
+
+    if (!profile_ioctl(hVolume, IOCTL_DISK_PERFORMANCE, NULL, 0, &perf, sizeof(perf), &cb, NULL) || cb == 0) {
+        return false;
+    }
+    *reads = perf.ReadCount;
+    *writes = perf.WriteCount;
+    return true;
+}
+
+/* look up the volumes on a disk; main thread, while no probe of the disk runs */
+void volumes_map(DISKSTATS *ds)
+{
+    char volume[MAX_PATH];
+    int drives[MAX_DISKS];
+    HANDLE find;
+
+    volumes_unmap(ds);
+    ds->volumes_top = -2;
+    if ((find = FindFirstVolumeA(volume, sizeof(volume))) == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    do {
+        VOLUME_REF *ref;
+        char name[sizeof(ref->name)];
+        size_t len;
+        int n, i;
+
+        volume_display_name(volume, name, sizeof(name));
+
+        /* \\?\Volume{guid}\ -> \\?\Volume{guid}; no access rights, so the disks are not woken up */
+        if ((len = strlen(volume)) > 0 && volume[len - 1] == '\\') {
+            volume[len - 1] = '\0';
+        }
+        HANDLE hVolume = CreateFileA(volume, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+        if (hVolume == INVALID_HANDLE_VALUE) {
+            continue;
+        }
+        n = volume_handle_disks(hVolume, drives, MAX_DISKS);
+        for (i = 0; i < n && drives[i] != ds->drive; ++i);
+        if (i == n || ds->nvolumes == MAX_VOLUMES) {
+            CloseHandle(hVolume);
+            continue;
+        }
+
+        ref = &ds->volumes[ds->nvolumes++];
+        memset(ref, 0x00, sizeof(*ref));
+        strcpy(ref->name, name);
+        ref->h = hVolume;
+        volume_counters(hVolume, &ref->reads, &ref->writes);
+        ref->prev_reads = ref->reads;
+        ref->prev_writes = ref->writes;
+        dprintf("volumes %s: %s%s\n", ds->name, ref->name, (n > 1) ? " (spans several disks)" : "");
+    } while (FindNextVolumeA(find, volume, sizeof(volume)));
+    FindVolumeClose(find);
+    ds->volumes_mapped = 1;
+    ds->volumes_retry = time(NULL) + VOLUMES_RETRY;
+}
+
+/* devices have changed; look up the volumes of disks without any on their next i/o */
+void volumes_changed(void)
+{
+    for (DISKSTATS *ds = first_diskstats(); ds != NULL; ds = next_diskstats(ds)) {
+        ds->volumes_retry = 0;
+    }
+}
+
+/* close the volume handles of a disk */
+void volumes_unmap(DISKSTATS *ds)
+{
+    for (int i = 0; i < ds->nvolumes; ++i) {
+        CloseHandle(ds->volumes[i].h);
+    }
+    ds->nvolumes = 0;
+    ds->volumes_mapped = 0;
+}
+
+/* take the counters of the volumes of a disk; runs on the worker of its probe */
+void volumes_query(DISKSTATS *ds)
+{
+    for (int i = 0; i < ds->nvolumes; ++i) {
+        VOLUME_REF *ref = &ds->volumes[i];
+        volume_counters(ref->h, &ref->reads, &ref->writes);
+    }
+}
+
+/* evaluate the volume counters of a probe; if the disk was found active,
+ * report the volumes that had i/o since the previous probe */
+void volumes_attribute(DISKSTATS *ds, bool active)
+{
+    char line[512];
+    size_t len = 0;
+    DWORD top_ios = 0;
+    int top = -1;
+
+    if (!ds->volumes_mapped) {
+        /* the first probe of the disk; the counters taken now are the baseline */
+        volumes_map(ds);
+        return;
+    }
+    if (active && ds->nvolumes == 0) {
+        /* its volumes may have arrived only after the disk */
+        if (time(NULL) >= ds->volumes_retry) {
+            volumes_map(ds);
+        }
+        dprintf("%s: i/o; no volumes known on this disk\n", ds->name);
+        return;
+    }
+    for (int i = 0; i < ds->nvolumes; ++i) {
+        VOLUME_REF *ref = &ds->volumes[i];
+        DWORD reads = ref->reads - ref->prev_reads;
+        DWORD writes = ref->writes - ref->prev_writes;
+
+        ref->prev_reads = ref->reads;
+        ref->prev_writes = ref->writes;
+        if (!active || (reads == 0 && writes == 0)) {
+            continue;
+        }
+        ref->activity++;
+        if (reads + writes > top_ios) {
+            top_ios = reads + writes;
+            top = i;
+        }
+        if (len < sizeof(line)) {
+            len += snprintf(line + len, sizeof(line) - len, "%s %s (%lu reads, %lu writes)", (len == 0) ? "" : ",",
+                            ref->name, (unsigned long)reads, (unsigned long)writes);
+        }
+    }
+    if (active) {
+        dprintf("%s: i/o on%s\n", ds->name, (len > 0) ? line : " none of its volumes (raw or paging i/o)");
+        if (top != ds->volumes_top) {
+            ds->volumes_top = top;
+            console_printf(V_STATE, "%s: kept awake by %s\n", ds->name,
+                           (top >= 0) ? ds->volumes[top].name : "none of its volumes (raw or paging i/o)");
+        }
+    }
+}